@@ -58,10 +58,23 @@
 #include <math.h>
 #include <usb.h>
 #include <termios.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <dirent.h>
 #include <alsa/asoundlib.h>
 
 #ifdef __linux
@@ -72,6 +85,158 @@
 #include <soundcard.h>
 #endif
 
+#ifndef __linux
+/*!
+ * \brief epoll on top of poll()
+ *	The event loop, the sound thread and the bench threads wait with epoll,
+ *	which only Linux has.  Elsewhere this stand-in keeps each set in a table
+ *	found by a descriptor opened on /dev/null, so that close() works on it
+ *	as on a real epoll descriptor, and waits with poll().  eventfd and
+ *	timerfd come from the system (FreeBSD 13 and 14 on).
+ */
+#define	EPOLLIN			POLLIN
+#define	EPOLLOUT		POLLOUT
+#define	EPOLL_CLOEXEC	O_CLOEXEC
+#define	EPOLL_CTL_ADD	1
+#define	EPOLL_CTL_DEL	2
+#define	EPOLL_MAX_SETS	64
+#define	EPOLL_MAX_FDS	8
+
+typedef union epoll_data {
+	void *ptr;
+	int fd;
+	unsigned int u32;
+	unsigned long long u64;
+} epoll_data_t;
+
+struct epoll_event {
+	unsigned int events;
+	epoll_data_t data;
+};
+
+struct epoll_set {
+	int fd;						/* the /dev/null descriptor plus 1, 0 if never used */
+	int n;
+	struct pollfd pfd[EPOLL_MAX_FDS];
+	epoll_data_t data[EPOLL_MAX_FDS];
+};
+
+static struct epoll_set epoll_sets[EPOLL_MAX_SETS];
+static pthread_mutex_t epoll_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Find the set of an epoll descriptor */
+static struct epoll_set *epoll_set_of(int epfd)
+{
+	int i;
+
+	for (i = 0; i < EPOLL_MAX_SETS; i++) {
+		if (epoll_sets[i].fd == epfd + 1) {
+			return (&epoll_sets[i]);
+		}
+	}
+	return (NULL);
+}
+
+/* A new, empty set; a closed set's descriptor number may come back and takes its slot */
+static int epoll_create1(int flags)
+{
+	struct epoll_set *es;
+	int i, fd;
+
+	fd = open("/dev/null", O_RDONLY | flags);
+	if (fd < 0) {
+		return (-1);
+	}
+	pthread_mutex_lock(&epoll_lock);
+	es = epoll_set_of(fd);
+	for (i = 0; !es && (i < EPOLL_MAX_SETS); i++) {
+		if (!epoll_sets[i].fd) {
+			es = &epoll_sets[i];
+		}
+	}
+	if (es) {
+		es->fd = fd + 1;
+		es->n = 0;
+	}
+	pthread_mutex_unlock(&epoll_lock);
+	if (!es) {
+		close(fd);
+		errno = ENFILE;
+		return (-1);
+	}
+	return (fd);
+}
+
+/* Add or remove a descriptor, plain files are refused as epoll does */
+static int epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev)
+{
+	struct epoll_set *es = epoll_set_of(epfd);
+	struct stat st;
+	int i;
+
+	if (!es) {
+		errno = EBADF;
+		return (-1);
+	}
+	for (i = 0; (i < es->n) && (es->pfd[i].fd != fd); i++) {
+		;
+	}
+	if (op == EPOLL_CTL_DEL) {
+		if (i == es->n) {
+			errno = ENOENT;
+			return (-1);
+		}
+		es->n--;
+		es->pfd[i] = es->pfd[es->n];
+		es->data[i] = es->data[es->n];
+		return (0);
+	}
+	if (i < es->n) {
+		errno = EEXIST;
+		return (-1);
+	}
+	if (fstat(fd, &st) || S_ISREG(st.st_mode)) {
+		errno = EPERM;
+		return (-1);
+	}
+	if (es->n == EPOLL_MAX_FDS) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	es->pfd[es->n].fd = fd;
+	es->pfd[es->n].events = ev->events;
+	es->pfd[es->n].revents = 0;
+	es->data[es->n++] = ev->data;
+	return (0);
+}
+
+/* Wait up to ms (-1 forever), a hang up is reported as readable so the read sees it */
+static int epoll_wait(int epfd, struct epoll_event *evs, int max, int ms)
+{
+	struct epoll_set *es = epoll_set_of(epfd);
+	int i, n, res;
+
+	if (!es) {
+		errno = EBADF;
+		return (-1);
+	}
+	res = poll(es->pfd, es->n, ms);
+	if (res <= 0) {
+		return (res);
+	}
+	for (i = n = 0; (i < es->n) && (n < max); i++) {
+		if (es->pfd[i].revents) {
+			evs[n].events = es->pfd[i].revents & (POLLIN | POLLOUT);
+			if (es->pfd[i].revents & (POLLHUP | POLLERR)) {
+				evs[n].events |= es->pfd[i].events & (POLLIN | POLLOUT);
+			}
+			evs[n++].data = es->data[i];
+		}
+	}
+	return (n);
+}
+#endif
+
 #define C108_VENDOR_ID   	0x0d8c
 #define C108_PRODUCT_ID  	0x000c
 #define C108B_PRODUCT_ID  	0x0012
@@ -94,10 +259,26 @@
 #define HID_RT_INPUT 0x01
 #define HID_RT_OUTPUT 0x02
 
-#define	AUDIO_BLOCKSIZE 4096
+#define HID_INT_EP 0x83			/* interrupt in endpoint of the HID interface */
+#define	HID_TIMEOUT_MS	50			/* one report normally takes 1-2 ms */
+#define	HID_RETRIES		2			/* further attempts after a transient error */
+#define	HID_EEPROM_BUDGET_MS	2000	/* whole EEPROM read or write */
+#define	HIDTRACE_MAGIC		0x54495255	/* "URIT" */
+#define	HIDTRACE_VERSION	1
+#define	HIDTRACE_MAX_REPORTS	10		/* output mismatches printed on replay */
+#define	HIDTRACE_COMMANDS	"igeldmrczqx"	/* menu commands that only need the HID */
+
+#define	GPIO_RING_SIZE 8192		/* transitions buffered by the GPIO sampler, power of 2 */
+
+#define	AUDIO_BLOCKSIZE 4096		/* playback block, stereo S16 */
 #define	AUDIO_SAMPLES_PER_BLOCK (AUDIO_BLOCKSIZE / 4)
+#define	CAPTURE_FRAME_BYTES 2		/* capture is the mono mic input, S16 */
+#define	CAPTURE_BLOCKSIZE (AUDIO_SAMPLES_PER_BLOCK * CAPTURE_FRAME_BYTES)
 #define	NFFT 1024
 #define	NFFTSQRT 10
+#define	FFT_BIN_HZ 46.875		/* 48000 / NFFT */
+#define	FRAMER_BYTES (16 * AUDIO_BLOCKSIZE)	/* capture ring, power of 2 */
+#define	HOP_MIN 64				/* shortest analysis hop, frames */
 
 #define	AUDIO_IN_SETTING 800
 
@@ -110,6 +291,7 @@
 #define MIXER_PARAM_SPKR_PLAYBACK_VOL "Speaker Playback Volume"
 #define	MIXER_PARAM_SPKR_PLAYBACK_SW_NEW "Headphone Playback Switch"
 #define	MIXER_PARAM_SPKR_PLAYBACK_VOL_NEW "Headphone Playback Volume"
+#define	MIXER_SAVED_PARAMS	9		/* controls mixer_setup() changes */
 
 /*!
  * \brief EEPROM memory layout
@@ -150,6 +332,180 @@
 #define STOPBAND_LEVEL		210.0	// was 117.0
 #define PASSBAND_5KHZ_LEVEL	1800.0
 
+/* Soak test */
+#define	SOAK_SEC_BUCKETS	3600	/* 1 hour of 1 second buckets */
+#define	SOAK_MIN_BUCKETS	1440	/* 1 day of 1 minute buckets */
+#define	SOAK_HOUR_BUCKETS	168		/* 1 week of 1 hour buckets */
+#define	SOAK_SETTLE_BLOCKS	48		/* blocks ignored while the stimulus reaches the input */
+#define	SOAK_BASELINE_SECS	10		/* seconds averaged for the reference levels */
+#define	SOAK_MAX_EVENTS		64		/* dropout/drift events kept for the report */
+#define	SOAK_DROPOUT_LEVEL	0.5		/* block level below this fraction of baseline */
+#define	SOAK_DRIFT_LEVEL	0.1		/* minute mean level off by more than 10% */
+#define	SOAK_DRIFT_FREQ		2.0		/* minute mean frequency off by more than 2 Hz */
+#define	SOAK_NOISE_RISE		2.0		/* minute mean noise floor more than 2x (6 dB) */
+
+/* Glitch detector */
+#define	GLITCH_MAX_BLOCK	2048	/* largest block tracked */
+#define	GLITCH_SUB			64		/* residual is checked per 64 samples (1.3 ms) */
+#define	GLITCH_LOCK_BLOCKS	3		/* steady blocks before tracking starts */
+#define	GLITCH_MIN_AMP		200.0	/* smallest tone amplitude (counts) tracked */
+#define	GLITCH_PHASE_STEP	0.05	/* radians between blocks */
+#define	GLITCH_RES_FACTOR	20.0	/* residual burst, times the running residual */
+#define	GLITCH_RES_MIN		0.0001	/* and at least -40 dB below the tone */
+#define	GLITCH_MAX_EVENTS	64		/* glitches kept with their times */
+#define	GLITCH_MAX_SHIFT	480		/* largest shift (samples) resolved with two tones */
+
+/* Shared memory capture ring */
+#define	SHM_MAGIC			0x53495255	/* "URIS" */
+#define	SHM_VERSION			3
+#define	SHM_SLOTS			64			/* 1.4 seconds of blocks */
+
+/* Analog test measurement */
+#define	ANALOG_SETTLE_MAX	1000000	/* us to wait for the stimulus to reach the input */
+#define	ANALOG_WINDOW_BLOCKS	12		/* blocks averaged per measurement (256 ms) */
+#define	ANALOG_MAX_STEPS	32
+#define	ANALOG_TOLERANCE	0.2		/* level limits, +/- 20% of the expected level */
+#define	DIO_SETTLE_MS		100		/* GPIO loopback settling */
+#define	SKEW_MAX_FREQ		3500.0	/* group delay fitted over the passband only */
+#define	LEVWIN_OUTLIER		0.1		/* block off the running mean by more than 10% */
+#define	DIO_GUARD_US		50000	/* audio this long after a GPIO output change may hold a click */
+#define	AUDIO_BLOCK_US		21333	/* one block of audio */
+
+/* Test plans */
+#define	PLAN_MAX_DIO		32		/* digital steps */
+#define	PLAN_MAX_OVR		64		/* chip specific settings */
+#define	PLAN_LINE			256
+
+/* PTT click test */
+#define	CLICK_CYCLES		4		/* PTT key/unkey cycles */
+#define	CLICK_PRE_MS		20		/* analysis window before the GPIO edge */
+#define	CLICK_POST_MS		250		/* analysis window after the GPIO edge */
+#define	CLICK_EMA			0.001	/* baseline tracking rate per sample */
+#define	CLICK_THRESH_FACTOR	8.0		/* step threshold, times the quiet RMS step */
+#define	CLICK_MIN_STEP		64.0	/* smallest step (counts) treated as a transient */
+#define	CLICK_GAP			48		/* samples between steps of the same transient */
+#define	CLICK_MAX_BURSTS	16
+#define	CLICK_LIMIT_DBFS	-40.0	/* transients louder than this are errors */
+
+/* Intermodulation test, all tones centred on analyzer bins */
+#define	IMD_SMPTE_LF		(5 * FFT_BIN_HZ)	/* 234.375 Hz */
+#define	IMD_SMPTE_HF		(63 * FFT_BIN_HZ)	/* 2953.125 Hz, 4:1 below the LF tone */
+#define	IMD_CCIF_F1			(50 * FFT_BIN_HZ)	/* 2343.75 Hz */
+#define	IMD_CCIF_F2			(60 * FFT_BIN_HZ)	/* 2812.5 Hz */
+#define	IMD_SETTLE_BLOCKS	48		/* blocks for the stimulus to reach the input */
+#define	IMD_AVG_BLOCKS		24		/* spectra averaged per measurement (512 ms) */
+#define	IMD_MIN_LEVEL		100.0	/* reference tone must be at least this level */
+#define	IMD_SMPTE_LIMIT		2.0		/* percent */
+#define	IMD_CCIF_LIMIT		-40.0	/* dB below the tones */
+
+/* Spur search */
+#define	SPUR_SETTLE_BLOCKS	48		/* blocks for the stimulus to reach the input */
+#define	SPUR_AVG_BLOCKS		96		/* frames averaged (2 s) */
+#define	SPUR_FREQ			1172.0	/* harmonics 2-5 clear of the 1 kHz USB frame multiples */
+#define	SPUR_HARMONICS		5		/* harmonics left out */
+#define	SPUR_LOBE			2		/* Hann main lobe half width, bins */
+#define	SPUR_FLOOR_BINS		16		/* bins either side for the local noise floor */
+#define	SPUR_MIN_SNR		10.0	/* dB above the local noise floor to be a spur */
+#define	SPUR_MIN_LEVEL		100.0	/* carrier must be at least this level */
+#define	SPUR_LIMIT_DBC		-50.0	/* largest spur allowed */
+#define	SPUR_REPORT			10		/* spurs listed */
+#define	SPUR_MAX			64		/* spurs listed verbose */
+
+/* Gain linearity sweep */
+#define	LIN_FREQ			(22 * FFT_BIN_HZ)	/* 1031.25 Hz, bin centred */
+#define	LIN_STEP_DB			3.0
+#define	LIN_STEPS			21		/* 0 to -60 dB */
+#define	LIN_SETTLE_BLOCKS	48		/* blocks for the stimulus to reach the input */
+#define	LIN_AVG_BLOCKS		4		/* blocks per average */
+#define	LIN_MAX_WINDOWS		12		/* averages per step at most */
+#define	LIN_SETTLE_DB		0.2		/* two averages this close are settled */
+#define	LIN_REF_HI			12.0	/* steps the unity slope line is fitted to, dB down */
+#define	LIN_REF_LO			30.0
+#define	LIN_ERR_SNR			20.0	/* steps this far above the noise are checked */
+#define	LIN_NOISE_SNR		10.0	/* below this the tone is in the noise */
+#define	LIN_LIMIT_DB		0.5		/* largest linearity error */
+
+/* Voice band zoom analyzer */
+#define	ZOOM_DECIM			4		/* 48 kHz to 12 kHz */
+#define	ZOOM_TAPS			64		/* decimating low pass, a multiple of ZOOM_DECIM */
+#define	ZOOM_PHASE_TAPS		(ZOOM_TAPS / ZOOM_DECIM)
+#define	ZOOM_OUT			(AUDIO_SAMPLES_PER_BLOCK / ZOOM_DECIM)	/* decimated samples per block */
+#define	ZOOM_NFFT			1024	/* 85 ms at 12 kHz, one transform every 4 blocks */
+#define	ZOOM_BIN_HZ			(48000.0 / ZOOM_DECIM / ZOOM_NFFT)	/* 11.72 Hz */
+#define	ZOOM_CUTOFF			6000.0	/* -6 dB point, aliases above 8 kHz land beyond 4 kHz */
+#define	ZOOM_NOISE_LO		300.0	/* voice band noise measurement */
+#define	ZOOM_NOISE_HI		3000.0
+
+/* Equalizer fit */
+#define	EQ_KLO				4		/* lowest multitone bin, 187.5 Hz */
+#define	EQ_KHI				85		/* highest, 3984 Hz */
+#define	EQ_PEAK				0.5		/* multitone peak, of full scale */
+#define	EQ_RATE				8000.0	/* the channel driver's audio rate */
+#define	EQ_TAPS				31		/* odd, for a type I linear phase FIR */
+#define	EQ_BAND_LO			300.0	/* band flattened */
+#define	EQ_BAND_HI			3000.0
+#define	EQ_MAX_BOOST		12.0	/* dB */
+#define	EQ_STOP_WEIGHT		0.05	/* fit weight outside the band */
+#define	EQ_RIDGE			1e-4	/* keeps the normal equations well conditioned */
+#define	EQ_SETTLE_BLOCKS	48
+#define	EQ_AVG_BLOCKS		24
+#define	EQ_FILE				"uri_eq.txt"
+
+/* Per-unit calibration cache */
+#define	CAL_MAGIC			0x43495255	/* "URIC" */
+#define	CAL_VERSION			1
+#define	CAL_FILE			".uridiag.cal"	/* in $HOME unless -C is given */
+#define	CAL_NRESP			5		/* frequencies in the response table */
+#define	CAL_REF_FREQ		1004.0
+#define	CAL_PROBE_BLOCKS	6		/* blocks per capture gain probe */
+#define	CAL_SPOT_TOL		0.05	/* spot check level within 5% of the cached one */
+#define	CAL_OFFSET_TOL		64.0	/* and the DC offset within 64 counts */
+#define	CAL_DRIFT_DB		0.5		/* response change the system test points out */
+
+/* Mixer step tables */
+#define	MIX_MAGIC			0x4d495255	/* "URIM" */
+#define	MIX_VERSION			1
+#define	MIX_SUFFIX			".mix"	/* kept next to the calibration cache */
+#define	MIX_MAX_STEPS		256		/* control range 0 to 255 at most */
+#define	MIX_PROBE_BLOCKS	4		/* blocks per step */
+#define	MIX_FLOOR_DB		-100.0
+
+/* USB topology report and bus stress run */
+#define	USB_SYSFS			"/sys/bus/usb/devices"
+#define	TOPO_MAX_DEVS		128		/* devices on the URI's bus */
+#define	TOPO_MAX_CHAIN		8		/* hubs between the URI and the root (USB allows 5) */
+#define	TOPO_FS_PERIODIC	1350	/* bytes per 1 ms frame, 90% of full speed */
+#define	TOPO_HS_PERIODIC	48000	/* bytes per ms, 80% of 8 high speed microframes */
+#define	TOPO_DEEP_CHAIN		2		/* more hubs than this is worth a warning */
+#define	TOPO_STRESS_SECS	60
+
+/* Receive monitor */
+#define	MON_POLL_MS			10		/* COR polling period, polled mode */
+#define	MON_ATTACK_MS		100		/* audio left out after COR opens */
+#define	MON_MIN_MS			250		/* shorter openings are counted as kerchunks */
+#define	MON_VOICE_LO		300.0	/* voice band level */
+#define	MON_VOICE_HI		3000.0
+#define	MON_NOISE_LO		4000.0	/* receiver noise above the voice band */
+#define	MON_NOISE_HI		8000.0
+#define	MON_NTONES			51		/* standard CTCSS tones */
+#define	MON_DECIM			32		/* 48 kHz to 1500 Hz for the CTCSS decoder */
+#define	MON_RATE			(48000.0 / MON_DECIM)
+#define	MON_CTCSS_FC		300.0	/* 4th order low pass ahead of the decimation */
+#define	MON_CTCSS_WIN		1500	/* decimated samples per window, 1 s (1 Hz resolution) */
+#define	MON_CTCSS_SHARE		0.3		/* energy share of the strongest tone to call it decoded */
+
+/* Multiple URI benchmark */
+#define	BENCH_MAX_DEVS		16
+#define	BENCH_SECS			60
+#define	BENCH_FREQ			1004.0
+#define	BENCH_MARK_BLOCKS	96		/* a muted block every 2 s marks the latency */
+#define	BENCH_MARKS			8		/* markers in flight */
+#define	BENCH_MAX_LATENCY	96000	/* frames, a marker not back within 2 s is missed */
+#define	BENCH_LATENCY_TOL	20.0	/* ms a marker may come back off the mean latency */
+#define	BENCH_GAP_LEVEL		0.1		/* a gap is below 10% of the tone peak */
+#define	BENCH_GAP_RUN		48		/* for 1 ms */
+#define	BENCH_MIN_PEAK		500.0	/* smallest tone peak (counts) analyzed */
+
 /* The CM-119B requires manuafacturer specific data  in 
  * memory positions 0 to 50
  */
@@ -172,10 +528,21 @@ char *devtypestrs[] = {"CM108","CM108AH","CM119", "CM119A", "CM119B"} ;
 void cdft(int, int, double *, int *, double *);
 
 float myfreq1 = 0.0, myfreq2 = 0.0, lev = 0.0, lev1 = 0.0, lev2 = 0.0;
+float levnoise = 0.0, measfreq1 = 0.0, measfreq2 = 0.0;
+float myamp1 = 1.0, mymixfreq = 0.0, mymixamp = 0.0;	/* left channel tone scale and a second tone mixed in */
+float *volatile mystim = NULL;	/* periodic left channel stimulus of NFFT frames, replaces the tones */
+int capmax = 0, capset = 0;		/* capture (mic) mixer range and current setting */
+int capdefault = 0;				/* capture setting the pass/fail limits are for */
+int spkrmax = 0, spkrset = 0;	/* playback (speaker) mixer range and current setting */
+char *spkrparam = MIXER_PARAM_SPKR_PLAYBACK_VOL;
 
 unsigned int frags = (((6 * 5) << 16) | 0xc);
+int hop = AUDIO_SAMPLES_PER_BLOCK;		/* frames between analysis frames (-H) */
+int hopsperblock = 1;
 int devtype = 0;
 int devproductid = 0;
+int devbcd = 0;
+char devpath[32];				/* bus/device, as found by device_init() */
 int devnum = -1;
 
 /* Call with:  devnum: alsa major device number, param: ascii Formal
@@ -185,6 +552,20 @@ if only 1 value. Values: 0-99 (percent) or 0-1 for baboon.
 Note: must add -lasound to end of linkage */
 
 int shutdown = 0;
+volatile int soundhold = 0;		/* asks the sound thread to close the device */
+volatile int soundheld = 0;		/* and it has */
+volatile int soundfail = 0;		/* the sound thread could not open the device */
+
+unsigned long long lastout_us = 0;	/* time of the last GPIO output change */
+
+/* Monotonic time in microseconds */
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
 
 /*!
  * \brief Get mixer max value
@@ -294,6 +675,406 @@ static int setamixer(int devnum, char *param, int v1, int v2)
 	return (0);
 }
 
+/*!
+ * \brief Get or put mixer values
+ * 	Reads (or with set, writes) every value of an integer or boolean
+ * 	control, up to two (left and right).
+ *
+ * \param devnum		The sound device number.
+ * \param param			Pointer to the string mixer device name (control).
+ * \param v				The values, two of them.
+ * \param set			Write the values rather than read them.
+ *
+ * \retval 				The number of values, -1 if the control is missing.
+ */
+static int amixer_values(int devnum, char *param, int *v, int set)
+{
+	int i, n;
+	char str[100];
+	snd_hctl_t *hctl;
+	snd_ctl_elem_id_t *id;
+	snd_ctl_elem_value_t *control;
+	snd_hctl_elem_t *elem;
+	snd_ctl_elem_info_t *info;
+
+	sprintf(str, "hw:%d", devnum);
+	if (snd_hctl_open(&hctl, str, 0)) {
+		return (-1);
+	}
+	snd_hctl_load(hctl);
+	snd_ctl_elem_id_alloca(&id);
+	snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
+	snd_ctl_elem_id_set_name(id, param);
+	elem = snd_hctl_find_elem(hctl, id);
+	if (!elem) {
+		snd_hctl_close(hctl);
+		return (-1);
+	}
+	snd_ctl_elem_info_alloca(&info);
+	snd_hctl_elem_info(elem, info);
+	n = snd_ctl_elem_info_get_count(info);
+	if (n > 2) {
+		n = 2;
+	}
+	snd_ctl_elem_value_alloca(&control);
+	snd_ctl_elem_value_set_id(control, id);
+	if (snd_hctl_elem_read(elem, control)) {
+		snd_hctl_close(hctl);
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		if (set) {
+			snd_ctl_elem_value_set_integer(control, i, v[i]);
+		} else {
+			v[i] = snd_ctl_elem_value_get_integer(control, i);
+		}
+	}
+	if (set && snd_hctl_elem_write(elem, control)) {
+		snd_hctl_close(hctl);
+		return (-1);
+	}
+	snd_hctl_close(hctl);
+	return (n);
+}
+
+/*!
+ * \brief HID trace
+ *	With -r every HID transfer attempt (set report, get report, interrupt
+ *	read) is appended to a binary trace with its time, bytes and return
+ *	code, along with every line typed at the menu and prompts.  With -R
+ *	the trace stands in for the unit: transfers return the recorded bytes
+ *	and codes, outputs are checked against the recorded ones, input lines
+ *	come from the trace and the pacing sleeps are skipped, so a session
+ *	runs again at full speed without the unit attached.  Replay covers
+ *	the HID only menu commands; anything needing audio is refused.
+ */
+struct hidtrace_hdr {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int devtype;
+	unsigned int productid;
+	unsigned int bcd;
+};
+
+struct hidtrace_rec {
+	unsigned int t;				/* us since the trace started */
+	unsigned char type;
+	unsigned char len;			/* bytes following */
+	short res;					/* transfer return code */
+};
+
+enum {HIDTRACE_SET, HIDTRACE_GET, HIDTRACE_INT, HIDTRACE_INPUT};
+enum {HIDTRACE_OFF, HIDTRACE_RECORD, HIDTRACE_REPLAY};
+
+struct hidtrace {
+	int mode;
+	FILE *fp;
+	pthread_mutex_t lock;
+	unsigned long long start;
+	struct hidtrace_rec next;	/* replay, record read ahead */
+	unsigned char data[256];
+	int havenext;
+	unsigned long records;
+	unsigned long mismatches;	/* outputs that differ from the recorded ones */
+	unsigned long skipped;		/* recorded transfers the program did not make */
+	unsigned long diverged;		/* transfers of the wrong type */
+};
+
+struct hidtrace hidtrace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static char *hidtrace_types[] = {"set report", "get report", "interrupt read", "input line"};
+
+/* Pacing delay, skipped on replay */
+static void hid_sleep(int us)
+{
+	if (hidtrace.mode != HIDTRACE_REPLAY) {
+		usleep(us);
+	}
+}
+
+/* Start recording into fname */
+static int hidtrace_record(char *fname)
+{
+	struct hidtrace_hdr h;
+
+	hidtrace.fp = fopen(fname, "wb");
+	if (!hidtrace.fp) {
+		printf("Unable to create HID trace %s: %s\n", fname, strerror(errno));
+		return (-1);
+	}
+	memset(&h, 0, sizeof(h));
+	h.magic = HIDTRACE_MAGIC;
+	h.version = HIDTRACE_VERSION;
+	h.devtype = devtype;
+	h.productid = devproductid;
+	h.bcd = devbcd;
+	fwrite(&h, sizeof(h), 1, hidtrace.fp);
+	hidtrace.start = now_us();
+	hidtrace.records = hidtrace.mismatches = hidtrace.skipped = hidtrace.diverged = 0;
+	hidtrace.havenext = 0;
+	hidtrace.mode = HIDTRACE_RECORD;
+	return (0);
+}
+
+/* Append one record */
+static void hidtrace_put(int type, void *data, int len, int res)
+{
+	struct hidtrace_rec r;
+
+	pthread_mutex_lock(&hidtrace.lock);
+	r.t = now_us() - hidtrace.start;
+	r.type = type;
+	r.len = len;
+	r.res = res;
+	fwrite(&r, sizeof(r), 1, hidtrace.fp);
+	fwrite(data, len, 1, hidtrace.fp);
+	hidtrace.records++;
+	pthread_mutex_unlock(&hidtrace.lock);
+}
+
+/* Read the next record ahead, returns -1 at the end of the trace */
+static int hidtrace_peek(void)
+{
+	if (!hidtrace.havenext) {
+		if ((fread(&hidtrace.next, sizeof(hidtrace.next), 1, hidtrace.fp) != 1) ||
+			(fread(hidtrace.data, 1, hidtrace.next.len, hidtrace.fp) != hidtrace.next.len)) {
+			return (-1);
+		}
+		hidtrace.havenext = 1;
+	}
+	return (0);
+}
+
+/* Open fname for replay, the unit it was recorded on becomes the one under test */
+static int hidtrace_replay(char *fname)
+{
+	struct hidtrace_hdr h;
+
+	hidtrace.fp = fopen(fname, "rb");
+	if (!hidtrace.fp) {
+		printf("Unable to open HID trace %s: %s\n", fname, strerror(errno));
+		return (-1);
+	}
+	if ((fread(&h, sizeof(h), 1, hidtrace.fp) != 1) || (h.magic != HIDTRACE_MAGIC) ||
+		(h.version != HIDTRACE_VERSION) || (h.devtype >= sizeof(devtypestrs) / sizeof(devtypestrs[0]))) {
+		printf("%s is not a HID trace from this version\n", fname);
+		fclose(hidtrace.fp);
+		return (-1);
+	}
+	devtype = h.devtype;
+	devproductid = h.productid;
+	devbcd = h.bcd;
+	hidtrace.start = now_us();
+	hidtrace.records = hidtrace.mismatches = hidtrace.skipped = hidtrace.diverged = 0;
+	hidtrace.havenext = 0;
+	hidtrace.mode = HIDTRACE_REPLAY;
+	printf("Replaying HID trace %s, recorded on a %s\n", fname, devtypestrs[devtype]);
+	return (0);
+}
+
+/*
+ * Replay one transfer of type into buf, returns the recorded code.  The
+ * unit stops answering where the trace ends or expects a typed line.
+ */
+static int hidtrace_transfer(int type, unsigned char *buf)
+{
+	int res;
+
+	pthread_mutex_lock(&hidtrace.lock);
+	if (hidtrace_peek() || (hidtrace.next.type == HIDTRACE_INPUT)) {
+		pthread_mutex_unlock(&hidtrace.lock);
+		return (-ENODEV);
+	}
+	if ((hidtrace.next.type != type) || (hidtrace.next.len != 4)) {
+		if (!hidtrace.diverged++) {
+			printf("HID replay diverged at record %lu: the program made a %s, the trace has a %s\n",
+				   hidtrace.records, hidtrace_types[type], hidtrace_types[hidtrace.next.type & 3]);
+		}
+		pthread_mutex_unlock(&hidtrace.lock);
+		return (-ENODEV);
+	}
+	if (type == HIDTRACE_SET) {
+		if (memcmp(buf, hidtrace.data, 4) && (hidtrace.mismatches++ < HIDTRACE_MAX_REPORTS)) {
+			printf("HID replay record %lu: set report %02x %02x %02x %02x, recorded %02x %02x %02x %02x\n",
+				   hidtrace.records, buf[0], buf[1], buf[2], buf[3], hidtrace.data[0], hidtrace.data[1],
+				   hidtrace.data[2], hidtrace.data[3]);
+		}
+	} else {
+		memcpy(buf, hidtrace.data, 4);
+	}
+	res = hidtrace.next.res;
+	hidtrace.havenext = 0;
+	hidtrace.records++;
+	pthread_mutex_unlock(&hidtrace.lock);
+	return (res);
+}
+
+/* Read a line typed at the menu or a prompt, recorded or replayed */
+static char *input_line(char *str, int len)
+{
+	if (hidtrace.mode == HIDTRACE_REPLAY) {
+		/* transfers the program did not make this time */
+		while (!hidtrace_peek() && (hidtrace.next.type != HIDTRACE_INPUT)) {
+			hidtrace.skipped++;
+			hidtrace.havenext = 0;
+		}
+		if (hidtrace_peek()) {
+			return (NULL);
+		}
+		len = (hidtrace.next.len < len - 1) ? hidtrace.next.len : len - 1;
+		memcpy(str, hidtrace.data, len);
+		str[len] = 0;
+		hidtrace.havenext = 0;
+		printf("%s", str);
+		return (str);
+	}
+	if (!fgets(str, len, stdin)) {
+		return (NULL);
+	}
+	if (hidtrace.mode == HIDTRACE_RECORD) {
+		hidtrace_put(HIDTRACE_INPUT, str, (strlen(str) < 255) ? strlen(str) : 255, 0);
+	}
+	return (str);
+}
+
+/* Finish recording or replay, returns nonzero if a replay did not match */
+static int hidtrace_close(void)
+{
+	int res = 0;
+
+	if (hidtrace.mode == HIDTRACE_RECORD) {
+		fclose(hidtrace.fp);
+		printf("HID trace: %lu record(s)\n", hidtrace.records);
+	} else if (hidtrace.mode == HIDTRACE_REPLAY) {
+		while (!hidtrace_peek()) {
+			hidtrace.skipped += (hidtrace.next.type != HIDTRACE_INPUT);
+			hidtrace.havenext = 0;
+		}
+		fclose(hidtrace.fp);
+		printf("HID replay: %lu transfer(s) in %.1f ms, %lu output mismatch(es), %lu diverged, "
+			   "%lu recorded transfer(s) not made\n", hidtrace.records, (now_us() - hidtrace.start) / 1000.0,
+			   hidtrace.mismatches, hidtrace.diverged, hidtrace.skipped);
+		res = (hidtrace.mismatches || hidtrace.diverged || hidtrace.skipped);
+	}
+	hidtrace.mode = HIDTRACE_OFF;
+	return (res);
+}
+
+/*!
+ * \brief HID transfer state
+ *	Every report transfer has a short deadline and its result is checked.
+ *	Timeouts, stalls and short transfers are retried a bounded number of
+ *	times; an unplugged device is not.  A multi-transfer operation (an
+ *	EEPROM read, say) can also set an overall budget with hid_begin().
+ *
+ *	The first failure is reported and latched: every later transfer fails
+ *	at once, so a dead unit costs milliseconds instead of a 5 second
+ *	timeout per call.  The latch is cleared before each menu command.
+ */
+struct hid_state {
+	int failed;					/* latched failure */
+	unsigned long long deadline;	/* operation budget, 0 for none */
+	unsigned long transfers;
+	unsigned long retries;
+};
+
+struct hid_state hid;
+
+/* Start an operation that must complete within ms */
+static void hid_begin(int ms)
+{
+	if (!hid.deadline) {
+		hid.deadline = now_us() + ms * 1000ULL;
+	}
+}
+
+/* End an operation */
+static int hid_end(void)
+{
+	hid.deadline = 0;
+	return (hid.failed ? -1 : 0);
+}
+
+/* Clear a latched failure */
+static void hid_clear(void)
+{
+	hid.failed = 0;
+	hid.deadline = 0;
+}
+
+/* Latch a failure and say why */
+static void hid_fail(char *what, int res, int attempts, unsigned long long start)
+{
+	if (!hid.failed) {
+		printf("USB HID %s failed: %s (%d attempt(s), %.1f ms), the unit is not responding\n", what,
+			   (res < 0) ? strerror(-res) : "short transfer", attempts, (now_us() - start) / 1000.0);
+	}
+	hid.failed = 1;
+}
+
+/* One report transfer with deadline and retries, returns 0 on success */
+static int hid_transfer(struct usb_dev_handle *handle, int in, unsigned char *buf)
+{
+	unsigned long long start, now;
+	int res = 0, attempt, timeout;
+
+	if (hid.failed) {
+		return (-1);
+	}
+	start = now_us();
+	for (attempt = 0; attempt <= HID_RETRIES; attempt++) {
+		timeout = HID_TIMEOUT_MS;
+		if (hid.deadline) {
+			now = now_us();
+			if (now >= hid.deadline) {
+				hid_fail("operation", -ETIMEDOUT, attempt, start);
+				return (-1);
+			}
+			if ((hid.deadline - now) / 1000 < timeout) {
+				timeout = (hid.deadline - now) / 1000 + 1;
+			}
+		}
+		hid.transfers++;
+		if (hidtrace.mode == HIDTRACE_REPLAY) {
+			res = hidtrace_transfer((in) ? HIDTRACE_GET : HIDTRACE_SET, buf);
+		} else if (in) {
+			res = usb_control_msg(handle, USB_ENDPOINT_IN + USB_TYPE_CLASS + USB_RECIP_INTERFACE,
+								  HID_REPORT_GET, 0 + (HID_RT_INPUT << 8), 3, (char *) buf, 4, timeout);
+		} else {
+			res = usb_control_msg(handle, USB_ENDPOINT_OUT + USB_TYPE_CLASS + USB_RECIP_INTERFACE,
+								  HID_REPORT_SET, 0 + (HID_RT_OUTPUT << 8), 3, (char *) buf, 4, timeout);
+		}
+		if (hidtrace.mode == HIDTRACE_RECORD) {
+			hidtrace_put((in) ? HIDTRACE_GET : HIDTRACE_SET, buf, 4, res);
+		}
+		if (res == 4) {
+			return (0);
+		}
+		if ((res == -ENODEV) || (res == -ENOENT) || (res == -ESHUTDOWN)) {
+			break;				/* unplugged, retrying cannot help */
+		}
+		hid.retries++;
+		hid_sleep(1000);
+	}
+	hid_fail((in) ? "get report" : "set report", res, attempt + (attempt <= HID_RETRIES), start);
+	return (-1);
+}
+
+/* Wait up to ms for an input report on the interrupt endpoint */
+static int hid_interrupt_read(struct usb_dev_handle *handle, unsigned char *buf, int ms)
+{
+	int res;
+
+	if (hidtrace.mode == HIDTRACE_REPLAY) {
+		return (hidtrace_transfer(HIDTRACE_INT, buf));
+	}
+	res = usb_interrupt_read(handle, HID_INT_EP, (char *) buf, 4, ms);
+	if ((hidtrace.mode == HIDTRACE_RECORD) && (res != -ETIMEDOUT)) {
+		hidtrace_put(HIDTRACE_INT, buf, 4, res);
+	}
+	return (res);
+}
+
 /*!
  * \brief Set USB HID outputs
  * 	This routine, depending on the outputs passed can set the GPIO states 
@@ -303,18 +1084,20 @@ static int setamixer(int devnum, char *param, int v1, int v2)
  *
  * \param handle		Pointer to usb_dev_handle associated with the HID.
  * \param outputs		Pointer to buffer that contains the data to send to the HID.
+ *
+ * \retval				0 on success, -1 if the transfer failed.
  */
-static void set_outputs(struct usb_dev_handle *handle, unsigned char *outputs)
+static int set_outputs(struct usb_dev_handle *handle, unsigned char *outputs)
 {
-	usleep(1500);
-	usb_control_msg(handle,
-					USB_ENDPOINT_OUT + USB_TYPE_CLASS + USB_RECIP_INTERFACE,
-					HID_REPORT_SET,
-					0 + (HID_RT_OUTPUT << 8), 3, (char *) outputs, 4, 5000);
+	if (hid.failed) {
+		return (-1);
+	}
+	hid_sleep(1500);
+	return (hid_transfer(handle, 0, outputs));
 }
 
-/* Set USB outputs */
-static void setout(struct usb_dev_handle *usb_handle, unsigned char c)
+/* Set USB outputs, without waiting for them to settle */
+static void setout_nowait(struct usb_dev_handle *usb_handle, unsigned char c)
 {
 	unsigned char buf[4];
 
@@ -326,7 +1109,27 @@ static void setout(struct usb_dev_handle *usb_handle, unsigned char c)
 	}
 	buf[1] = c;					/* set GPIO 1,3,4 (5,7) outputs appropriately */
 	set_outputs(usb_handle, buf);
-	usleep(100000);
+	lastout_us = now_us();
+}
+
+/* Set USB outputs and give the loopback time to follow */
+static void setout(struct usb_dev_handle *usb_handle, unsigned char c)
+{
+	setout_nowait(usb_handle, c);
+	hid_sleep(100000);
+}
+
+/*!
+ * \brief Read USB HID inputs
+ * 	Issues the GET_REPORT for the input report without any pacing delay.
+ *	Used where the inputs are sampled as fast as the transport allows.
+ *
+ * \param handle		Pointer to usb_dev_handle associated with the HID.
+ * \param inputs		Pointer to buffer that will contain the data received from the HID.
+ */
+static int read_inputs(struct usb_dev_handle *handle, unsigned char *inputs)
+{
+	return (hid_transfer(handle, 1, inputs));
 }
 
 /*!
@@ -338,22 +1141,28 @@ static void setout(struct usb_dev_handle *usb_handle, unsigned char c)
  * \param handle		Pointer to usb_dev_handle associated with the HID.
  * \param inputs		Pointer to buffer that will contain the data received from the HID.
  */
-static void get_inputs(struct usb_dev_handle *handle, unsigned char *inputs)
+static int get_inputs(struct usb_dev_handle *handle, unsigned char *inputs)
 {
-	usleep(1500);
-	usb_control_msg(handle,
-					USB_ENDPOINT_IN + USB_TYPE_CLASS + USB_RECIP_INTERFACE,
-					HID_REPORT_GET, 0 + (HID_RT_INPUT << 8), 3, (char *) inputs, 4, 5000);
+	if (hid.failed) {
+		return (-1);
+	}
+	hid_sleep(1500);
+	return (read_inputs(handle, inputs));
 }
 
-/* Set USB inputs */
-unsigned char getin(struct usb_dev_handle *usb_handle)
-{
-	unsigned char buf[4];
+/*!
+ * \brief Decode a HID input report
+ * 	Converts the 4 byte input report (from a GET_REPORT or from the interrupt
+ *	endpoint) into the GPIO/COR/CTCSS bitfield returned by getin().
+ *
+ * \param buf			Pointer to the 4 byte input report.
+ *
+ * \retval 				The input bitfield.
+ */
+static unsigned char inputs_to_bits(unsigned char *buf)
+{
 	unsigned short c;
 
-	buf[0] = buf[1] = 0;
-	get_inputs(usb_handle, buf);
 	c = buf[1] & 0xf;
 	c += (buf[0] & 3) << 4;
 	if (devtype == DEV_C119 || devtype == DEV_C119A || devtype == DEV_C119B) {
@@ -369,6 +1178,16 @@ unsigned char getin(struct usb_dev_handle *usb_handle)
 	return (c);
 }
 
+/* Set USB inputs */
+unsigned char getin(struct usb_dev_handle *usb_handle)
+{
+	unsigned char buf[4];
+
+	buf[0] = buf[1] = 0;
+	get_inputs(usb_handle, buf);
+	return (inputs_to_bits(buf));
+}
+
 /*!
  * \brief Read CM-xxx EEPROM
  * 	Read a memory position from the EEPROM attached to the CM-XXX device.
@@ -389,15 +1208,18 @@ static unsigned short read_eeprom(struct usb_dev_handle *usb_handle, int addr)
 {
 	unsigned char buf[4];
 
+	if (hid.failed) {
+		return (0);
+	}
 	buf[0] = 0x80;
 	buf[1] = 0;
 	buf[2] = 0;
 	buf[3] = 0x80 | (addr & 0x3f);
 
-	usleep(500);
+	hid_sleep(500);
 	set_outputs(usb_handle, buf);
 	memset(buf, 0, sizeof(buf));
-	usleep(500);
+	hid_sleep(500);
 	get_inputs(usb_handle, buf);
 
 	return (buf[1] + (buf[2] << 8));
@@ -424,9 +1246,11 @@ static unsigned short get_eeprom(struct usb_dev_handle *handle, unsigned short *
 	unsigned short cs;
 
 	cs = 0xffff;
+	hid_begin(HID_EEPROM_BUDGET_MS);
 	for (i = EEPROM_START_ADDR; i <= EEPROM_START_ADDR + EEPROM_USER_CS_ADDR; i++) {
 		cs += buf[i - EEPROM_START_ADDR] = read_eeprom(handle, i);
 	}
+	hid_end();
 
 	return (cs);
 }
@@ -447,9 +1271,11 @@ static void get_eeprom_dump(struct usb_dev_handle *handle, unsigned short *buf)
 {
 	int i;
 
+	hid_begin(HID_EEPROM_BUDGET_MS);
 	for (i = 0; i < EEPROM_PHYSICAL_LEN; i++) {
 		buf[i] = read_eeprom(handle, i);
 	}
+	hid_end();
 }
 
 /*!
@@ -474,12 +1300,15 @@ static void write_eeprom(struct usb_dev_handle *usb_handle, int addr, unsigned s
 {
 	unsigned char buf[4];
 
+	if (hid.failed) {
+		return;
+	}
 	buf[0] = 0x80;
 	buf[1] = data & 0xff;
 	buf[2] = data >> 8;
 	buf[3] = 0xc0 | (addr & 0x3f);
 
-	usleep(2000);
+	hid_sleep(2000);
 	set_outputs(usb_handle, buf);
 }
 
@@ -503,13 +1332,15 @@ static void put_eeprom(struct usb_dev_handle *handle, unsigned short *buf)
 
 	cs = 0xffff;
 	buf[EEPROM_USER_MAGIC_ADDR] = EEPROM_MAGIC;
+	hid_begin(HID_EEPROM_BUDGET_MS);
 	for (i = EEPROM_START_ADDR; i < EEPROM_START_ADDR + EEPROM_USER_CS_ADDR; i++) {
 		write_eeprom(handle, i, buf[i - EEPROM_START_ADDR]);
 		cs += buf[i];
 	}
 	buf[EEPROM_USER_CS_ADDR] = (65535 - cs) + 1;
-	usleep(2000);
+	hid_sleep(2000);
 	write_eeprom(handle, i, buf[EEPROM_USER_CS_ADDR]);
+	hid_end();
 }
 
 /*!
@@ -526,9 +1357,13 @@ static void put_eeprom_mfg_data(struct usb_dev_handle *handle)
 {
 	int i;
 
-	for (i = 0; i < sizeof(cm119b_manufacturer_data); i++) {
+	hid_begin(HID_EEPROM_BUDGET_MS);
+	for (i = 0; i < sizeof(cm119b_manufacturer_data) / sizeof(cm119b_manufacturer_data[0]); i++) {
 		write_eeprom(handle, i, cm119b_manufacturer_data[i]);
 	}
+	if (hid_end()) {
+		return;
+	}
 	
 	printf("CM-119B Manufacturer data updated.\n");
 }
@@ -538,10 +1373,91 @@ static void erase_eeprom(struct usb_dev_handle *handle)
 {
 	int	i;
 	
+	hid_begin(HID_EEPROM_BUDGET_MS);
 	for (i = 0; i < EEPROM_PHYSICAL_LEN; i++)
 	{
 		write_eeprom(handle, i, 0x00);
 	}
+	hid_end();
+}
+
+/* Is this a USB device known to work with this application */
+static int uri_match(struct usb_device *dev)
+{
+	return ((dev->descriptor.idVendor == C108_VENDOR_ID) &&
+			(((dev->descriptor.idProduct & 0xfffc) == C108_PRODUCT_ID) ||
+			 (dev->descriptor.idProduct == C108B_PRODUCT_ID) ||
+			 (dev->descriptor.idProduct == C108AH_PRODUCT_ID) ||
+			 (dev->descriptor.idProduct == C119A_PRODUCT_ID) ||
+			 (dev->descriptor.idProduct == C119B_PRODUCT_ID) ||
+			 ((dev->descriptor.idProduct & 0xff00) == N1KDO_PRODUCT_ID) ||
+			 (dev->descriptor.idProduct == C119_PRODUCT_ID)));
+}
+
+/* Chip type from the product ID */
+static int uri_type(struct usb_device *dev)
+{
+	if (dev->descriptor.idProduct == C108AH_PRODUCT_ID) {
+		return (DEV_C108AH);
+	} else if (dev->descriptor.idProduct == C119_PRODUCT_ID) {
+		return (DEV_C119);
+	} else if (dev->descriptor.idProduct == C119A_PRODUCT_ID) {
+		return (DEV_C119A);
+	} else if (dev->descriptor.idProduct == C119B_PRODUCT_ID) {
+		return (DEV_C119B);
+	}
+	return (DEV_C108);
+}
+
+/* Sound card number of the USB device at devstr (bus/device), -1 if it has none */
+static int uri_card(char *devstr)
+{
+	char str[200], desdev[200], *cp;
+	int i;
+	FILE *fp;
+
+	for (i = 0; i < 32; i++) {
+		sprintf(str, "/proc/asound/card%d/usbbus", i);
+		fp = fopen(str, "r");
+		if (!fp) {
+			continue;
+		}
+		if ((!fgets(desdev, sizeof(desdev) - 1, fp)) || (!desdev[0])) {
+			fclose(fp);
+			continue;
+		}
+		fclose(fp);
+		if (desdev[strlen(desdev) - 1] == '\n')
+			desdev[strlen(desdev) - 1] = 0;
+		if (strcasecmp(desdev, devstr)) {
+			continue;
+		}
+		if (i) {
+			sprintf(str, "/sys/class/sound/dsp%d/device", i);
+		} else {
+			strcpy(str, "/sys/class/sound/dsp/device");
+		}
+		memset(desdev, 0, sizeof(desdev));
+		if (readlink(str, desdev, sizeof(desdev) - 1) == -1) {
+			sprintf(str, "/sys/class/sound/controlC%d/device", i);
+			memset(desdev, 0, sizeof(desdev));
+			if (readlink(str, desdev, sizeof(desdev) - 1) == -1) {
+				continue;
+			}
+		}
+		cp = strrchr(desdev, '/');
+		if (cp) {
+			*cp = 0;
+		} else {
+			continue;
+		}
+		cp = strrchr(desdev, '/');
+		if (!cp) {
+			continue;
+		}
+		return (i);
+	}
+	return (-1);
 }
 
 /*!
@@ -557,84 +1473,27 @@ static struct usb_device *device_init(void)
 {
 	struct usb_bus *usb_bus;
 	struct usb_device *dev;
-	char devstr[10000], str[200], desdev[200], *cp;
+	char devstr[10000];
 	int i;
-	FILE *fp;
 
 	usb_init();
 	usb_find_busses();
 	usb_find_devices();
 	for (usb_bus = usb_busses; usb_bus; usb_bus = usb_bus->next) {
 		for (dev = usb_bus->devices; dev; dev = dev->next) {
-			if ((dev->descriptor.idVendor == C108_VENDOR_ID) &&
-				(((dev->descriptor.idProduct & 0xfffc) == C108_PRODUCT_ID) ||
-				 (dev->descriptor.idProduct == C108B_PRODUCT_ID) ||
-				 (dev->descriptor.idProduct == C108AH_PRODUCT_ID) ||
-				 (dev->descriptor.idProduct == C119A_PRODUCT_ID) ||
-				 (dev->descriptor.idProduct == C119B_PRODUCT_ID) ||
-				 ((dev->descriptor.idProduct & 0xff00) == N1KDO_PRODUCT_ID) ||
-				 (dev->descriptor.idProduct == C119_PRODUCT_ID))) {
+			if (uri_match(dev)) {
 				sprintf(devstr, "%s/%s", usb_bus->dirname, dev->filename);
-
-				for (i = 0; i < 32; i++) {
-					sprintf(str, "/proc/asound/card%d/usbbus", i);
-					fp = fopen(str, "r");
-					if (!fp) {
-						continue;
-					}
-					if ((!fgets(desdev, sizeof(desdev) - 1, fp)) || (!desdev[0])) {
-						fclose(fp);
-						continue;
-					}
-					fclose(fp);
-					if (desdev[strlen(desdev) - 1] == '\n')
-						desdev[strlen(desdev) - 1] = 0;
-					if (strcasecmp(desdev, devstr)) {
-						continue;
-					}
-					if (i) {
-						sprintf(str, "/sys/class/sound/dsp%d/device", i);
-					} else {
-						strcpy(str, "/sys/class/sound/dsp/device");
-					}
-					memset(desdev, 0, sizeof(desdev));
-					if (readlink(str, desdev, sizeof(desdev) - 1) == -1) {
-						sprintf(str, "/sys/class/sound/controlC%d/device", i);
-						memset(desdev, 0, sizeof(desdev));
-						if (readlink(str, desdev, sizeof(desdev) - 1) == -1) {
-							continue;
-						}
-					}
-					cp = strrchr(desdev, '/');
-					if (cp) {
-						*cp = 0;
-					} else {
-						continue;
-					}
-					cp = strrchr(desdev, '/');
-					if (!cp) {
-						continue;
-					}
-					cp++;
-					break;
-				}
-				if (i >= 32) {
+				i = uri_card(devstr);
+				if (i < 0) {
 					continue;
 				}
-				devtype = DEV_C108;
 				devproductid = dev->descriptor.idProduct;
-				if (dev->descriptor.idProduct == C108AH_PRODUCT_ID) {
-					devtype = DEV_C108AH;
-				} else if (dev->descriptor.idProduct == C119_PRODUCT_ID) {
-					devtype = DEV_C119;
-				} else if (dev->descriptor.idProduct == C119A_PRODUCT_ID) {
-					devtype = DEV_C119A;
-				} else if (dev->descriptor.idProduct == C119B_PRODUCT_ID) {
-					devtype = DEV_C119B;
-				}
+				devbcd = dev->descriptor.bcdDevice;
+				devtype = uri_type(dev);
 
 				printf("Found %s USB Radio Interface at %s\n", devtypestrs[devtype],
 					   devstr);
+				sprintf(devpath, "%03d/%03d", atoi(usb_bus->dirname) & 0xfff, atoi(dev->filename) & 0xfff);
 				devnum = i;
 				return dev;
 			}
@@ -643,6 +1502,20 @@ static struct usb_device *device_init(void)
 	return NULL;
 }
 
+/* Set the capture (mic) mixer level */
+static void capture_set(int v)
+{
+	setamixer(devnum, MIXER_PARAM_MIC_CAPTURE_VOL, v, 0);
+	capset = v;
+}
+
+/* Set the playback (speaker) mixer level, both channels */
+static void playback_set(int v)
+{
+	setamixer(devnum, spkrparam, v, v);
+	spkrset = v;
+}
+
 /* Evaluate the integer and return "1" or "0" */
 static inline char *baboons(int v)
 {
@@ -653,43 +1526,512 @@ static inline char *baboons(int v)
 }
 
 /* Print errors that were encountered */
-static int dioerror(unsigned char got, unsigned char should)
+static int dioerror(FILE *fp, unsigned char got, unsigned char should)
 {
 	unsigned char err = got ^ should;
 	int n = 0;
 
 	if (err & 0x2) {
-		printf("Error on GPIO1/GPIO2, got %s, should be %s\n",
+		fprintf(fp, "Error on GPIO1/GPIO2, got %s, should be %s\n",
 			   baboons(got & 2), baboons(should & 2));
 		n++;
 	}
 	if (err & 0x10) {
-		printf("Error on GPIO3/PTT/COR IN, got %s, should be %s\n",
+		fprintf(fp, "Error on GPIO3/PTT/COR IN, got %s, should be %s\n",
 			   baboons(got & 0x10), baboons(should & 0x10));
 		n++;
 	}
 	if (err & 0x40) {
-		printf("Error on GPIO5/GPIO7, got %s, should be %s\n",
+		fprintf(fp, "Error on GPIO5/GPIO7, got %s, should be %s\n",
 			   baboons(got & 0x40), baboons(should & 0x40));
 		n++;
 	}
 	if (err & 0x80) {
-		printf("Error on GPIO5/GPIO7, got %s, should be %s\n",
+		fprintf(fp, "Error on GPIO5/GPIO7, got %s, should be %s\n",
 			   baboons(got & 0x80), baboons(should & 0x80));
 		n++;
 	}
 	return (n);
 }
 
-/* Test output */
-static int testio(struct usb_dev_handle *usb_handle, unsigned char toout,
-				  unsigned char toexpect)
+/* Prompt for a line of input, strip the newline */
+static char *prompt_str(char *prompt, char *str, int len)
 {
-	unsigned char c;
+	char *cp;
+
+	printf("%s", prompt);
+	fflush(stdout);
+	str[0] = 0;
+	if (!input_line(str, len - 1)) {
+		str[0] = 0;
+	}
+	cp = strchr(str, '\n');
+	if (cp) {
+		*cp = 0;
+	}
+	return (str);
+}
+
+/*!
+ * \brief Event loop
+ *	One epoll set carries everything the user interface and the tests wait
+ *	for: key presses on stdin, a timerfd, an eventfd the sound thread bumps
+ *	for every analyzed block and an eventfd the GPIO sampler bumps for every
+ *	input transition.  Tests are written as state machines that react to
+ *	these events instead of sleeping for fixed times.
+ *
+ *	stdin is only in the set between kbd_nowait() and kbd_wait(), so typed
+ *	ahead lines are left for the menu and the prompts.  A key press is
+ *	latched until ev_key() takes it, so nothing is lost while a test is
+ *	waiting for something else.
+ */
+enum {EV_KEY = 1, EV_BLOCK = 2, EV_TIMER = 4, EV_GPIO = 8, EV_HIDTIMER = 16};
+
+struct evloop {
+	int epfd;
+	int timerfd;
+	int hidtimerfd;				/* for HID side steps running alongside audio ones */
+	int blockfd;				/* analyzed blocks, from the sound thread */
+	int gpiofd;					/* input transitions, from the GPIO sampler */
+	int wakefd;					/* wakes the sound thread for shutdown or a hold */
+	int haskbd;					/* stdin is in the set */
+	int keyhit;
+	int key;
+	unsigned long blocks;		/* analyzed blocks counted so far */
+};
+
+struct evloop evl = { .epfd = -1, .timerfd = -1, .hidtimerfd = -1, .blockfd = -1, .gpiofd = -1, .wakefd = -1 };
+
+/* Create the event loop */
+static int evloop_init(struct evloop *el)
+{
+	struct epoll_event ev;
+
+	el->epfd = epoll_create1(EPOLL_CLOEXEC);
+	el->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	el->hidtimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	el->blockfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	el->gpiofd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	el->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((el->epfd < 0) || (el->timerfd < 0) || (el->hidtimerfd < 0) || (el->blockfd < 0) || (el->gpiofd < 0) || (el->wakefd < 0)) {
+		printf("Unable to create event loop: %s\n", strerror(errno));
+		return (-1);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = EV_TIMER;
+	epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->timerfd, &ev);
+	ev.data.u32 = EV_HIDTIMER;
+	epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->hidtimerfd, &ev);
+	ev.data.u32 = EV_BLOCK;
+	epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->blockfd, &ev);
+	ev.data.u32 = EV_GPIO;
+	epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->gpiofd, &ev);
+	return (0);
+}
+
+/* Watch stdin for key presses, or leave it to line input */
+static void ev_kbd(struct evloop *el, int on)
+{
+	struct epoll_event ev;
+
+	if (on && !el->haskbd) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = EV_KEY;
+		/* fails if stdin is a plain file, key presses are then never seen */
+		el->haskbd = !epoll_ctl(el->epfd, EPOLL_CTL_ADD, fileno(stdin), &ev);
+	} else if (!on && el->haskbd) {
+		epoll_ctl(el->epfd, EPOLL_CTL_DEL, fileno(stdin), NULL);
+		el->haskbd = 0;
+	}
+}
+
+/* Bump an eventfd (any thread) */
+static void ev_signal(int fd)
+{
+	unsigned long long one = 1;
+
+	if (fd >= 0) {
+		if (write(fd, &one, sizeof(one)) < 0) {
+			return;				/* counter saturated, the waiter is behind anyway */
+		}
+	}
+}
+
+/* Arm the timer, once or periodically; 0 stops it */
+static void ev_timer(struct evloop *el, int ms, int periodic)
+{
+	struct itimerspec its;
+	unsigned long long junk;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (periodic) {
+		its.it_interval = its.it_value;
+	}
+	if (read(el->timerfd, &junk, sizeof(junk)) < 0) {
+		junk = 0;				/* nothing pending */
+	}
+	timerfd_settime(el->timerfd, 0, &its, NULL);
+}
+
+/* Arm the HID side timer once */
+static void ev_hid_timer(struct evloop *el, int ms)
+{
+	struct itimerspec its;
+
+	if ((hidtrace.mode == HIDTRACE_REPLAY) && ms) {
+		ms = 1;					/* nothing to settle */
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	timerfd_settime(el->hidtimerfd, 0, &its, NULL);
+}
+
+/* Wait up to ms (-1 forever) for events, returns the EV_ mask seen */
+static int ev_wait(struct evloop *el, int ms)
+{
+	struct epoll_event evs[6];
+	unsigned long long cnt;
+	unsigned char ch;
+	int i, n, res, mask = 0;
+
+	n = epoll_wait(el->epfd, evs, 6, ms);
+	for (i = 0; i < n; i++) {
+		switch (evs[i].data.u32) {
+		case EV_TIMER:
+			if (read(el->timerfd, &cnt, sizeof(cnt)) == sizeof(cnt)) {
+				mask |= EV_TIMER;
+			}
+			break;
+		case EV_HIDTIMER:
+			if (read(el->hidtimerfd, &cnt, sizeof(cnt)) == sizeof(cnt)) {
+				mask |= EV_HIDTIMER;
+			}
+			break;
+		case EV_BLOCK:
+			if (read(el->blockfd, &cnt, sizeof(cnt)) == sizeof(cnt)) {
+				el->blocks += cnt;
+				mask |= EV_BLOCK;
+			}
+			break;
+		case EV_GPIO:
+			if (read(el->gpiofd, &cnt, sizeof(cnt)) == sizeof(cnt)) {
+				mask |= EV_GPIO;
+			}
+			break;
+		case EV_KEY:
+			res = read(fileno(stdin), &ch, 1);
+			if (res == 1) {
+				el->keyhit = 1;
+				el->key = ch;
+			} else if (!res || (errno != EAGAIN)) {
+				/* end of input, stop watching it */
+				ev_kbd(el, 0);
+			}
+			break;
+		}
+	}
+	if (el->keyhit) {
+		mask |= EV_KEY;
+	}
+	return (mask);
+}
+
+/* Take a latched key press, returns 0 if there was none */
+static int ev_key(struct evloop *el)
+{
+	if (!el->keyhit) {
+		return (0);
+	}
+	el->keyhit = 0;
+	return (el->key);
+}
+
+/* Wait for ms, returns non-zero if a key was pressed first */
+static int ev_sleep(struct evloop *el, int ms)
+{
+	int mask;
+
+	ev_timer(el, ms, 0);
+	for (;;) {
+		mask = ev_wait(el, -1);
+		if (mask & EV_KEY) {
+			ev_timer(el, 0, 0);
+			return (1);
+		}
+		if (mask & EV_TIMER) {
+			return (0);
+		}
+	}
+}
+
+/* Wait for n more analyzed blocks or ms, returns non-zero on timeout */
+static int ev_wait_blocks(struct evloop *el, int n, int ms)
+{
+	unsigned long target = el->blocks + n;
+	unsigned long long start = now_us();
+	int left;
+
+	while (el->blocks < target) {
+		left = ms - (int) ((now_us() - start) / 1000);
+		if (left <= 0) {
+			return (-1);
+		}
+		ev_wait(el, left);
+	}
+	return (0);
+}
+
+/* Put the terminal into raw, non-blocking mode so a single key press can be seen */
+static void kbd_nowait(void)
+{
+	struct termios t;
+
+	tcgetattr(fileno(stdin), &t);
+	cfmakeraw(&t);
+	t.c_lflag &= ~ICANON;
+	tcsetattr(fileno(stdin), TCSANOW, &t);
+	fcntl(fileno(stdin), F_SETFL, fcntl(fileno(stdin), F_GETFL) | O_NONBLOCK);
+	ev_kbd(&evl, 1);
+}
+
+/* Return the terminal to line mode after kbd_nowait() */
+static void kbd_wait(void)
+{
+	struct termios t;
+
+	tcgetattr(fileno(stdin), &t);
+	t.c_lflag &= ICANON;
+	tcsetattr(fileno(stdin), TCSANOW, &t);
+	fcntl(fileno(stdin), F_SETFL, fcntl(fileno(stdin), F_GETFL) & ~O_NONBLOCK);
+	ev_kbd(&evl, 0);
+}
+
+/*!
+ * \brief GPIO timeline (logic analyzer) capture
+ *	A sampler thread reads the getin() bitfield as fast as the HID transport
+ *	allows (or, after one poll for the starting levels, waits on the interrupt
+ *	endpoint) and pushes only the transitions
+ *	into a single producer/single consumer ring.  The main thread drains the
+ *	ring into a Value Change Dump file that can be viewed with GTKWave.
+ *
+ *	Bit assignment matches getin(): bit 0-3 GPIO1-4, bit 4 CTCSS,
+ *	bit 5 COR, bit 6-7 GPIO7/GPIO8 (CM119 family only).
+ */
+struct gpio_event {
+	unsigned long long t;		/* microseconds since start of capture */
+	unsigned char bits;
+};
+
+struct gpio_capture {
+	struct usb_dev_handle *usb_handle;
+	int use_interrupt;
+	int period_us;				/* between polls, 0 for as fast as possible */
+	volatile int stop;
+	unsigned long long start;
+	unsigned long nsamples;
+	unsigned long overruns;
+	unsigned int head;			/* written by sampler only */
+	unsigned int tail;			/* written by drain only */
+	struct gpio_event ev[GPIO_RING_SIZE];
+};
+
+char *gpio_names[] = {"GPIO1", "GPIO2", "GPIO3", "GPIO4", "CTCSS", "COR", "GPIO7", "GPIO8"};
+
+/* Push a transition into the ring, drop it (and count) if the ring is full */
+static void gpio_ring_push(struct gpio_capture *gc, unsigned long long t, unsigned char bits)
+{
+	unsigned int head = gc->head;
+
+	if (head - __atomic_load_n(&gc->tail, __ATOMIC_ACQUIRE) >= GPIO_RING_SIZE) {
+		gc->overruns++;
+		return;
+	}
+	gc->ev[head & (GPIO_RING_SIZE - 1)].t = t;
+	gc->ev[head & (GPIO_RING_SIZE - 1)].bits = bits;
+	__atomic_store_n(&gc->head, head + 1, __ATOMIC_RELEASE);
+	ev_signal(evl.gpiofd);
+}
+
+/* GPIO sampler thread */
+static void *gpio_sampler(void *this)
+{
+	struct gpio_capture *gc = (struct gpio_capture *) this;
+	unsigned char buf[4];
+	unsigned long long t0, t1;
+	int first = 1, res;
+	unsigned char bits, last = 0;
+
+	/* the endpoint only reports changes, so poll once for the levels at the start */
+	if (gc->use_interrupt) {
+		memset(buf, 0, sizeof(buf));
+		t0 = now_us();
+		if (read_inputs(gc->usb_handle, buf)) {
+			gc->stop = 1;
+			ev_signal(evl.gpiofd);
+			return NULL;
+		}
+		t1 = now_us();
+		gc->nsamples++;
+		last = inputs_to_bits(buf);
+		gpio_ring_push(gc, ((t0 + t1) / 2) - gc->start, last);
+		first = 0;
+	}
+	while (!gc->stop) {
+		memset(buf, 0, sizeof(buf));
+		t0 = now_us();
+		if (gc->use_interrupt) {
+			res = hid_interrupt_read(gc->usb_handle, buf, 100);
+			if (res == -ENODEV) {
+				gc->stop = 1;	/* unplugged */
+				ev_signal(evl.gpiofd);
+				break;
+			}
+			if (res < 4) {
+				continue;		/* timeout, nothing changed */
+			}
+			t1 = t0 = now_us();
+		} else {
+			if (read_inputs(gc->usb_handle, buf)) {
+				gc->stop = 1;	/* unit gone, the failure has been reported */
+				ev_signal(evl.gpiofd);
+				break;
+			}
+			t1 = now_us();
+			if (gc->period_us) {
+				usleep(gc->period_us);
+			}
+		}
+		gc->nsamples++;
+		bits = inputs_to_bits(buf);
+		if (first || (bits != last)) {
+			gpio_ring_push(gc, ((t0 + t1) / 2) - gc->start, bits);
+			last = bits;
+			first = 0;
+		}
+	}
+	return NULL;
+}
+
+/* Write the changed signals of one event to the VCD file */
+static void gpio_vcd_event(FILE *fp, struct gpio_event *ev, unsigned char *last, int nbits, int first)
+{
+	int i;
+
+	fprintf(fp, "#%llu\n", ev->t);
+	if (first) {
+		fprintf(fp, "$dumpvars\n");
+	}
+	for (i = 0; i < nbits; i++) {
+		if (first || ((ev->bits ^ *last) & (1 << i))) {
+			fprintf(fp, "%d%c\n", (ev->bits >> i) & 1, '!' + i);
+		}
+	}
+	if (first) {
+		fprintf(fp, "$end\n");
+	}
+	*last = ev->bits;
+}
+
+/* Capture the GPIO/COR/CTCSS inputs into a VCD file */
+static int gpio_timeline(struct usb_dev_handle *usb_handle, int use_interrupt)
+{
+	static struct gpio_capture gc;
+	pthread_t gthread;
+	char str[200], fname[200];
+	FILE *fp;
+	time_t now;
+	float duration;
+	unsigned long transitions = 0;
+	unsigned long long elapsed;
+	unsigned char last = 0;
+	int i, nbits, joined = 0, asked = 0;
+
+	prompt_str("Capture duration in seconds (Enter for until a key is pressed): ", str, sizeof(str));
+	duration = atof(str);
+	prompt_str("VCD output file [uridiag.vcd]: ", fname, sizeof(fname));
+	if (!fname[0]) {
+		strcpy(fname, "uridiag.vcd");
+	}
+	fp = fopen(fname, "w");
+	if (!fp) {
+		printf("Unable to create %s\n", fname);
+		return (1);
+	}
+	nbits = 6;
+	if (devtype == DEV_C119 || devtype == DEV_C119A || devtype == DEV_C119B) {
+		nbits = 8;
+	}
+	time(&now);
+	fprintf(fp, "$date\n\t%s$end\n", ctime(&now));
+	fprintf(fp, "$version\n\tURIDiag GPIO timeline, %s\n$end\n", devtypestrs[devtype]);
+	fprintf(fp, "$timescale 1us $end\n");
+	fprintf(fp, "$scope module uri $end\n");
+	for (i = 0; i < nbits; i++) {
+		fprintf(fp, "$var wire 1 %c %s $end\n", '!' + i, gpio_names[i]);
+	}
+	fprintf(fp, "$upscope $end\n$enddefinitions $end\n");
+
+	memset(&gc, 0, sizeof(gc));
+	gc.usb_handle = usb_handle;
+	gc.use_interrupt = use_interrupt;
+	gc.start = now_us();
+	if (pthread_create(&gthread, NULL, gpio_sampler, &gc)) {
+		printf("Unable to start GPIO sampler\n");
+		fclose(fp);
+		return (1);
+	}
+	printf("Capturing GPIO timeline (%s) to %s, press any key to stop...\r\n",
+		   (use_interrupt) ? "interrupt reports" : "polled", fname);
+	kbd_nowait();
+	ev_key(&evl);
+	if (duration > 0.0) {
+		ev_timer(&evl, duration * 1000.0, 0);
+	}
+	for (;;) {
+		unsigned int head = __atomic_load_n(&gc.head, __ATOMIC_ACQUIRE);
 
-	setout(usb_handle, toout);	/* should readback 0 */
-	c = getin(usb_handle) & 0xf2;
-	return (dioerror(c, toexpect));
+		while (gc.tail != head) {
+			gpio_vcd_event(fp, &gc.ev[gc.tail & (GPIO_RING_SIZE - 1)], &last, nbits, !transitions);
+			transitions++;
+			__atomic_store_n(&gc.tail, gc.tail + 1, __ATOMIC_RELEASE);
+		}
+		if (joined) {
+			break;
+		}
+		if (gc.stop) {
+			/* asked to, or the sampler stopped itself, either way it is ending */
+			pthread_join(gthread, NULL);
+			joined = 1;
+			continue;			/* drain what is left */
+		}
+		/* the sampler signals every transition it pushes */
+		if (ev_wait(&evl, -1) & (EV_KEY | EV_TIMER)) {
+			ev_key(&evl);
+			gc.stop = 1;
+			asked = 1;
+		}
+	}
+	ev_timer(&evl, 0, 0);
+	kbd_wait();
+	if (!asked) {
+		printf("Capture ended early, the unit stopped answering\n");
+	}
+	elapsed = now_us() - gc.start;
+	fprintf(fp, "#%llu\n", elapsed);
+	fclose(fp);
+	printf("Captured %lu samples in %.2f seconds (%.0f samples/sec), %lu transitions",
+		   gc.nsamples, elapsed / 1000000.0, gc.nsamples / (elapsed / 1000000.0),
+		   (transitions) ? transitions - 1 : 0);
+	if (gc.overruns) {
+		printf(", %lu lost (ring full)", gc.overruns);
+	}
+	printf("\n");
+	return (0);
 }
 
 /* get tone sample */
@@ -712,32 +2054,115 @@ static float get_tonesample(struct tonevars *tvars, float ddr, float ddi)
 	return tvars->mycr * 0.9092;
 }
 
+/*
+ * Set a tone oscillator to the phase it has at playback frame index idx,
+ * so the phase of every stimulus tone is a known function of the frame
+ * index (and float rounding in the oscillator cannot accumulate).
+ */
+static void tone_lock(struct tonevars *tvars, float freq, long long idx)
+{
+	double p = 2.0 * M_PI * fmod((double) freq * (idx - 1), 48000.0) / 48000.0;
+
+	tvars->mycr = cos(p);
+	tvars->myci = sin(p);
+}
+
 /* Output audio */
+/*
+ * Oscillator increment and analyzer bins of one stimulus tone.  Test
+ * plan steps carry these precomputed; anything else gets them computed
+ * once per frequency change.
+ */
+struct tone_plan {
+	float freq;
+	float ddr, ddi;
+	int binlo, binhi;			/* bins within 1.5 bins of the tone, summed for its level */
+};
+
+struct tone_plan *volatile mytones = NULL;	/* left and right tones of the running plan step */
+
+static void tone_plan_init(struct tone_plan *tp, float freq)
+{
+	float x = freq / FFT_BIN_HZ;
+
+	tp->freq = freq;
+	tp->ddr = cos(freq * 2.0 * M_PI / 48000.0);
+	tp->ddi = sin(freq * 2.0 * M_PI / 48000.0);
+	tp->binlo = (int) floor(x - 1.5) + 1;
+	tp->binhi = (int) ceil(x + 1.5) - 1;
+	if (tp->binlo < 1) {
+		tp->binlo = 1;
+	}
+	if (tp->binhi > NFFT / 2 - 1) {
+		tp->binhi = NFFT / 2 - 1;
+	}
+}
+
+/* Tone plan for channel ch (2 for the mixed in tone) at freq (sound thread) */
+static struct tone_plan *tone_for(int ch, float freq)
+{
+	static struct tone_plan cache[3];
+	struct tone_plan *tp = mytones;
+
+	if (tp && (ch < 2) && (tp[ch].freq == freq)) {
+		return (&tp[ch]);
+	}
+	if (cache[ch].freq != freq) {
+		tone_plan_init(&cache[ch], freq);
+	}
+	return (&cache[ch]);
+}
+
 static int outaudio(int fd, float freq1, float freq2)
 {
 	unsigned short buf[AUDIO_SAMPLES_PER_BLOCK * 2];
-	float f, ddr1, ddi1, ddr2, ddi2;
+	float f, ddr1 = 0.0, ddi1 = 0.0, ddr2 = 0.0, ddi2 = 0.0, ddr3 = 0.0, ddi3 = 0.0;
+	float mixfreq = mymixfreq;
+	float *stim = mystim;
+	struct tone_plan *tp;
 	int i;
-	static struct tonevars t1, t2;
+	static struct tonevars t1, t2, t3;
+	static long long playframes = 0;
 
 	if (freq1 > 0.0) {
-		ddr1 = cos(freq1 * 2.0 * M_PI / 48000.0);
-		ddi1 = sin(freq1 * 2.0 * M_PI / 48000.0);
+		tp = tone_for(0, freq1);
+		ddr1 = tp->ddr;
+		ddi1 = tp->ddi;
+		tone_lock(&t1, freq1, playframes);
 	} else {
 		t1.mycr = 1.0;
 		t1.myci = 0.0;
 	}
 
 	if (freq2 > 0.0) {
-		ddr2 = cos(freq2 * 2.0 * M_PI / 48000.0);
-		ddi2 = sin(freq2 * 2.0 * M_PI / 48000.0);
+		tp = tone_for(1, freq2);
+		ddr2 = tp->ddr;
+		ddi2 = tp->ddi;
+		tone_lock(&t2, freq2, playframes);
 	} else {
 		t2.mycr = 1.0;
 		t2.myci = 0.0;
 	}
+	if (mixfreq > 0.0) {
+		tp = tone_for(2, mixfreq);
+		ddr3 = tp->ddr;
+		ddi3 = tp->ddi;
+		tone_lock(&t3, mixfreq, playframes);
+	} else {
+		t3.mycr = 1.0;
+		t3.myci = 0.0;
+	}
 	for (i = 0; i < AUDIO_SAMPLES_PER_BLOCK * 2; i += 2) {
+		if (stim) {
+			buf[i] = stim[(playframes + i / 2) % NFFT] * 32765;
+			buf[i + 1] = 0;
+			continue;
+		}
 		if (freq1 > 0.0) {
-			f = get_tonesample(&t1, ddr1, ddi1);
+			f = get_tonesample(&t1, ddr1, ddi1) * myamp1;
+			if (mixfreq > 0.0) {
+				f += get_tonesample(&t3, ddr3, ddi3) * mymixamp;
+			}
 			buf[i] = f * 32765;
 		} else
 			buf[i] = 0;
@@ -750,11 +2175,17 @@ static int outaudio(int fd, float freq1, float freq2)
 	if (write(fd, buf, AUDIO_BLOCKSIZE) != AUDIO_BLOCKSIZE) {
 		return (-1);
 	}
+	playframes += AUDIO_SAMPLES_PER_BLOCK;
 	return 0;
 }
 
-/* Open the sound device */
-static int soundopen(int devicenum)
+/*
+ * Open the sound device for capture (O_RDONLY, mono) or playback
+ * (O_WRONLY, stereo).  The two directions are separate opens so each
+ * has its own channel count; the URI's input is mono, and capturing it
+ * as stereo only doubled the data read and copied.
+ */
+static int soundopen(int devicenum, int mode)
 {
 	int fd, res, fmt, desired;
 	char device[200];
@@ -763,7 +2194,7 @@ static int soundopen(int devicenum)
 	if (devicenum) {
 		sprintf(device, "/dev/dsp%d", devicenum);
 	}
-	fd = open(device, O_RDWR | O_NONBLOCK);
+	fd = open(device, mode | O_NONBLOCK);
 	if (fd < 0) {
 		printf("Unable to re-open DSP device %d: %s\n", devicenum, device);
 		return -1;
@@ -776,25 +2207,22 @@ static int soundopen(int devicenum)
 	res = ioctl(fd, SNDCTL_DSP_SETFMT, &fmt);
 	if (res < 0) {
 		printf("Unable to set format to 16-bit signed\n");
+		close(fd);
 		return -1;
 	}
-	res = ioctl(fd, SNDCTL_DSP_SETDUPLEX, 0);
-	/* Check to see if duplex set (FreeBSD Bug) */
-	res = ioctl(fd, SNDCTL_DSP_GETCAPS, &fmt);
-	if ((res != 0) || (!(fmt & DSP_CAP_DUPLEX))) {
-		printf("Doesnt have full duplex mode\n");
-		return -1;
-	}
-	fmt = 1;
+	fmt = (mode == O_WRONLY);
 	res = ioctl(fd, SNDCTL_DSP_STEREO, &fmt);
-	if (res < 0) {
-		printf("Failed to set audio device to mono\n");
+	if ((res < 0) || (fmt != (mode == O_WRONLY))) {
+		printf("Failed to set audio %s to %s\n", (mode == O_WRONLY) ? "playback" : "capture",
+			   (mode == O_WRONLY) ? "stereo" : "mono");
+		close(fd);
 		return -1;
 	}
 	fmt = desired = 48000;
 	res = ioctl(fd, SNDCTL_DSP_SPEED, &fmt);
 	if (res < 0) {
 		printf("Failed to set audio device to 48k\n");
+		close(fd);
 		return -1;
 	}
 	if (fmt != desired) {
@@ -811,209 +2239,5573 @@ static int soundopen(int devicenum)
 			printf("Unable to set fragment size -- sound may be choppy\n");
 		}
 	}
-	/* on some cards, we need SNDCTL_DSP_SETTRIGGER to start outputting */
-	res = PCM_ENABLE_INPUT | PCM_ENABLE_OUTPUT;
-	res = ioctl(fd, SNDCTL_DSP_SETTRIGGER, &res);
-	/* it may fail if we are in half duplex, never mind */
-	return fd;
+	/* on some cards, we need SNDCTL_DSP_SETTRIGGER to start outputting */
+	res = (mode == O_WRONLY) ? PCM_ENABLE_OUTPUT : PCM_ENABLE_INPUT;
+	res = ioctl(fd, SNDCTL_DSP_SETTRIGGER, &res);
+	return fd;
+}
+
+/* Time a sample written now takes to be played out of a full playback queue */
+static unsigned long long playback_queue_us(void)
+{
+	return (((unsigned long long) (frags >> 16) << (frags & 0xffff)) * 1000000ULL / (48000 * 4));
+}
+
+/* Open capture and playback of the sound device, returns -1 if either fails */
+static int soundopen_pair(int devicenum, int *rfd, int *wfd)
+{
+	*rfd = soundopen(devicenum, O_RDONLY);
+	if (*rfd < 0) {
+		*wfd = -1;
+		return (-1);
+	}
+	*wfd = soundopen(devicenum, O_WRONLY);
+	if (*wfd < 0) {
+		close(*rfd);
+		*rfd = -1;
+		return (-1);
+	}
+	return (0);
+}
+
+/* Estimate the frequency of the tone nearest freq from the bin powers */
+static float tone_freq(float *spec, float freq)
+{
+	int i, k;
+	float m0, m1;
+
+	k = (int) (freq / FFT_BIN_HZ + 0.5);
+	if (k < 2) {
+		k = 2;
+	}
+	if (k > NFFT / 2 - 3) {
+		k = NFFT / 2 - 3;
+	}
+	for (i = k - 1; i <= k + 1; i++) {
+		if (spec[i] > spec[k]) {
+			k = i;
+		}
+	}
+	/* the tone lies between the peak and its larger neighbour (rectangular window) */
+	m0 = sqrt(spec[k]);
+	if (spec[k + 1] > spec[k - 1]) {
+		m1 = sqrt(spec[k + 1]);
+		return (k + m1 / (m0 + m1)) * FFT_BIN_HZ;
+	}
+	m1 = sqrt(spec[k - 1]);
+	return (k - m1 / (m0 + m1)) * FFT_BIN_HZ;
+}
+
+/*!
+ * \brief Soak test time series
+ *	The soak test keeps min/max/mean of every quantity at three resolutions
+ *	(1 second, 1 minute and 1 hour buckets).  Each resolution is a fixed
+ *	size ring, so the memory used does not grow with the soak duration.
+ *	Completed buckets cascade into the next coarser resolution.
+ *
+ *	All of the updating happens in the sound thread, once per block.
+ */
+enum {SOAK_LEV1, SOAK_LEV2, SOAK_NOISE, SOAK_FREQ1, SOAK_FREQ2, SOAK_NQ};
+
+char *soak_names[] = {"Left level", "Right level", "Noise floor", "Left freq", "Right freq"};
+
+struct soak_stat {
+	float min;
+	float max;
+	double sum;
+};
+
+struct soak_bucket {
+	unsigned long t;			/* start of the bucket, seconds into the soak */
+	unsigned int n;				/* blocks accumulated */
+	struct soak_stat q[SOAK_NQ];
+};
+
+struct soak_series {
+	int seconds;				/* bucket width */
+	int size;					/* ring size */
+	int count;					/* completed buckets retained */
+	int head;					/* next ring position to write */
+	struct soak_bucket cur;		/* bucket being accumulated */
+	struct soak_bucket *ring;
+};
+
+struct soak_event {
+	unsigned long long t;		/* microseconds into the soak */
+	unsigned long long len;		/* duration in microseconds */
+	int q;						/* quantity that failed */
+	float val;
+};
+
+struct soak_state {
+	pthread_mutex_t lock;
+	volatile int active;
+	int settle;					/* analysis frames left to ignore */
+	unsigned long long start;
+	unsigned long blocks;
+	struct soak_bucket base;	/* baseline, first SOAK_BASELINE_SECS */
+	int havebase;
+	struct soak_series sec, min, hour;
+	int ndropouts;
+	int indropout;
+	struct soak_event dropouts[SOAK_MAX_EVENTS];
+	int ndrifts;
+	struct soak_event drifts[SOAK_MAX_EVENTS];
+	int drifting[SOAK_NQ];
+};
+
+static struct soak_bucket soak_sec_ring[SOAK_SEC_BUCKETS];
+static struct soak_bucket soak_min_ring[SOAK_MIN_BUCKETS];
+static struct soak_bucket soak_hour_ring[SOAK_HOUR_BUCKETS];
+
+struct soak_state soak = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Reset a bucket to start accumulating at time t */
+static void soak_bucket_init(struct soak_bucket *b, unsigned long t)
+{
+	int i;
+
+	b->t = t;
+	b->n = 0;
+	for (i = 0; i < SOAK_NQ; i++) {
+		b->q[i].min = 1e30;
+		b->q[i].max = -1e30;
+		b->q[i].sum = 0.0;
+	}
+}
+
+/* Merge one bucket into another */
+static void soak_bucket_merge(struct soak_bucket *to, struct soak_bucket *from)
+{
+	int i;
+
+	if (!from->n) {
+		return;
+	}
+	for (i = 0; i < SOAK_NQ; i++) {
+		if (from->q[i].min < to->q[i].min) {
+			to->q[i].min = from->q[i].min;
+		}
+		if (from->q[i].max > to->q[i].max) {
+			to->q[i].max = from->q[i].max;
+		}
+		to->q[i].sum += from->q[i].sum;
+	}
+	to->n += from->n;
+}
+
+static float soak_mean(struct soak_bucket *b, int q)
+{
+	if (!b->n) {
+		return 0.0;
+	}
+	return b->q[q].sum / b->n;
+}
+
+static void soak_series_init(struct soak_series *s, int seconds, struct soak_bucket *ring, int size)
+{
+	s->seconds = seconds;
+	s->ring = ring;
+	s->size = size;
+	s->count = 0;
+	s->head = 0;
+	soak_bucket_init(&s->cur, 0);
+}
+
+/* Retire the current bucket of a series into its ring */
+static void soak_series_push(struct soak_series *s)
+{
+	s->ring[s->head] = s->cur;
+	s->head = (s->head + 1) % s->size;
+	if (s->count < s->size) {
+		s->count++;
+	}
+}
+
+/* Return the i'th oldest retained bucket of a series */
+static struct soak_bucket *soak_series_get(struct soak_series *s, int i)
+{
+	return &s->ring[(s->head - s->count + i + s->size) % s->size];
+}
+
+/* Check a completed minute against the baseline, record drift events */
+static void soak_check_drift(struct soak_state *sk, struct soak_bucket *b)
+{
+	float m, ref, lim;
+	int i;
+
+	for (i = 0; i < SOAK_NQ; i++) {
+		m = soak_mean(b, i);
+		ref = soak_mean(&sk->base, i);
+		if (ref <= 0.0) {
+			continue;
+		}
+		switch (i) {
+		case SOAK_FREQ1:
+		case SOAK_FREQ2:
+			lim = SOAK_DRIFT_FREQ;
+			break;
+		case SOAK_NOISE:
+			lim = ref * (SOAK_NOISE_RISE - 1.0);
+			if (m < ref) {		/* only a rising noise floor is a problem */
+				m = ref;
+			}
+			break;
+		default:
+			lim = ref * SOAK_DRIFT_LEVEL;
+		}
+		if (fabs(m - ref) <= lim) {
+			sk->drifting[i] = 0;
+			continue;
+		}
+		if (sk->drifting[i]) {
+			continue;			/* already reported, still out */
+		}
+		sk->drifting[i] = 1;
+		if (sk->ndrifts < SOAK_MAX_EVENTS) {
+			sk->drifts[sk->ndrifts].t = (unsigned long long) b->t * 1000000ULL;
+			sk->drifts[sk->ndrifts].len = 60000000ULL;
+			sk->drifts[sk->ndrifts].q = i;
+			sk->drifts[sk->ndrifts].val = m;
+		}
+		sk->ndrifts++;
+	}
+}
+
+/* Start a soak run */
+static void soak_start(struct soak_state *sk)
+{
+	pthread_mutex_lock(&sk->lock);
+	sk->start = 0;
+	sk->blocks = 0;
+	sk->settle = SOAK_SETTLE_BLOCKS * hopsperblock;
+	sk->havebase = 0;
+	soak_bucket_init(&sk->base, 0);
+	soak_series_init(&sk->sec, 1, soak_sec_ring, SOAK_SEC_BUCKETS);
+	soak_series_init(&sk->min, 60, soak_min_ring, SOAK_MIN_BUCKETS);
+	soak_series_init(&sk->hour, 3600, soak_hour_ring, SOAK_HOUR_BUCKETS);
+	sk->ndropouts = sk->ndrifts = 0;
+	sk->indropout = 0;
+	memset(sk->drifting, 0, sizeof(sk->drifting));
+	sk->active = 1;
+	pthread_mutex_unlock(&sk->lock);
+}
+
+/* Add one analyzed block to the soak time series (sound thread) */
+static void soak_block(struct soak_state *sk, unsigned long long t, float *v)
+{
+	unsigned long secs;
+	int i, low;
+
+	pthread_mutex_lock(&sk->lock);
+	if (!sk->active || sk->settle) {
+		if (sk->settle) {
+			sk->settle--;
+		}
+		pthread_mutex_unlock(&sk->lock);
+		return;
+	}
+	if (!sk->start) {
+		sk->start = t;
+	}
+	t -= sk->start;
+	secs = t / 1000000ULL;
+	sk->blocks++;
+
+	/* dropouts are checked on every block, against the baseline */
+	if (sk->havebase) {
+		low = -1;
+		for (i = SOAK_LEV1; i <= SOAK_LEV2; i++) {
+			if ((soak_mean(&sk->base, i) > 0.0) &&
+				(v[i] < soak_mean(&sk->base, i) * SOAK_DROPOUT_LEVEL)) {
+				low = i;
+			}
+		}
+		if (low >= 0) {
+			if (!sk->indropout) {
+				if (sk->ndropouts < SOAK_MAX_EVENTS) {
+					sk->dropouts[sk->ndropouts].t = t;
+					sk->dropouts[sk->ndropouts].len = 0;
+					sk->dropouts[sk->ndropouts].q = low;
+					sk->dropouts[sk->ndropouts].val = v[low];
+				}
+				sk->ndropouts++;
+				sk->indropout = 1;
+			} else if (sk->ndropouts <= SOAK_MAX_EVENTS) {
+				sk->dropouts[sk->ndropouts - 1].len = t - sk->dropouts[sk->ndropouts - 1].t;
+			}
+		} else {
+			sk->indropout = 0;
+		}
+	}
+
+	/* close the 1 second bucket, cascading into minutes and hours */
+	if (secs >= sk->sec.cur.t + 1) {
+		if (sk->sec.cur.n) {
+			soak_series_push(&sk->sec);
+			soak_bucket_merge(&sk->min.cur, &sk->sec.cur);
+			if (!sk->havebase) {
+				soak_bucket_merge(&sk->base, &sk->sec.cur);
+				if (secs >= SOAK_BASELINE_SECS) {
+					sk->havebase = 1;
+				}
+			}
+		}
+		soak_bucket_init(&sk->sec.cur, secs);
+		if (secs >= sk->min.cur.t + 60) {
+			if (sk->min.cur.n) {
+				soak_series_push(&sk->min);
+				soak_bucket_merge(&sk->hour.cur, &sk->min.cur);
+				if (sk->havebase) {
+					soak_check_drift(sk, &sk->min.cur);
+				}
+			}
+			soak_bucket_init(&sk->min.cur, secs - (secs % 60));
+			if (secs >= sk->hour.cur.t + 3600) {
+				if (sk->hour.cur.n) {
+					soak_series_push(&sk->hour);
+				}
+				soak_bucket_init(&sk->hour.cur, secs - (secs % 3600));
+			}
+		}
+	}
+	for (i = 0; i < SOAK_NQ; i++) {
+		if (v[i] < sk->sec.cur.q[i].min) {
+			sk->sec.cur.q[i].min = v[i];
+		}
+		if (v[i] > sk->sec.cur.q[i].max) {
+			sk->sec.cur.q[i].max = v[i];
+		}
+		sk->sec.cur.q[i].sum += v[i];
+	}
+	sk->sec.cur.n++;
+	pthread_mutex_unlock(&sk->lock);
+}
+
+/* Stop a soak run, retiring the partly filled buckets and checking the last minute */
+static void soak_stop(struct soak_state *sk)
+{
+	pthread_mutex_lock(&sk->lock);
+	sk->active = 0;
+	if (sk->sec.cur.n) {
+		soak_series_push(&sk->sec);
+		soak_bucket_merge(&sk->min.cur, &sk->sec.cur);
+		if (!sk->havebase) {
+			soak_bucket_merge(&sk->base, &sk->sec.cur);
+		}
+	}
+	if (sk->min.cur.n) {
+		soak_series_push(&sk->min);
+		soak_bucket_merge(&sk->hour.cur, &sk->min.cur);
+		if (sk->havebase) {
+			soak_check_drift(sk, &sk->min.cur);
+		}
+	}
+	if (sk->hour.cur.n) {
+		soak_series_push(&sk->hour);
+	}
+	pthread_mutex_unlock(&sk->lock);
+}
+
+/* Running min/max/mean/standard deviation (Welford) */
+struct runstat {
+	unsigned long n;
+	double mean;
+	double m2;
+	float min;
+	float max;
+};
+
+static void runstat_init(struct runstat *rs)
+{
+	rs->n = 0;
+	rs->mean = rs->m2 = 0.0;
+	rs->min = 1e30;
+	rs->max = -1e30;
+}
+
+static void runstat_add(struct runstat *rs, float x)
+{
+	double d = x - rs->mean;
+
+	rs->n++;
+	rs->mean += d / rs->n;
+	rs->m2 += d * (x - rs->mean);
+	if (x < rs->min) {
+		rs->min = x;
+	}
+	if (x > rs->max) {
+		rs->max = x;
+	}
+}
+
+static float runstat_std(struct runstat *rs)
+{
+	if (rs->n < 2) {
+		return 0.0;
+	}
+	return sqrt(rs->m2 / (rs->n - 1));
+}
+
+/* Least squares straight line, x and y relative to the first point */
+struct linfit {
+	unsigned long n;
+	double x0, y0;
+	double sx, sy, sxx, sxy;
+};
+
+static void linfit_init(struct linfit *lf)
+{
+	memset(lf, 0, sizeof(*lf));
+}
+
+static void linfit_add(struct linfit *lf, double x, double y)
+{
+	if (!lf->n) {
+		lf->x0 = x;
+		lf->y0 = y;
+	}
+	x -= lf->x0;
+	y -= lf->y0;
+	lf->n++;
+	lf->sx += x;
+	lf->sy += y;
+	lf->sxx += x * x;
+	lf->sxy += x * y;
+}
+
+static double linfit_slope(struct linfit *lf)
+{
+	double d = lf->n * lf->sxx - lf->sx * lf->sx;
+
+	if ((lf->n < 2) || (d == 0.0)) {
+		return 0.0;
+	}
+	return (lf->n * lf->sxy - lf->sx * lf->sy) / d;
+}
+
+/*!
+ * \brief Audio timing (jitter) analysis
+ *	Timestamps every capture and playback period in the sound thread and
+ *	records how much audio the driver holds at that moment (OSS
+ *	GETISPACE/GETODELAY).  From those it derives the period arrival jitter,
+ *	the device sample rate as seen by the host clock and how steady the
+ *	playback delay and capture backlog are over the run.
+ */
+struct jitter_state {
+	pthread_mutex_t lock;
+	volatile int active;
+	unsigned long long lastcap, lastplay;	/* us */
+	unsigned long long capframes;			/* frames read while active */
+	struct runstat capint, playint;			/* period intervals, ms */
+	struct runstat odelay, ibacklog;		/* ms */
+	struct linfit rate;						/* device frames against host seconds */
+	struct linfit delaydrift;				/* playback delay (ms) against host seconds */
+	unsigned long late;						/* periods later than 2x nominal */
+	struct runstat seccap, secdelay;		/* since the last progress line */
+};
+
+struct jitter_state jit = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void jitter_start(struct jitter_state *js)
+{
+	pthread_mutex_lock(&js->lock);
+	js->lastcap = js->lastplay = 0;
+	js->capframes = 0;
+	runstat_init(&js->capint);
+	runstat_init(&js->playint);
+	runstat_init(&js->odelay);
+	runstat_init(&js->ibacklog);
+	runstat_init(&js->seccap);
+	runstat_init(&js->secdelay);
+	linfit_init(&js->rate);
+	linfit_init(&js->delaydrift);
+	js->late = 0;
+	js->active = 1;
+	pthread_mutex_unlock(&js->lock);
+}
+
+/* A capture period was read (sound thread) */
+static void jitter_capture(struct jitter_state *js, int fd, unsigned long long t, int frames)
+{
+	audio_buf_info info;
+	float dt;
+
+	pthread_mutex_lock(&js->lock);
+	if (js->lastcap) {
+		dt = (t - js->lastcap) / 1000.0;
+		runstat_add(&js->capint, dt);
+		runstat_add(&js->seccap, dt);
+		if (dt > 2.0 * frames / 48.0) {
+			js->late++;
+		}
+	}
+	js->lastcap = t;
+	js->capframes += frames;
+	if (ioctl(fd, SNDCTL_DSP_GETISPACE, &info) >= 0) {
+		/* frames the device has captured = read so far + waiting in the driver */
+		runstat_add(&js->ibacklog, (info.bytes / CAPTURE_FRAME_BYTES) / 48.0);
+		linfit_add(&js->rate, t / 1000000.0, (double) js->capframes + (info.bytes / CAPTURE_FRAME_BYTES));
+	}
+	pthread_mutex_unlock(&js->lock);
+}
+
+/* A playback period was written (sound thread) */
+static void jitter_playback(struct jitter_state *js, int fd, unsigned long long t)
+{
+	int odelay;
+
+	pthread_mutex_lock(&js->lock);
+	if (js->lastplay) {
+		runstat_add(&js->playint, (t - js->lastplay) / 1000.0);
+	}
+	js->lastplay = t;
+	if (ioctl(fd, SNDCTL_DSP_GETODELAY, &odelay) >= 0) {
+		runstat_add(&js->odelay, (odelay / 4) / 48.0);
+		runstat_add(&js->secdelay, (odelay / 4) / 48.0);
+		linfit_add(&js->delaydrift, t / 1000000.0, (odelay / 4) / 48.0);
+	}
+	pthread_mutex_unlock(&js->lock);
+}
+
+/*!
+ * \brief Audio overrun/underrun counters
+ *	OSS under ALSA has no xrun counter, so they are inferred in the sound
+ *	thread: a capture buffer still full after a block was read has dropped
+ *	input, and a playback buffer that ran empty after playback started
+ *	has played silence.  Each episode counts once.
+ */
+struct xrun_state {
+	volatile unsigned long overruns;
+	volatile unsigned long underruns;
+	int inover, inunder;
+	int primed;					/* playback has had data queued */
+};
+
+struct xrun_state xrun;
+
+/* A capture block was read (sound thread) */
+static void xrun_capture(struct xrun_state *xs, int fd)
+{
+	audio_buf_info info;
+	int full;
+
+	if (ioctl(fd, SNDCTL_DSP_GETISPACE, &info) < 0) {
+		return;
+	}
+	full = (info.bytes >= info.fragstotal * info.fragsize - CAPTURE_BLOCKSIZE);
+	if (full && !xs->inover) {
+		xs->overruns++;
+	}
+	xs->inover = full;
+}
+
+/* Playback wants another block (sound thread) */
+static void xrun_playback(struct xrun_state *xs, int fd)
+{
+	int odelay, empty;
+
+	if (ioctl(fd, SNDCTL_DSP_GETODELAY, &odelay) < 0) {
+		return;
+	}
+	if (!xs->primed) {
+		xs->primed = (odelay > 0);
+		return;
+	}
+	empty = (odelay <= 0);
+	if (empty && !xs->inunder) {
+		xs->underruns++;
+	}
+	xs->inunder = empty;
+}
+
+/*!
+ * \brief Level measurement window
+ *	Accumulates the left/right levels over a window of blocks in the sound
+ *	thread, so a measurement is the mean of the window (with its spread)
+ *	rather than whichever block happened to be processed last.
+ */
+struct levwin {
+	volatile int want;			/* blocks still to accumulate, set last by the main thread */
+	volatile int done;
+	struct runstat s1, s2;
+	struct runstat dc;			/* left channel block means */
+	double pc[2], ps[2];		/* tone phasors from the glitch detector fits */
+	int np;
+	int out1, out2;				/* blocks off the running mean by more than LEVWIN_OUTLIER */
+	int skipped;				/* frames left out next to a GPIO output change */
+};
+
+struct levwin lwin;
+
+/* Power averaged spectrum over a window of blocks */
+struct specavg {
+	volatile int want;			/* blocks still to accumulate, set last by the main thread */
+	volatile int done;
+	int n;
+	double pow[NFFT / 2];
+};
+
+struct specavg savg;
+
+/* Hann windowed power spectrum averaged for the spur search, window scaled to the analyzer levels */
+struct spuravg {
+	volatile int want;			/* frames still to accumulate, set last by the main thread */
+	volatile int done;
+	int n;
+	double pow[NFFT / 2];
+	float win[NFFT];
+	double afft[(NFFT + 1) * 2 + 1], wfft[NFFT * 5 / 2];
+	int ipfft[NFFTSQRT + 2];
+};
+
+struct spuravg spavg;
+
+/*!
+ * \brief Voice band zoom analyzer
+ *	The left channel is low pass filtered and decimated to 12 kHz, then
+ *	transformed with a Hann window.  The same size transform as the full
+ *	rate analyzer covers only 0-6 kHz, so the bins are 4 times narrower and
+ *	a transform is needed only every 4 blocks.
+ *
+ *	The decimator is in polyphase form: the input is split into ZOOM_DECIM
+ *	phase streams and each output is the sum of the phase streams filtered
+ *	by their sub-filters, so only the retained outputs are computed.  The
+ *	inner loops run over consecutive outputs with no loop carried
+ *	dependency, which lets the compiler vectorize them.
+ */
+struct zoom_state {
+	volatile int active;
+	float h[ZOOM_TAPS];
+	float ph[ZOOM_DECIM][ZOOM_PHASE_TAPS - 1 + ZOOM_OUT];	/* phase streams, with history */
+	float win[ZOOM_NFFT];		/* decimated samples for the next transform */
+	int nwin;
+	pthread_mutex_t lock;		/* results */
+	unsigned long nfft;
+	float spec[ZOOM_NFFT / 2];
+	float freq;					/* tone nearest the stimulus */
+	float lev;
+	float noise;				/* ZOOM_NOISE_LO - ZOOM_NOISE_HI, tone excluded */
+};
+
+struct zoom_state zoom = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Add one value to a window statistic, counting it if it is an outlier */
+static void levwin_add(struct runstat *rs, int *out, float x)
+{
+	if ((rs->n >= 4) && (fabs(x - rs->mean) > rs->mean * LEVWIN_OUTLIER)) {
+		(*out)++;
+	}
+	runstat_add(rs, x);
+}
+
+/* One block of levels (sound thread) */
+static void levwin_block(struct levwin *lw, float l1, float l2, float dc, int skip)
+{
+	if (!lw->want) {
+		return;
+	}
+	if (skip) {
+		lw->skipped++;
+		return;
+	}
+	levwin_add(&lw->s1, &lw->out1, l1);
+	levwin_add(&lw->s2, &lw->out2, l2);
+	runstat_add(&lw->dc, dc);
+	if (!--lw->want) {
+		lw->done = 1;
+	}
+}
+
+/* Tone phases of one block (sound thread, before levwin_block) */
+static void levwin_phase(struct levwin *lw, float p1, float p2, int skip)
+{
+	if (!lw->want || skip) {
+		return;
+	}
+	lw->pc[0] += cos(p1);
+	lw->ps[0] += sin(p1);
+	lw->pc[1] += cos(p2);
+	lw->ps[1] += sin(p2);
+	lw->np++;
+}
+
+/* Mean tone phase over the window, relative to the oscillator on the capture frame index */
+static float levwin_mean_phase(struct levwin *lw, int ch)
+{
+	return (atan2(lw->ps[ch], lw->pc[ch]));
+}
+
+/* Start measuring over the next nblocks blocks, returns the ms to allow for it */
+static int levwin_start(struct levwin *lw, int nblocks)
+{
+	runstat_init(&lw->s1);
+	runstat_init(&lw->s2);
+	runstat_init(&lw->dc);
+	lw->pc[0] = lw->pc[1] = lw->ps[0] = lw->ps[1] = 0.0;
+	lw->np = 0;
+	lw->out1 = lw->out2 = 0;
+	lw->skipped = 0;
+	lw->done = 0;
+	__sync_synchronize();
+	lw->want = nblocks * hopsperblock;
+	return ((nblocks * 2 * 21333) / 1000 + 1000);
+}
+
+/* One block of bin powers (sound thread) */
+static void specavg_block(struct specavg *sa, float *spec)
+{
+	int i;
+
+	if (!sa->want) {
+		return;
+	}
+	for (i = 1; i < NFFT / 2; i++) {
+		sa->pow[i] += spec[i];
+	}
+	sa->n++;
+	if (!--sa->want) {
+		sa->done = 1;
+	}
+}
+
+/* Start averaging the next nblocks spectra, returns the ms to allow for it */
+static int specavg_start(struct specavg *sa, int nblocks)
+{
+	memset(sa->pow, 0, sizeof(sa->pow));
+	sa->n = 0;
+	sa->done = 0;
+	__sync_synchronize();
+	sa->want = nblocks * hopsperblock;
+	return ((nblocks * 2 * 21333) / 1000 + 1000);
+}
+
+/* One frame into the spur search average (sound thread) */
+static void spuravg_block(struct spuravg *sa, short *sbuf)
+{
+	int i;
+
+	if (!sa->want) {
+		return;
+	}
+	memset(sa->afft, 0, sizeof(double) * 2 * (NFFT + 1));
+	for (i = 0; i < NFFT; i++) {
+		sa->afft[i * 2] = sa->win[i] * sbuf[i] / 65536.0;
+	}
+	cdft(NFFT * 2, -1, sa->afft, sa->ipfft, sa->wfft);
+	for (i = 0; i < NFFT / 2; i++) {
+		sa->pow[i] += (sa->afft[i * 2] * sa->afft[i * 2]) + (sa->afft[i * 2 + 1] * sa->afft[i * 2 + 1]);
+	}
+	sa->n++;
+	if (!--sa->want) {
+		sa->done = 1;
+	}
+}
+
+/* Start averaging the next nblocks of frames, returns the ms to allow for it */
+static int spuravg_start(struct spuravg *sa, int nblocks)
+{
+	int i;
+
+	/* Hann, scaled so a tone summed over its lobe reads the same as on the analyzer */
+	for (i = 0; i < NFFT; i++) {
+		sa->win[i] = (0.5 - 0.5 * cos(2.0 * M_PI * i / NFFT)) * sqrt(8.0 / 3.0);
+	}
+	memset(sa->pow, 0, sizeof(sa->pow));
+	sa->n = 0;
+	sa->ipfft[0] = 0;
+	sa->done = 0;
+	__sync_synchronize();
+	sa->want = nblocks * hopsperblock;
+	return ((nblocks * 2 * 21333) / 1000 + 1000);
+}
+
+/* Design the decimating low pass (Blackman windowed sinc, unity gain at DC) */
+static void zoom_init(struct zoom_state *zs)
+{
+	int i;
+	double x, w, sum = 0.0, fc = ZOOM_CUTOFF / 48000.0;
+
+	for (i = 0; i < ZOOM_TAPS; i++) {
+		x = i - (ZOOM_TAPS - 1) / 2.0;
+		w = 0.42 - 0.5 * cos(2.0 * M_PI * i / (ZOOM_TAPS - 1)) + 0.08 * cos(4.0 * M_PI * i / (ZOOM_TAPS - 1));
+		zs->h[i] = w * ((x == 0.0) ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x));
+		sum += zs->h[i];
+	}
+	for (i = 0; i < ZOOM_TAPS; i++) {
+		zs->h[i] /= sum;
+	}
+	memset(zs->ph, 0, sizeof(zs->ph));
+	zs->nwin = 0;
+	zs->nfft = 0;
+}
+
+/* Level of the power in bins lo..hi, on the same scale as lev (Hann window) */
+static float zoom_level(float *spec, int lo, int hi)
+{
+	int i;
+	float p = 0.0;
+
+	if (lo < 1) {
+		lo = 1;
+	}
+	if (hi > ZOOM_NFFT / 2 - 1) {
+		hi = ZOOM_NFFT / 2 - 1;
+	}
+	for (i = lo; i <= hi; i++) {
+		p += spec[i];
+	}
+	/* the Hann window halves the amplitude and spreads the power over 1.5 bins */
+	return ((sqrt(p / 1.5) / (float) (ZOOM_NFFT / 4)) * 4096.0);
+}
+
+/* Transform a full window of decimated samples and pick out the tone */
+static void zoom_analyze(struct zoom_state *zs, float freq)
+{
+	static double a[ZOOM_NFFT * 2], w[ZOOM_NFFT * 5 / 2];
+	static int ip[NFFTSQRT + 2];
+	float spec[ZOOM_NFFT / 2], m0, m1, tf = 0.0, tl = 0.0, d;
+	int i, k;
+
+	for (i = 0; i < ZOOM_NFFT; i++) {
+		a[i * 2] = zs->win[i] * (0.5 - 0.5 * cos(2.0 * M_PI * i / ZOOM_NFFT)) / 65536.0;
+		a[i * 2 + 1] = 0.0;
+	}
+	ip[0] = 0;
+	cdft(ZOOM_NFFT * 2, -1, a, ip, w);
+	for (i = 0; i < ZOOM_NFFT / 2; i++) {
+		spec[i] = (a[i * 2] * a[i * 2]) + (a[i * 2 + 1] * a[i * 2 + 1]);
+	}
+	k = (int) (freq / ZOOM_BIN_HZ + 0.5);
+	if ((freq > 0.0) && (k >= 3) && (k < ZOOM_NFFT / 2 - 3)) {
+		/* peak near the stimulus, then the Hann two-bin interpolation */
+		for (i = k - 2; i <= k + 2; i++) {
+			if (spec[i] > spec[k]) {
+				k = i;
+			}
+		}
+		m0 = sqrt(spec[k]);
+		m1 = sqrt((spec[k + 1] > spec[k - 1]) ? spec[k + 1] : spec[k - 1]);
+		d = (2.0 * m1 - m0) / (m0 + m1);
+		tf = ((spec[k + 1] > spec[k - 1]) ? k + d : k - d) * ZOOM_BIN_HZ;
+		tl = zoom_level(spec, k - 2, k + 2);
+	} else {
+		k = 0;
+	}
+	pthread_mutex_lock(&zs->lock);
+	memcpy(zs->spec, spec, sizeof(spec));
+	zs->freq = tf;
+	zs->lev = tl;
+	/* voice band noise with the tone and its near sidelobes (+/- 94 Hz) left out */
+	zs->noise = 0.0;
+	for (i = ZOOM_NOISE_LO / ZOOM_BIN_HZ; i <= ZOOM_NOISE_HI / ZOOM_BIN_HZ; i++) {
+		if (!k || (abs(i - k) > 8)) {
+			zs->noise += spec[i];
+		}
+	}
+	zs->noise = (sqrt(zs->noise / 1.5) / (float) (ZOOM_NFFT / 4)) * 4096.0;
+	zs->nfft++;
+	pthread_mutex_unlock(&zs->lock);
+}
+
+/* Decimate one block (sound thread) */
+static void zoom_block(struct zoom_state *zs, short *sbuf, int n, int stride, float freq)
+{
+	float y[ZOOM_OUT], hk;
+	float *u;
+	int i, j, p;
+
+	if (!zs->active || (n != AUDIO_SAMPLES_PER_BLOCK)) {
+		return;
+	}
+	/* split into phase streams, phase p holds samples ZOOM_DECIM - 1 - p of each output period */
+	for (p = 0; p < ZOOM_DECIM; p++) {
+		u = zs->ph[p] + ZOOM_PHASE_TAPS - 1;
+		for (i = 0; i < ZOOM_OUT; i++) {
+			u[i] = sbuf[(i * ZOOM_DECIM + ZOOM_DECIM - 1 - p) * stride];
+		}
+	}
+	memset(y, 0, sizeof(y));
+	for (p = 0; p < ZOOM_DECIM; p++) {
+		for (j = 0; j < ZOOM_PHASE_TAPS; j++) {
+			hk = zs->h[j * ZOOM_DECIM + p];
+			u = zs->ph[p] + ZOOM_PHASE_TAPS - 1 - j;
+			for (i = 0; i < ZOOM_OUT; i++) {
+				y[i] += hk * u[i];
+			}
+		}
+		/* keep the history for the next block */
+		memmove(zs->ph[p], zs->ph[p] + ZOOM_OUT, (ZOOM_PHASE_TAPS - 1) * sizeof(float));
+	}
+	memcpy(zs->win + zs->nwin, y, sizeof(y));
+	zs->nwin += ZOOM_OUT;
+	if (zs->nwin >= ZOOM_NFFT) {
+		zoom_analyze(zs, freq);
+		zs->nwin = 0;
+	}
+}
+
+/* Averaged level in one bin, on the same scale as lev */
+static float specavg_level(struct specavg *sa, int bin)
+{
+	if (!sa->n || (bin < 1) || (bin >= NFFT / 2)) {
+		return (0.0);
+	}
+	return ((sqrt(sa->pow[bin] / sa->n) / (float) (NFFT / 2)) * 4096.0);
+}
+
+/*!
+ * \brief Sample drop/glitch detector
+ *	Phase locks to the stimulus tones.  Every block, each tone is fitted
+ *	(Hann weighted correlation against an oscillator that runs on the
+ *	absolute capture sample index), so a steady tone gives a constant
+ *	phase from block to block.  A dropped or repeated group of samples
+ *	shows up as a phase step, and as a burst in the residual left after
+ *	subtracting the fitted tones from the block.  Tracking starts once
+ *	every tone is present and its phase has been steady for a few blocks
+ *	after a stimulus change.
+ */
+struct glitch_event {
+	unsigned long long t;		/* time of the glitch (us) */
+	float samples;				/* samples lost (+) or repeated (-), 0 if unknown */
+};
+
+struct glitch_state {
+	float freq[2];				/* tones being tracked */
+	int locked;
+	int steady;					/* consecutive blocks with a steady phase */
+	double phase[2];			/* phase of the last block */
+	double refphase[2];			/* phase of the last block before a glitch */
+	int inglitch;				/* a glitch is open, waiting for the phase to settle */
+	float amp[2];				/* amplitude of the last block */
+	float lockamp[2];			/* amplitude when lock was acquired */
+	float resfloor;				/* running residual energy per sub block */
+	int masked;					/* a GPIO output just changed, a click is expected */
+	int maskpend;				/* phase to be checked once the click has passed */
+	volatile int reset;			/* request from the main thread to clear the counts */
+	unsigned long count;
+	int nev;
+	struct glitch_event ev[GLITCH_MAX_EVENTS];
+};
+
+struct glitch_state glitch;
+
+/* Wrap a phase difference into -pi..pi */
+static double wrap_phase(double p)
+{
+	while (p > M_PI) {
+		p -= 2.0 * M_PI;
+	}
+	while (p < -M_PI) {
+		p += 2.0 * M_PI;
+	}
+	return (p);
+}
+
+/*
+ * Ask the sound thread to clear the glitch counts.  Done twice, so that the
+ * second block has certainly seen any stimulus change made before the call.
+ */
+static void glitch_clear(struct glitch_state *gs)
+{
+	int i, j;
+
+	for (j = 0; j < 2; j++) {
+		gs->reset = 1;
+		for (i = 0; gs->reset && (i < 4); i++) {
+			ev_wait_blocks(&evl, 1, 50);
+		}
+	}
+}
+
+/* Record a glitch, the samples are filled in once the phase settles */
+static void glitch_add(struct glitch_state *gs, unsigned long long t)
+{
+	if (gs->nev < GLITCH_MAX_EVENTS) {
+		gs->ev[gs->nev].t = t;
+		gs->ev[gs->nev].samples = 0.0;
+		gs->nev++;
+	}
+	gs->count++;
+	gs->inglitch = 1;
+}
+
+/*
+ * Find the sample shift that best explains the phase steps of all tones.
+ * With a single tone the answer is only known modulo its period.
+ */
+static float glitch_shift(struct glitch_state *gs, float *f, int nt)
+{
+	double step[2], e, beste = 1e30;
+	int k, j, range, best = 0;
+
+	for (j = 0; j < nt; j++) {
+		step[j] = wrap_phase(gs->phase[j] - gs->refphase[j]);
+	}
+	if (nt == 1) {
+		return step[0] * 48000.0 / (2.0 * M_PI * f[0]);
+	}
+	range = GLITCH_MAX_SHIFT;
+	for (k = -range; k <= range; k++) {
+		e = 0.0;
+		for (j = 0; j < nt; j++) {
+			double d = wrap_phase(2.0 * M_PI * f[j] * k / 48000.0 - step[j]);
+
+			e += d * d;
+		}
+		if (e < beste) {
+			beste = e;
+			best = k;
+		}
+	}
+	/* refine to a fraction of a sample with the lowest tone */
+	j = (f[1] < f[0]) ? 1 : 0;
+	return best + wrap_phase(step[j] - 2.0 * M_PI * f[j] * best / 48000.0) * 48000.0 / (2.0 * M_PI * f[j]);
+}
+
+/* Track one block of captured samples (sound thread) */
+static void glitch_block(struct glitch_state *gs, short *sbuf, int n, int stride,
+						 long long idx, unsigned long long t, float freq1, float freq2)
+{
+	static float w[GLITCH_MAX_BLOCK], r[GLITCH_MAX_BLOCK];
+	static int wn = 0;
+	double cr[2], ci[2], or, oi, dr, di, tmp, wsum, dc, d;
+	float f[2], e, worst;
+	int i, j, k, nt, jump, worstsub;
+
+	if ((freq1 != gs->freq[0]) || (freq2 != gs->freq[1])) {
+		gs->freq[0] = freq1;
+		gs->freq[1] = freq2;
+		gs->locked = 0;
+		gs->steady = 0;
+		gs->inglitch = 0;
+		gs->resfloor = 0.0;
+	}
+	if (gs->reset) {			/* after the stimulus check, so locked is current */
+		gs->count = 0;
+		gs->nev = 0;
+		gs->reset = 0;
+	}
+	if (n > GLITCH_MAX_BLOCK) {
+		n = GLITCH_MAX_BLOCK;
+	}
+	if (wn != n) {
+		for (i = 0; i < n; i++) {
+			w[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / n);
+		}
+		wn = n;
+	}
+	nt = 0;
+	if (freq1 > 0.0) {
+		f[nt++] = freq1;
+	}
+	if (freq2 > 0.0) {
+		f[nt++] = freq2;
+	}
+	if (!nt) {
+		return;
+	}
+	wsum = dc = 0.0;
+	for (i = 0; i < n; i++) {
+		wsum += w[i];
+		dc += w[i] * sbuf[i * stride];
+	}
+	dc /= wsum;
+	for (i = 0; i < n; i++) {
+		r[i] = sbuf[i * stride] - dc;
+	}
+	/* fit each tone against an oscillator locked to the capture sample index */
+	for (k = 0; k < nt; k++) {
+		tmp = 2.0 * M_PI * fmod((double) f[k] * idx, 48000.0) / 48000.0;
+		or = cos(tmp);
+		oi = -sin(tmp);
+		dr = cos(2.0 * M_PI * f[k] / 48000.0);
+		di = -sin(2.0 * M_PI * f[k] / 48000.0);
+		cr[k] = ci[k] = 0.0;
+		for (i = 0; i < n; i++) {
+			cr[k] += w[i] * r[i] * or;
+			ci[k] += w[i] * r[i] * oi;
+			tmp = or * dr - oi * di;
+			oi = or * di + oi * dr;
+			or = tmp;
+		}
+	}
+	/* subtract the fitted tones, leaving noise, distortion and glitches */
+	for (k = 0; k < nt; k++) {
+		double a = 2.0 * sqrt(cr[k] * cr[k] + ci[k] * ci[k]) / wsum;
+		double p = atan2(ci[k], cr[k]);
+
+		tmp = 2.0 * M_PI * fmod((double) f[k] * idx, 48000.0) / 48000.0 + p;
+		or = a * cos(tmp);
+		oi = a * sin(tmp);
+		dr = cos(2.0 * M_PI * f[k] / 48000.0);
+		di = sin(2.0 * M_PI * f[k] / 48000.0);
+		for (i = 0; i < n; i++) {
+			r[i] -= or;
+			tmp = or * dr - oi * di;
+			oi = or * di + oi * dr;
+			or = tmp;
+		}
+	}
+	/* phase steps */
+	jump = 0;
+	for (k = 0; k < nt; k++) {
+		double p = atan2(ci[k], cr[k]);
+
+		gs->amp[k] = 2.0 * sqrt(cr[k] * cr[k] + ci[k] * ci[k]) / wsum;
+		tmp = wrap_phase(p - gs->phase[k]);
+		gs->phase[k] = p;
+		if ((gs->amp[k] >= GLITCH_MIN_AMP) && (fabs(tmp) > GLITCH_PHASE_STEP)) {
+			jump = 1;
+		}
+	}
+	if (!gs->locked) {
+		/* every tone must be there, the new one may still be in the playback queue */
+		for (k = 0; k < nt; k++) {
+			if (gs->amp[k] < GLITCH_MIN_AMP) {
+				jump = 1;
+			}
+		}
+		gs->steady = (jump) ? 0 : gs->steady + 1;
+		if (gs->steady >= GLITCH_LOCK_BLOCKS) {
+			gs->locked = 1;
+			for (k = 0; k < nt; k++) {
+				gs->lockamp[k] = gs->amp[k];
+				gs->refphase[k] = gs->phase[k];
+			}
+		}
+	}
+	/* residual energy per sub block */
+	worst = 0.0;
+	worstsub = 0;
+	for (j = 0; j + GLITCH_SUB <= n; j += GLITCH_SUB) {
+		e = 0.0;
+		for (i = j; i < j + GLITCH_SUB; i++) {
+			e += r[i] * r[i];
+		}
+		e /= GLITCH_SUB;
+		if (e > worst) {
+			worst = e;
+			worstsub = j;
+		}
+	}
+	if (!gs->locked) {
+		gs->resfloor = worst;
+		return;
+	}
+	if (gs->masked) {
+		/* the click disturbs phase and residual, judge the phase once it has passed */
+		gs->maskpend = 1;
+		return;
+	}
+	if (gs->maskpend) {
+		gs->maskpend = 0;
+		for (k = 0; k < nt; k++) {
+			if ((gs->amp[k] >= GLITCH_MIN_AMP) &&
+				(fabs(wrap_phase(gs->phase[k] - gs->refphase[k])) > GLITCH_PHASE_STEP) && !gs->inglitch) {
+				glitch_add(gs, t);
+			}
+		}
+	}
+	if (jump || ((worst > gs->resfloor * GLITCH_RES_FACTOR) &&
+				 (worst > gs->lockamp[0] * gs->lockamp[0] * GLITCH_RES_MIN))) {
+		/* a glitch spreads over the block it happens in and the next */
+		if (!gs->inglitch) {
+			glitch_add(gs, t - ((n - worstsub) * 1000000ULL / 48000));
+		}
+		return;
+	}
+	if (gs->inglitch) {
+		d = glitch_shift(gs, f, nt);
+		if ((gs->nev > 0) && (gs->count <= GLITCH_MAX_EVENTS)) {
+			gs->ev[gs->nev - 1].samples = d;
+		}
+		gs->inglitch = 0;
+	}
+	for (k = 0; k < nt; k++) {
+		gs->refphase[k] = gs->phase[k];
+	}
+	gs->resfloor += (worst - gs->resfloor) * 0.1;
+}
+
+/* Print the glitches recorded, times relative to start */
+static void glitch_print(struct glitch_state *gs, unsigned long long start)
+{
+	int i;
+
+	for (i = 0; i < gs->nev; i++) {
+		if (fabs(gs->ev[i].samples) >= 0.5) {
+			printf("  glitch at %.3f s, %.1f sample(s) %s\n", ((long long) gs->ev[i].t - (long long) start) / 1000000.0,
+				   fabs(gs->ev[i].samples), (gs->ev[i].samples > 0.0) ? "lost" : "repeated");
+		} else {
+			printf("  glitch at %.3f s, residual burst\n", ((long long) gs->ev[i].t - (long long) start) / 1000000.0);
+		}
+	}
+	if (gs->count > gs->nev) {
+		printf("  (%lu more not listed)\n", gs->count - gs->nev);
+	}
+}
+
+/*!
+ * \brief PTT keying click detector
+ *	Streams the captured samples through a first difference detector.
+ *	The main thread arms the detector just before keying PTT (freezing the
+ *	quiet baseline), then posts the time of the GPIO edge.  Runs of samples
+ *	whose step exceeds the threshold are merged into bursts, so only a few
+ *	numbers are kept per edge instead of the capture itself.
+ */
+struct click_burst {
+	long long start;			/* capture sample index */
+	long long end;
+	float peak;					/* largest excursion from the baseline, in counts */
+};
+
+struct click_state {
+	volatile int armed;
+	volatile int done;
+	volatile unsigned long long edge;	/* time of the GPIO edge (us), 0 until posted */
+	long long edgeidx;			/* capture sample index of the edge, -1 until known */
+	float mean;					/* running mean of the signal */
+	float dms;					/* running mean square of the first difference */
+	float thresh;
+	float prev;
+	int nbursts;
+	struct click_burst bursts[CLICK_MAX_BURSTS];
+	/* results */
+	float peak;
+	float duration;				/* ms */
+	float offset;				/* ms from the edge to the start of the transient */
+};
+
+struct click_state click;
+
+/* Arm the detector before changing the PTT output */
+static void click_arm(struct click_state *cs)
+{
+	cs->done = 0;
+	cs->edge = 0;
+	cs->edgeidx = -1;
+	cs->nbursts = 0;
+	cs->peak = cs->duration = cs->offset = 0.0;
+	cs->thresh = 0.0;
+	cs->armed = 1;
+}
+
+/* Finish an edge, merging the bursts that fall inside the analysis window */
+static void click_finish(struct click_state *cs)
+{
+	long long lo, hi, first = -1, last = -1;
+	int i;
+
+	lo = cs->edgeidx - (CLICK_PRE_MS * 48);
+	hi = cs->edgeidx + (CLICK_POST_MS * 48);
+	for (i = 0; i < cs->nbursts; i++) {
+		if ((cs->bursts[i].end < lo) || (cs->bursts[i].start > hi)) {
+			continue;
+		}
+		if (first < 0) {
+			first = cs->bursts[i].start;
+		}
+		last = cs->bursts[i].end;
+		if (cs->bursts[i].peak > cs->peak) {
+			cs->peak = cs->bursts[i].peak;
+		}
+	}
+	if (first >= 0) {
+		cs->duration = (last - first + 1) / 48.0;
+		cs->offset = (first - cs->edgeidx) / 48.0;
+	}
+	cs->armed = 0;
+	cs->done = 1;
+}
+
+/* Run one block of captured samples through the detector (sound thread) */
+static void click_block(struct click_state *cs, short *sbuf, int n, int stride,
+						long long idx, unsigned long long t)
+{
+	struct click_burst *b;
+	float x, d, e;
+	int i;
+
+	if (cs->armed && !cs->thresh) {
+		/* freeze the quiet baseline at the time of arming */
+		cs->thresh = sqrt(cs->dms) * CLICK_THRESH_FACTOR;
+		if (cs->thresh < CLICK_MIN_STEP) {
+			cs->thresh = CLICK_MIN_STEP;
+		}
+	}
+	if (cs->armed && cs->edge && (cs->edgeidx < 0)) {
+		/* the last sample of this block was captured at about t */
+		cs->edgeidx = idx + n - ((long long) t - (long long) cs->edge) * 48 / 1000;
+	}
+	for (i = 0; i < n; i++, idx++) {
+		x = sbuf[i * stride];
+		d = x - cs->prev;
+		cs->prev = x;
+		if (!cs->armed) {
+			cs->mean += (x - cs->mean) * CLICK_EMA;
+			cs->dms += ((d * d) - cs->dms) * CLICK_EMA;
+			continue;
+		}
+		e = fabs(x - cs->mean);
+		if (fabs(d) > cs->thresh) {
+			b = (cs->nbursts) ? &cs->bursts[cs->nbursts - 1] : NULL;
+			if (b && (idx - b->end <= CLICK_GAP)) {
+				b->end = idx;
+			} else if (cs->nbursts < CLICK_MAX_BURSTS) {
+				b = &cs->bursts[cs->nbursts++];
+				b->start = b->end = idx;
+				b->peak = 0.0;
+			} else {
+				b = NULL;
+			}
+			if (b && (e > b->peak)) {
+				b->peak = e;
+			}
+		} else if (cs->nbursts && (idx - cs->bursts[cs->nbursts - 1].end <= CLICK_GAP)) {
+			/* the excursion can outlast the steep edges */
+			if (e > cs->bursts[cs->nbursts - 1].peak) {
+				cs->bursts[cs->nbursts - 1].peak = e;
+			}
+		}
+	}
+	if (cs->armed && (cs->edgeidx >= 0) && (idx >= cs->edgeidx + (CLICK_POST_MS * 48))) {
+		click_finish(cs);
+	}
+}
+
+/*!
+ * \brief Shared memory capture ring
+ *	With -s <name>, every analysis frame is copied from the capture ring
+ *	into a slot of a POSIX shared memory ring, with the analyzer's power
+ *	spectrum for that frame next to it.  A slot holds NFFT frames and one
+ *	is published every hop frames, so with -H shorter than a block the
+ *	slots overlap, and blockno counts analysis frames, not reads.  External tools map the segment read only
+ *	(shm_open(name, O_RDONLY) + mmap(PROT_READ)) and never block the audio
+ *	thread; a reader that falls behind simply loses the oldest slots.
+ *
+ *	Reader protocol (seqlock):
+ *	  n = hdr->seq;  slot = n - 1 (mod nslots) is the newest frame.
+ *	  s1 = slot->seq; copy the slot; s2 = slot->seq;
+ *	  the copy is good if s1 == s2 and s1 is even and non-zero.
+ *	slot->seq is odd while the slot is being written.  A slot is only
+ *	claimed for a whole frame already in the capture ring and is always
+ *	published, never handed back, so an even seq always means a whole,
+ *	consistent slot.
+ */
+struct shm_slot {
+	volatile unsigned long long seq;
+	unsigned long long blockno;			/* analysis frame number */
+	unsigned long long t;				/* CLOCK_MONOTONIC of the read, us */
+	float freq1, freq2;					/* stimulus in effect */
+	float lev, lev1, lev2;				/* analyzer levels for the frame */
+	short raw[AUDIO_SAMPLES_PER_BLOCK];	/* the frame analyzed, mono S16 */
+	float spec[NFFT / 2];				/* power per FFT bin (46.875 Hz) */
+};
+
+struct shm_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int nslots;
+	unsigned int slotsize;				/* bytes per slot */
+	unsigned int hdrsize;				/* offset of slot 0 */
+	unsigned int rate;
+	unsigned int channels;				/* interleaved channels in raw */
+	unsigned int nsamples;				/* samples per channel in raw */
+	unsigned int nbins;
+	unsigned int hop;					/* frames between slots, raw overlaps if < nsamples */
+	volatile unsigned long long seq;	/* slots published */
+};
+
+char *shmname = NULL;
+struct shm_header *shmhdr = NULL;
+size_t shmlen = 0;
+
+#define	SHM_SLOT(n) ((struct shm_slot *) ((char *) shmhdr + shmhdr->hdrsize + \
+			(((n) % shmhdr->nslots) * shmhdr->slotsize)))
+
+/* Create the shared memory ring */
+static int shm_ring_open(char *name)
+{
+	int fd;
+	size_t len, hlen;
+
+	hlen = (sizeof(struct shm_header) + 63) & ~63;
+	len = hlen + SHM_SLOTS * sizeof(struct shm_slot);
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		printf("Unable to create shared memory %s: %s\n", name, strerror(errno));
+		return (-1);
+	}
+	if (ftruncate(fd, len) < 0) {
+		printf("Unable to size shared memory %s: %s\n", name, strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	shmhdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shmhdr == MAP_FAILED) {
+		shmhdr = NULL;
+		printf("Unable to map shared memory %s: %s\n", name, strerror(errno));
+		return (-1);
+	}
+	shmlen = len;
+	memset(shmhdr, 0, len);
+	shmhdr->version = SHM_VERSION;
+	shmhdr->nslots = SHM_SLOTS;
+	shmhdr->slotsize = sizeof(struct shm_slot);
+	shmhdr->hdrsize = hlen;
+	shmhdr->rate = 48000;
+	shmhdr->channels = 1;
+	shmhdr->nsamples = AUDIO_SAMPLES_PER_BLOCK;
+	shmhdr->nbins = NFFT / 2;
+	shmhdr->hop = hop;
+	__sync_synchronize();
+	shmhdr->magic = SHM_MAGIC;			/* readers check this last */
+	printf("Publishing capture and spectra in shared memory %s (%d slots)\n", name, SHM_SLOTS);
+	return (0);
+}
+
+/* Remove the shared memory ring, once the sound thread has stopped (the fd was closed when it was mapped) */
+static void shm_ring_close(void)
+{
+	if (shmhdr) {
+		shm_unlink(shmname);
+		munmap(shmhdr, shmlen);
+		shmhdr = NULL;
+	}
+}
+
+/* Claim the next slot for writing (sound thread) */
+static struct shm_slot *shm_slot_begin(void)
+{
+	struct shm_slot *slot = SHM_SLOT(shmhdr->seq);
+
+	slot->seq++;				/* odd, being written */
+	__sync_synchronize();
+	return (slot);
+}
+
+/* Publish a slot (sound thread) */
+static void shm_slot_end(struct shm_slot *slot)
+{
+	__sync_synchronize();
+	slot->seq++;				/* even, complete */
+	shmhdr->seq++;
+}
+
+/* Controls mixer_setup() changes */
+static char *mixer_saved_params[MIXER_SAVED_PARAMS] = {
+	MIXER_PARAM_MIC_PLAYBACK_SW, MIXER_PARAM_MIC_PLAYBACK_VOL, MIXER_PARAM_SPKR_PLAYBACK_SW,
+	MIXER_PARAM_SPKR_PLAYBACK_VOL, MIXER_PARAM_SPKR_PLAYBACK_SW_NEW, MIXER_PARAM_SPKR_PLAYBACK_VOL_NEW,
+	MIXER_PARAM_MIC_CAPTURE_VOL, MIXER_PARAM_MIC_BOOST, MIXER_PARAM_MIC_CAPTURE_SW
+};
+
+struct mixer_saved {
+	int n[MIXER_SAVED_PARAMS];	/* values read, -1 for a missing control */
+	int v[MIXER_SAVED_PARAMS][2];
+};
+
+/* Save the controls of a sound card that mixer_setup() is about to change */
+static void mixer_save(int card, struct mixer_saved *ms)
+{
+	int i;
+
+	for (i = 0; i < MIXER_SAVED_PARAMS; i++) {
+		ms->n[i] = amixer_values(card, mixer_saved_params[i], ms->v[i], 0);
+	}
+}
+
+/* And put them back */
+static void mixer_restore(int card, struct mixer_saved *ms)
+{
+	int i;
+
+	for (i = 0; i < MIXER_SAVED_PARAMS; i++) {
+		if (ms->n[i] > 0) {
+			amixer_values(card, mixer_saved_params[i], ms->v[i], 1);
+		}
+	}
+}
+
+/*
+ * Set up the mixer of a sound card for loopback tests, returns the capture
+ * setting.  The playback range and control name are returned in *spkrmax
+ * and *spkrname.
+ */
+static int mixer_setup(int card, int type, int *micmax, int *spkrmax, char **spkrname)
+{
+	int adjust, setting;
+	int micparam1 = 0;
+	char newname = 0;
+
+	*micmax = amixer_max(card, MIXER_PARAM_MIC_CAPTURE_VOL);
+	*spkrmax = amixer_max(card, MIXER_PARAM_SPKR_PLAYBACK_VOL);
+
+	if (*spkrmax == -1) {
+		newname = 1;
+		*spkrmax = amixer_max(card, MIXER_PARAM_SPKR_PLAYBACK_VOL_NEW);
+	}
+	*spkrname = (newname) ? MIXER_PARAM_SPKR_PLAYBACK_VOL_NEW : MIXER_PARAM_SPKR_PLAYBACK_VOL;
+
+	setamixer(card, MIXER_PARAM_MIC_PLAYBACK_SW, 0, 0);
+	setamixer(card, MIXER_PARAM_MIC_PLAYBACK_VOL, 0, 0);
+	setamixer(card, (newname) ? MIXER_PARAM_SPKR_PLAYBACK_SW_NEW : MIXER_PARAM_SPKR_PLAYBACK_SW, 1, 0);
+	setamixer(card, *spkrname, *spkrmax, *spkrmax);
+	switch (type)
+	{
+		case DEV_C108:
+			adjust = C108_ADJUST;
+			break;
+		case DEV_C108AH:
+			adjust = C108AH_ADJUST;
+			break;
+		case DEV_C119:
+			adjust = C119_ADJUST;
+			break;
+		case DEV_C119A:
+			adjust = C119A_ADJUST;
+			break;
+		case DEV_C119B:
+			adjust = C119B_ADJUST;
+			micparam1 = 1;
+			break;
+		default:
+			adjust = DEFAULT_ADJUST;
+	}
+	setting = AUDIO_IN_SETTING * *micmax / adjust;
+	setamixer(card, MIXER_PARAM_MIC_CAPTURE_VOL, setting, 0);
+	setamixer(card, MIXER_PARAM_MIC_BOOST, micparam1, 0);
+	setamixer(card, MIXER_PARAM_MIC_CAPTURE_SW, 1, 0);
+	return (setting);
+}
+
+/*!
+ * \brief Receive monitor
+ *	For a URI on a live receiver.  The main thread follows COR through the
+ *	GPIO sampler and opens the gate while it is active; only then does the
+ *	sound thread analyze the capture, so between transmissions the audio
+ *	is read and dropped.  Each transmission gets the voice band level (mean
+ *	and peak; receiver audio is proportional to deviation), the noise above
+ *	the voice band and the CTCSS tone.  For CTCSS the audio is low passed,
+ *	decimated to 1500 Hz and correlated with every standard tone over 1
+ *	second windows.  The tone with the most energy is the one in use, and
+ *	the drift of its window phases gives its frequency offset.
+ */
+static const float ctcss_tones[MON_NTONES] = {
+	67.0, 69.3, 71.9, 74.4, 77.0, 79.7, 82.5, 85.4, 88.5, 91.5, 94.8, 97.4, 100.0,
+	103.5, 107.2, 110.9, 114.8, 118.8, 123.0, 127.3, 131.8, 136.5, 141.3, 146.2, 150.0,
+	151.4, 156.7, 159.8, 162.2, 165.5, 167.9, 171.3, 173.8, 177.3, 179.9, 183.5, 186.2,
+	189.9, 192.8, 196.6, 199.5, 203.5, 206.5, 210.7, 218.1, 225.7, 229.1, 233.6, 241.8,
+	250.3, 254.1
+};
+
+struct mon_ctcss {
+	double bq[2][5];			/* low pass biquads, b0 b1 b2 a1 a2 */
+	double st[2][2];
+	double dc;
+	int phase;					/* input samples since the last decimated one */
+	unsigned long long n;		/* decimated samples */
+	int nwin;
+	double cr[MON_NTONES], ci[MON_NTONES];	/* tone phasors and their steps */
+	double dr[MON_NTONES], di[MON_NTONES];
+	double zr[MON_NTONES], zi[MON_NTONES];	/* correlation over the window */
+	double energy[MON_NTONES];
+	double lastph[MON_NTONES];
+	struct linfit drift[MON_NTONES];	/* unwrapped window phase against window */
+	int windows;
+};
+
+struct mon_state {
+	pthread_mutex_t lock;
+	volatile int active;		/* monitor running, the analyzer idles while the gate is closed */
+	volatile int open;			/* COR active */
+	unsigned long long skip;	/* audio read before this is the COR attack */
+	struct runstat level;		/* voice band level per frame */
+	struct runstat noise;
+	struct mon_ctcss ct;
+};
+
+struct mon_state mon = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* One transmission */
+struct mon_rec {
+	time_t start;
+	float secs;
+	int ctcssin;				/* the CTCSS decoder input was active */
+	unsigned long frames;
+	float level, peak, noise;
+	int tone;					/* ctcss_tones index, -1 for none */
+	float tonefreq, tonelevel;
+	int tonewins;
+};
+
+/* Butterworth section of the CTCSS low pass */
+static void mon_biquad(double *c, double fc, double q)
+{
+	double w0 = 2.0 * M_PI * fc / 48000.0, alpha = sin(w0) / (2.0 * q), a0 = 1.0 + alpha;
+
+	c[0] = (1.0 - cos(w0)) / 2.0 / a0;
+	c[1] = (1.0 - cos(w0)) / a0;
+	c[2] = c[0];
+	c[3] = -2.0 * cos(w0) / a0;
+	c[4] = (1.0 - alpha) / a0;
+}
+
+/* Tone phasors for the decimated sample count, so window phases are absolute */
+static void mon_phasors(struct mon_ctcss *ct)
+{
+	double p;
+	int k;
+
+	for (k = 0; k < MON_NTONES; k++) {
+		p = 2.0 * M_PI * fmod(ctcss_tones[k] * (double) ct->n / MON_RATE, 1.0);
+		ct->cr[k] = cos(p);
+		ct->ci[k] = sin(p);
+		ct->dr[k] = cos(2.0 * M_PI * ctcss_tones[k] / MON_RATE);
+		ct->di[k] = sin(2.0 * M_PI * ctcss_tones[k] / MON_RATE);
+	}
+}
+
+/* End of a CTCSS window */
+static void mon_ctcss_window(struct mon_ctcss *ct)
+{
+	double ph;
+	int k;
+
+	for (k = 0; k < MON_NTONES; k++) {
+		ct->energy[k] += ct->zr[k] * ct->zr[k] + ct->zi[k] * ct->zi[k];
+		ph = atan2(ct->zi[k], ct->zr[k]);
+		if (ct->windows) {
+			ph = ct->lastph[k] + wrap_phase(ph - ct->lastph[k]);
+		}
+		linfit_add(&ct->drift[k], ct->windows, ph);
+		ct->lastph[k] = ph;
+		ct->zr[k] = ct->zi[k] = 0.0;
+	}
+	ct->windows++;
+	ct->nwin = 0;
+	mon_phasors(ct);
+}
+
+/* Open (COR active at t) or close the gate (main thread) */
+static void mon_gate(struct mon_state *ms, int open, unsigned long long t)
+{
+	int k;
+
+	pthread_mutex_lock(&ms->lock);
+	if (open) {
+		runstat_init(&ms->level);
+		runstat_init(&ms->noise);
+		memset(&ms->ct, 0, sizeof(ms->ct));
+		mon_biquad(ms->ct.bq[0], MON_CTCSS_FC, 0.5412);
+		mon_biquad(ms->ct.bq[1], MON_CTCSS_FC, 1.3066);
+		for (k = 0; k < MON_NTONES; k++) {
+			linfit_init(&ms->ct.drift[k]);
+		}
+		mon_phasors(&ms->ct);
+		ms->skip = t + MON_ATTACK_MS * 1000ULL;
+	}
+	ms->open = open;
+	pthread_mutex_unlock(&ms->lock);
+}
+
+/* CTCSS decoding of a capture block (sound thread) */
+static void mon_block(struct mon_state *ms, short *sbuf, int n, unsigned long long tread)
+{
+	struct mon_ctcss *ct = &ms->ct;
+	double x, y;
+	int i, j, k;
+
+	pthread_mutex_lock(&ms->lock);
+	if (!ms->open || (tread < ms->skip)) {
+		pthread_mutex_unlock(&ms->lock);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		ct->dc += (sbuf[i] - ct->dc) * 0.0005;
+		x = sbuf[i] - ct->dc;
+		for (j = 0; j < 2; j++) {
+			y = ct->bq[j][0] * x + ct->st[j][0];
+			ct->st[j][0] = ct->bq[j][1] * x - ct->bq[j][3] * y + ct->st[j][1];
+			ct->st[j][1] = ct->bq[j][2] * x - ct->bq[j][4] * y;
+			x = y;
+		}
+		if (++ct->phase < MON_DECIM) {
+			continue;
+		}
+		ct->phase = 0;
+		for (k = 0; k < MON_NTONES; k++) {
+			ct->zr[k] += x * ct->cr[k];
+			ct->zi[k] -= x * ct->ci[k];
+			y = ct->cr[k] * ct->dr[k] - ct->ci[k] * ct->di[k];
+			ct->ci[k] = ct->cr[k] * ct->di[k] + ct->ci[k] * ct->dr[k];
+			ct->cr[k] = y;
+		}
+		ct->n++;
+		if (++ct->nwin == MON_CTCSS_WIN) {
+			mon_ctcss_window(ct);
+		}
+	}
+	pthread_mutex_unlock(&ms->lock);
+}
+
+/* Levels of an analyzed frame (sound thread) */
+static void mon_frame(struct mon_state *ms, float *spec, unsigned long long tread)
+{
+	double v = 0.0, nz = 0.0;
+	int i;
+
+	pthread_mutex_lock(&ms->lock);
+	if (ms->open && (tread >= ms->skip)) {
+		for (i = MON_VOICE_LO / FFT_BIN_HZ; i <= MON_VOICE_HI / FFT_BIN_HZ; i++) {
+			v += spec[i];
+		}
+		for (i = MON_NOISE_LO / FFT_BIN_HZ; i <= MON_NOISE_HI / FFT_BIN_HZ; i++) {
+			nz += spec[i];
+		}
+		runstat_add(&ms->level, (sqrt(v) / (float) (NFFT / 2)) * 4096.0);
+		runstat_add(&ms->noise, (sqrt(nz) / (float) (NFFT / 2)) * 4096.0);
+	}
+	pthread_mutex_unlock(&ms->lock);
+}
+
+/*!
+ * \brief Capture framer
+ *	Reads of any size, even partial frames, go into a byte ring so no
+ *	audio is lost and nothing depends on the driver's fragment size.  The
+ *	stream consumers (click and glitch detectors, zoom decimator) get
+ *	contiguous blocks of AUDIO_SAMPLES_PER_BLOCK frames; the spectrum
+ *	analysis runs on NFFT frame windows every hop frames (-H), which
+ *	overlap when the hop is shorter than a block.
+ */
+struct framer {
+	unsigned char ring[FRAMER_BYTES];
+	unsigned long long wr;		/* bytes read */
+	unsigned long long blk;		/* start of the next block */
+	unsigned long long frm;		/* start of the next analysis frame */
+};
+
+struct framer framer;
+
+/* Read what the driver has, returns bytes read or <= 0 */
+static int framer_read(struct framer *fr, int fd)
+{
+	unsigned long long oldest = (fr->frm < fr->blk) ? fr->frm : fr->blk;
+	int off = fr->wr % FRAMER_BYTES;
+	int len = FRAMER_BYTES - (fr->wr - oldest);
+	int res;
+
+	if (len > FRAMER_BYTES - off) {
+		len = FRAMER_BYTES - off;	/* up to the wrap, the next read gets the rest */
+	}
+	if (len <= 0) {
+		return (0);
+	}
+	res = read(fd, fr->ring + off, len);
+	if (res > 0) {
+		fr->wr += res;
+	}
+	return (res);
+}
+
+/* Copy len bytes starting at stream byte pos out of the ring */
+static void framer_get(struct framer *fr, unsigned long long pos, void *dst, int len)
+{
+	int off = pos % FRAMER_BYTES;
+	int n = (len < FRAMER_BYTES - off) ? len : FRAMER_BYTES - off;
+
+	memcpy(dst, fr->ring + off, n);
+	memcpy((char *) dst + n, fr->ring, len - n);
+}
+
+/* Level correction of the CM108AH/CM119 family, applied in place */
+static void capture_scale(short *sbuf, int n)
+{
+	float gfac = 1.0;
+	int i;
+
+	if (devtype == DEV_C108AH || devtype == DEV_C119 ||
+		devtype == DEV_C119A || devtype == DEV_C119B) {
+		gfac = 0.7499;
+	}
+	for (i = 0; i < n; i++) {
+		sbuf[i] = (int) (((float) sbuf[i] + 32768) * gfac) - 32768;
+	}
+}
+
+/* Was the capture at tread within reach of the last GPIO output change */
+static int capture_gpioclick(unsigned long long tread)
+{
+	unsigned long long edge = lastout_us;
+
+	return (edge && (tread >= edge) && (tread - edge < DIO_GUARD_US + AUDIO_BLOCK_US));
+}
+
+/* The next contiguous block to the stream consumers (sound thread) */
+static void sound_block(struct framer *fr, unsigned long long tread)
+{
+	short sbuf[AUDIO_SAMPLES_PER_BLOCK];
+	long long capsamples = fr->blk / CAPTURE_FRAME_BYTES;
+
+	framer_get(fr, fr->blk, sbuf, CAPTURE_BLOCKSIZE);
+	capture_scale(sbuf, AUDIO_SAMPLES_PER_BLOCK);
+	click_block(&click, sbuf, AUDIO_SAMPLES_PER_BLOCK, 1, capsamples, tread);
+	/* a GPIO output change clicks in the audio, keep the block out of the measurements */
+	glitch.masked = capture_gpioclick(tread);
+	glitch_block(&glitch, sbuf, AUDIO_SAMPLES_PER_BLOCK, 1, capsamples, tread, myfreq1, myfreq2);
+	zoom_block(&zoom, sbuf, AUDIO_SAMPLES_PER_BLOCK, 1, myfreq1);
+	if (mon.open) {
+		mon_block(&mon, sbuf, AUDIO_SAMPLES_PER_BLOCK, tread);
+	}
+}
+
+/* Spectrum analysis of the next frame (sound thread) */
+static void sound_frame(struct framer *fr, unsigned long long tread)
+{
+	short sbuf[AUDIO_SAMPLES_PER_BLOCK];
+	static double afft[(NFFT + 1) * 2 + 1], wfft[NFFT * 5 / 2];
+	static float spec[NFFT / 2];
+	static int ipfft[NFFTSQRT + 2];
+	float mylev, mylev1, mylev2, mynoise;
+	float f1 = myfreq1, f2 = myfreq2;
+	struct shm_slot *slot = NULL;
+	struct tone_plan *tp;
+	int i, gpioclick, lo1 = 1, hi1 = 0, lo2 = 1, hi2 = 0;
+
+	if (mon.active && !mon.open) {
+		return;					/* receive monitor between transmissions */
+	}
+	if (shmhdr) {
+		/* the shared ring gets the frame as read, the analyzer works on a copy */
+		slot = shm_slot_begin();
+		framer_get(fr, fr->frm, slot->raw, CAPTURE_BLOCKSIZE);
+		memcpy(sbuf, slot->raw, CAPTURE_BLOCKSIZE);
+	} else {
+		framer_get(fr, fr->frm, sbuf, CAPTURE_BLOCKSIZE);
+	}
+	capture_scale(sbuf, AUDIO_SAMPLES_PER_BLOCK);
+	gpioclick = capture_gpioclick(tread);
+	memset(afft, 0, sizeof(double) * 2 * (NFFT + 1));
+	for (i = 0; i < NFFT; i++) {
+		afft[i * 2] = (double) (sbuf[i] + 32768) / (double) 65536.0;
+	}
+	ipfft[0] = 0;
+	cdft(NFFT * 2, -1, afft, ipfft, wfft);
+	if (f1 > 0.0) {
+		tp = tone_for(0, f1);
+		lo1 = tp->binlo;
+		hi1 = tp->binhi;
+	}
+	if (f2 > 0.0) {
+		tp = tone_for(1, f2);
+		lo2 = tp->binlo;
+		hi2 = tp->binhi;
+	}
+	mylev = 0.0;
+	mylev1 = 0.0;
+	mylev2 = 0.0;
+	mynoise = 0.0;
+	for (i = 1; i < NFFT / 2; i++) {
+		float ftmp;
+		int intone = 0;
+
+		ftmp = (afft[i * 2] * afft[i * 2]) + (afft[i * 2 + 1] * afft[i * 2 + 1]);
+		spec[i] = ftmp;
+
+		mylev += ftmp;
+		if ((i >= lo1) && (i <= hi1)) {
+			mylev1 += ftmp;
+			intone = 1;
+		}
+		if ((i >= lo2) && (i <= hi2)) {
+			mylev2 += ftmp;
+			intone = 1;
+		}
+		if (!intone) {
+			mynoise += ftmp;
+		}
+	}
+	lev = (sqrt(mylev) / (float) (NFFT / 2)) * 4096.0;
+	lev1 = (sqrt(mylev1) / (float) (NFFT / 2)) * 4096.0;
+	lev2 = (sqrt(mylev2) / (float) (NFFT / 2)) * 4096.0;
+	levnoise = (sqrt(mynoise) / (float) (NFFT / 2)) * 4096.0;
+	if (glitch.locked && (myfreq1 > 0.0) && (myfreq2 > 0.0)) {
+		levwin_phase(&lwin, glitch.phase[0], glitch.phase[1], gpioclick);
+	}
+	/* bin 0 is the block mean, offset by the +32768 above */
+	levwin_block(&lwin, lev1, lev2, afft[0] / NFFT * 65536.0 - 32768.0, gpioclick);
+	specavg_block(&savg, spec);
+	spuravg_block(&spavg, sbuf);
+	if (mon.open) {
+		mon_frame(&mon, spec, tread);
+	}
+	if (slot) {
+		slot->blockno = fr->frm / (hop * CAPTURE_FRAME_BYTES);
+		slot->t = tread;
+		slot->freq1 = myfreq1;
+		slot->freq2 = myfreq2;
+		slot->lev = lev;
+		slot->lev1 = lev1;
+		slot->lev2 = lev2;
+		memcpy(slot->spec, spec, sizeof(slot->spec));
+		shm_slot_end(slot);
+	}
+	measfreq1 = (myfreq1 > 0.0) ? tone_freq(spec, myfreq1) : 0.0;
+	measfreq2 = (myfreq2 > 0.0) ? tone_freq(spec, myfreq2) : 0.0;
+	if (soak.active) {
+		float v[SOAK_NQ];
+
+		v[SOAK_LEV1] = lev1;
+		v[SOAK_LEV2] = lev2;
+		v[SOAK_NOISE] = levnoise;
+		v[SOAK_FREQ1] = measfreq1;
+		v[SOAK_FREQ2] = measfreq2;
+		soak_block(&soak, now_us(), v);
+	}
+}
+
+/* Open the sound device and add it to the sound thread's poll set, returns -1 if it could not be opened */
+static int soundthread_open(int epfd, int *rfd, int *wfd)
+{
+	struct epoll_event ev;
+
+	soundfail = (soundopen_pair(devnum, rfd, wfd) < 0);
+	if (soundfail) {
+		printf("Unable to open sound device %d, no audio will be played or analyzed!!\r\n", devnum);
+		return (-1);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = *rfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, *rfd, &ev);
+	ev.events = EPOLLOUT;
+	ev.data.fd = *wfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, *wfd, &ev);
+	return (0);
+}
+
+/* Sound card processing thread */
+void *soundthread(void *this)
+{
+	int rfd, wfd, epfd, micmax;
+	struct epoll_event ev;
+	unsigned long long cnt;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	soundthread_open(epfd, &rfd, &wfd);
+	capset = mixer_setup(devnum, devtype, &micmax, &spkrmax, &spkrparam);
+	capdefault = capset;
+	capmax = micmax;
+	spkrset = spkrmax;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = evl.wakefd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, evl.wakefd, &ev);
+
+	while (!shutdown) {
+		int res;
+
+		res = epoll_wait(epfd, &ev, 1, -1);
+		if (!res || ((res < 0) && (errno == EINTR))) {
+			continue;
+		}
+		if (res < 0) {
+			perror("poll");
+			exit(255);
+		}
+		if ((ev.data.fd != rfd) && (ev.data.fd != wfd)) {
+			/* woken for shutdown, or to let go of the device for a while */
+			if (read(evl.wakefd, &cnt, sizeof(cnt)) < 0) {
+				cnt = 0;
+			}
+			if (soundhold && !shutdown) {
+				if (rfd >= 0) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, rfd, NULL);
+					epoll_ctl(epfd, EPOLL_CTL_DEL, wfd, NULL);
+					close(rfd);
+					close(wfd);
+				}
+				soundheld = 1;
+				while (soundhold && !shutdown) {
+					if ((epoll_wait(epfd, &ev, 1, -1) > 0) && (read(evl.wakefd, &cnt, sizeof(cnt)) < 0)) {
+						cnt = 0;
+					}
+				}
+				soundthread_open(epfd, &rfd, &wfd);
+				xrun.primed = 0;
+				framer.wr = framer.frm = framer.blk;	/* drop any partial block */
+				soundheld = 0;
+			}
+			continue;
+		}
+		if (ev.data.fd == wfd) {
+			xrun_playback(&xrun, wfd);
+			outaudio(wfd, myfreq1, myfreq2);
+			if (jit.active) {
+				jitter_playback(&jit, wfd, now_us());
+			}
+			continue;
+		}
+		if (ev.events & EPOLLIN) {
+			unsigned long long tread;
+
+			res = framer_read(&framer, rfd);
+			tread = now_us();
+			if (res <= 0) {
+				continue;
+			}
+			xrun_capture(&xrun, rfd);
+			if (jit.active) {
+				jitter_capture(&jit, rfd, tread, res / CAPTURE_FRAME_BYTES);
+			}
+			/* every complete block, then the frames that end inside it */
+			while (framer.wr - framer.blk >= CAPTURE_BLOCKSIZE) {
+				sound_block(&framer, tread);
+				framer.blk += CAPTURE_BLOCKSIZE;
+				while (framer.frm + CAPTURE_BLOCKSIZE <= framer.blk) {
+					sound_frame(&framer, tread);
+					framer.frm += hop * CAPTURE_FRAME_BYTES;
+				}
+				ev_signal(evl.blockfd);
+			}
+		}
+	}
+	close(epfd);
+	if (rfd >= 0) {
+		close(rfd);
+		close(wfd);
+	}
+	pthread_exit(NULL);
+}
+
+/*!
+ * \brief Per-unit calibration cache
+ *	Units that are re-tested often are calibrated once: the capture mixer
+ *	setting that brings the 1004 Hz loopback to PASSBAND_LEVEL, the
+ *	resulting loopback gain, the capture DC offset and the response of each
+ *	channel relative to 1004 Hz.  The results are kept in a binary file of
+ *	fixed size records sorted by unit key, mapped read only and searched
+ *	with bsearch(), so a lookup costs nothing.  Updates rewrite the file to
+ *	a temporary name and rename it over the old one.  The record is looked
+ *	up at startup and the system test reports its levels against it, but
+ *	the capture setting is only changed by 'a'; the test always runs at the
+ *	default setting, so gain drift still fails it.
+ *
+ *	The unit key is a 64 bit FNV-1a hash of the fixed identity of the unit:
+ *	the USB ids, the serial number string and the manufacturer area of the
+ *	EEPROM (the user area after it is rewritten by 'E' and the channel
+ *	drivers).  Units with neither a serial number nor manufacturer data
+ *	can't be told apart and are not calibrated.
+ *
+ *	The mixer step tables use the same code with their own file and record:
+ *	the loopback level at every step of the capture and playback volume
+ *	controls, measured once per chip and firmware (product id and
+ *	bcdDevice), since what a step is worth in dB is down to the chip.
+ */
+struct cal_header {
+	unsigned int magic;
+	unsigned short version;
+	unsigned short recsize;
+	unsigned int count;
+	unsigned int pad;
+};
+
+struct cal_rec {
+	unsigned long long key;
+	unsigned int when;			/* time of the calibration */
+	unsigned short productid;
+	unsigned short bcddevice;
+	short capset;				/* capture mixer setting */
+	short capmax;
+	float gain;					/* 1004 Hz loopback level over PASSBAND_LEVEL */
+	float offset;				/* capture DC offset, counts */
+	float resp[CAL_NRESP][2];	/* dB relative to 1004 Hz, left and right */
+};
+
+struct mix_rec {
+	unsigned long long key;
+	unsigned int when;			/* time of the characterization */
+	unsigned short productid;
+	unsigned short bcddevice;
+	short capmax;
+	short spkrmax;
+	short capref;				/* capture setting the playback steps were measured at */
+	short pad;
+	float capdb[MIX_MAX_STEPS];	/* 1004 Hz loopback level over PASSBAND_LEVEL, dB, playback at the top */
+	float spkrdb[MIX_MAX_STEPS];	/* dB relative to the top playback step */
+};
+
+struct cal_db {
+	char path[256];
+	unsigned int magic;
+	unsigned short version;
+	unsigned short recsize;
+	size_t len;
+	struct cal_header *hdr;		/* mapped file, NULL if none */
+	void *recs;
+	unsigned long long key;
+	int havekey;
+	int weakkey;				/* no serial number and no manufacturer EEPROM data */
+	void *rec;					/* this unit's record in the map */
+};
+
+struct cal_db cal = {.magic = CAL_MAGIC, .version = CAL_VERSION, .recsize = sizeof(struct cal_rec)};
+struct cal_db mixcal = {.magic = MIX_MAGIC, .version = MIX_VERSION, .recsize = sizeof(struct mix_rec)};
+
+static float cal_freqs[CAL_NRESP] = {204.0, 504.0, 1004.0, 2004.0, 3004.0};
+
+/* Order records by key, the first member of every record */
+static int cal_cmp(const void *a, const void *b)
+{
+	unsigned long long ka = *(unsigned long long *) a, kb = *(unsigned long long *) b;
+
+	return ((ka > kb) - (ka < kb));
+}
+
+/* Unmap the cache */
+static void cal_close(struct cal_db *db)
+{
+	if (db->hdr) {
+		munmap(db->hdr, db->len);
+	}
+	db->hdr = NULL;
+	db->recs = NULL;
+	db->rec = NULL;
+}
+
+/* Map the cache file read only, a missing or foreign file is an empty cache */
+static int cal_open(struct cal_db *db)
+{
+	struct stat st;
+	struct cal_header *hdr;
+	int fd;
+
+	cal_close(db);
+	fd = open(db->path, O_RDONLY);
+	if (fd < 0) {
+		return (-1);
+	}
+	if (fstat(fd, &st) || (st.st_size < sizeof(struct cal_header))) {
+		close(fd);
+		return (-1);
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		return (-1);
+	}
+	if ((hdr->magic != db->magic) || (hdr->version != db->version) || (hdr->recsize != db->recsize) ||
+		(st.st_size < sizeof(struct cal_header) + (size_t) hdr->count * db->recsize)) {
+		printf("Ignoring calibration cache %s, unknown format\n", db->path);
+		munmap(hdr, st.st_size);
+		return (-1);
+	}
+	db->hdr = hdr;
+	db->len = st.st_size;
+	db->recs = hdr + 1;
+	return (0);
+}
+
+/* Find a unit's record in the map */
+static void *cal_find(struct cal_db *db, unsigned long long key)
+{
+	if (!db->hdr || !db->hdr->count) {
+		return (NULL);
+	}
+	return (bsearch(&key, db->recs, db->hdr->count, db->recsize, cal_cmp));
+}
+
+/* Add or replace a record, rewriting the file */
+static int cal_store(struct cal_db *db, void *rec)
+{
+	struct cal_header hdr;
+	unsigned long long key = *(unsigned long long *) rec;
+	char tmp[300], *recs, *r;
+	unsigned int i, n = 0, old = 0;
+	FILE *fp;
+
+	if (db->hdr) {
+		old = db->hdr->count;
+	}
+	recs = calloc(old + 1, db->recsize);
+	if (!recs) {
+		return (-1);
+	}
+	for (i = 0; i < old; i++) {
+		r = (char *) db->recs + (size_t) i * db->recsize;
+		if (*(unsigned long long *) r != key) {
+			memcpy(recs + (size_t) n++ * db->recsize, r, db->recsize);
+		}
+	}
+	memcpy(recs + (size_t) n++ * db->recsize, rec, db->recsize);
+	qsort(recs, n, db->recsize, cal_cmp);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = db->magic;
+	hdr.version = db->version;
+	hdr.recsize = db->recsize;
+	hdr.count = n;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", db->path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		printf("Unable to create %s\n", tmp);
+		free(recs);
+		return (-1);
+	}
+	if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) || (fwrite(recs, db->recsize, n, fp) != n)) {
+		printf("Unable to write %s\n", tmp);
+		fclose(fp);
+		unlink(tmp);
+		free(recs);
+		return (-1);
+	}
+	fclose(fp);
+	free(recs);
+	if (rename(tmp, db->path)) {
+		printf("Unable to replace %s: %s\n", db->path, strerror(errno));
+		unlink(tmp);
+		return (-1);
+	}
+	cal_open(db);
+	db->rec = cal_find(db, key);
+	return (0);
+}
+
+/* Fold bytes into a 64 bit FNV-1a hash */
+static unsigned long long fnv1a(unsigned long long h, void *data, int len)
+{
+	unsigned char *cp = data;
+
+	while (len--) {
+		h ^= *cp++;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/* Work out the key for the unit in hand */
+static void cal_unit_key(struct cal_db *db, struct usb_dev_handle *usb_handle, struct usb_device *dev)
+{
+	unsigned short sbuf[EEPROM_PHYSICAL_LEN];
+	char serial[128];
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	int i, blank = 1;
+
+	memset(serial, 0, sizeof(serial));
+	if (dev->descriptor.iSerialNumber) {
+		if (usb_get_string_simple(usb_handle, dev->descriptor.iSerialNumber, serial, sizeof(serial) - 1) < 0) {
+			serial[0] = 0;
+		}
+	}
+	get_eeprom_dump(usb_handle, sbuf);
+	if (hid.failed) {
+		return;					/* no key, nothing is looked up or saved */
+	}
+	for (i = 0; i < EEPROM_START_ADDR; i++) {
+		if (sbuf[i] && (sbuf[i] != 0xffff)) {
+			blank = 0;
+		}
+	}
+	h = fnv1a(h, &dev->descriptor.idVendor, sizeof(dev->descriptor.idVendor));
+	h = fnv1a(h, &dev->descriptor.idProduct, sizeof(dev->descriptor.idProduct));
+	h = fnv1a(h, &dev->descriptor.bcdDevice, sizeof(dev->descriptor.bcdDevice));
+	h = fnv1a(h, serial, strlen(serial));
+	h = fnv1a(h, sbuf, EEPROM_START_ADDR * sizeof(sbuf[0]));
+	db->key = h;
+	db->weakkey = (!serial[0] && blank);
+	db->havekey = 1;
+}
+
+/* Key for the chip and firmware in hand, shared by every unit with them */
+static unsigned long long mix_key(void)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	h = fnv1a(h, &devproductid, sizeof(devproductid));
+	h = fnv1a(h, &devbcd, sizeof(devbcd));
+	h = fnv1a(h, &devtype, sizeof(devtype));
+	return (h);
+}
+
+/* The mixer step table of this chip, NULL if there is none for the current control ranges */
+static struct mix_rec *mix_lookup(void)
+{
+	struct mix_rec *rec;
+
+	if (!mixcal.havekey) {
+		mixcal.key = mix_key();
+		mixcal.havekey = 1;
+		cal_open(&mixcal);
+		mixcal.rec = cal_find(&mixcal, mixcal.key);
+	}
+	rec = mixcal.rec;
+	if (!rec || (rec->capmax != capmax) || (rec->spkrmax != spkrmax)) {
+		return (NULL);
+	}
+	return (rec);
+}
+
+/* First capture step the table puts at or above db, the level rises with the setting */
+static int mix_step(struct mix_rec *rec, float db)
+{
+	int s;
+
+	for (s = 0; s < rec->capmax; s++) {
+		if (rec->capdb[s] >= db) {
+			break;
+		}
+	}
+	return (s);
+}
+
+/* Level ratio in dB, held at the floor */
+static float mix_db(float ratio)
+{
+	if ((ratio <= 0.0) || (20.0 * log10(ratio) < MIX_FLOOR_DB)) {
+		return (MIX_FLOOR_DB);
+	}
+	return (20.0 * log10(ratio));
+}
+
+/*!
+ * \brief Test plans
+ *	The digital and analog test steps, their levels and limits come from
+ *	a plan: the built in one below, or a file given with -p that replaces
+ *	its sections and settings.  A plan file looks like
+ *
+ *		[plan]
+ *		name = URIx production
+ *		tolerance = 15				(percent)
+ *		abort = first				(or none)
+ *		[chip CM119B]				(overrides for these chips only)
+ *		passband = 1100
+ *		[digital]
+ *		step = 0x18 0x40 chip=CM119,CM119A,CM119B
+ *		[analog]
+ *		step = 5004 700 stopband passband5k tol=25
+ *
+ *	Digital steps are the output bits and the inputs expected back, analog
+ *	steps the left and right frequencies and levels (a number, or passband,
+ *	stopband or passband5k).  The plan is compiled for the chip found once
+ *	at startup, with the limits, oscillator increments and analyzer bins
+ *	of every step worked out, so nothing is set up while the test runs.
+ */
+enum {PLAN_ABORT_NONE, PLAN_ABORT_FIRST};
+enum {PLAN_LEV_PASSBAND = -1, PLAN_LEV_STOPBAND = -2, PLAN_LEV_PASSBAND5K = -3};
+
+struct plan_params {
+	float passband, stopband, passband5k;
+	float tolerance;			/* fraction of the expected level */
+	int settle_ms;				/* longest wait for the stimulus to reach the input */
+	int window;					/* blocks averaged per measurement */
+	int dio_settle_ms;			/* GPIO loopback settling */
+	int abort;
+};
+
+struct plan_astep {
+	float freq1, freq2;
+	float lev1, lev2;			/* or a PLAN_LEV_ name */
+	float tol;					/* < 0 for the plan tolerance */
+	unsigned int chips;			/* 1 << DEV_ of the chips it runs on, 0 for all */
+};
+
+struct plan_dstep {
+	unsigned char out, expect;
+	unsigned int chips;
+};
+
+struct plan_ovr {
+	unsigned int chips;
+	char key[32], val[32];
+	int line;
+};
+
+/* A plan as parsed */
+struct plan_src {
+	char name[64];
+	struct plan_params par;
+	struct plan_astep astep[ANALOG_MAX_STEPS];
+	int nastep;
+	struct plan_dstep dstep[PLAN_MAX_DIO];
+	int ndstep;
+	struct plan_ovr ovr[PLAN_MAX_OVR];
+	int novr;
+};
+
+/* Digital I/O test vector, output bits and the inputs they loop back to */
+struct dio_step {
+	unsigned char out;
+	unsigned char expect;
+};
+
+/* Analog test step, stimulus frequencies and the levels expected back */
+struct analog_step {
+	float freq1;
+	float freq2;
+	float lev1;
+	float lev2;
+	float lo1, hi1, lo2, hi2;	/* limits */
+	struct tone_plan t[2];
+};
+
+/* A plan compiled for one chip */
+struct test_plan {
+	char name[64];
+	struct plan_params par;
+	struct dio_step d[PLAN_MAX_DIO];
+	int nd;
+	struct analog_step a[ANALOG_MAX_STEPS];
+	int na;
+};
+
+struct test_plan tplan;
+char *planname = NULL;
+
+static char default_plan[] =
+	"[plan]\n"
+	"name = built in\n"
+	"[digital]\n"
+	"step = 0x08 0x00\n"								/* NONE */
+	"step = 0x09 0x02\n"								/* GPIO1 -> GPIO2 */
+	"step = 0x0c 0x10\n"								/* GPIO3/PTT -> CTCSS */
+	"step = 0x00 0x20\n"								/* GPIO4 -> COR */
+	"step = 0x18 0x40 chip=CM119,CM119A,CM119B\n"		/* GPIO5 -> GPIO7 */
+	"step = 0x28 0x80 chip=CM119,CM119A,CM119B\n"		/* GPIO6 -> GPIO8 */
+	"step = 0x08 0x00\n"								/* NONE */
+	"[analog]\n"
+	"step = 204 700 passband passband\n"
+	"step = 504 700 passband passband\n"
+	"step = 1004 700 passband passband\n"
+	"step = 2004 700 passband passband\n"
+	"step = 3004 700 passband passband\n"
+	/* this a fudge to make this work with CM119B chips and EEPROMs, not sure why */
+	"step = 5004 700 stopband passband5k\n"
+	"step = 700 204 passband passband\n"
+	"step = 700 504 passband passband\n"
+	"step = 700 1004 passband passband\n"
+	"step = 700 2004 passband passband\n"
+	"step = 700 3004 passband passband\n"
+	"step = 700 5004 passband5k stopband\n";
+
+static void plan_defaults(struct plan_src *ps)
+{
+	memset(ps, 0, sizeof(*ps));
+	ps->par.passband = PASSBAND_LEVEL;
+	ps->par.stopband = STOPBAND_LEVEL;
+	ps->par.passband5k = PASSBAND_5KHZ_LEVEL;
+	ps->par.tolerance = ANALOG_TOLERANCE;
+	ps->par.settle_ms = ANALOG_SETTLE_MAX / 1000;
+	ps->par.window = ANALOG_WINDOW_BLOCKS;
+	ps->par.dio_settle_ms = DIO_SETTLE_MS;
+	ps->par.abort = PLAN_ABORT_NONE;
+}
+
+/* Comma separated chip names to a mask */
+static int plan_chips(char *list, unsigned int *chips)
+{
+	char *cp, *save = NULL;
+	int i, n = sizeof(devtypestrs) / sizeof(devtypestrs[0]);
+
+	*chips = 0;
+	for (cp = strtok_r(list, ",", &save); cp; cp = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < n; i++) {
+			if (!strcasecmp(cp, devtypestrs[i])) {
+				break;
+			}
+		}
+		if (i >= n) {
+			return (-1);
+		}
+		*chips |= 1 << i;
+	}
+	return ((*chips) ? 0 : -1);
+}
+
+/* A level, number or name */
+static int plan_level(char *tok, float *lev)
+{
+	char *end;
+
+	if (!strcasecmp(tok, "passband")) {
+		*lev = PLAN_LEV_PASSBAND;
+	} else if (!strcasecmp(tok, "stopband")) {
+		*lev = PLAN_LEV_STOPBAND;
+	} else if (!strcasecmp(tok, "passband5k")) {
+		*lev = PLAN_LEV_PASSBAND5K;
+	} else {
+		*lev = strtod(tok, &end);
+		if (*end || (*lev <= 0.0)) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* Set one plan setting, returns -1 for an unknown key or bad value */
+static int plan_set(struct plan_params *par, char *key, char *val)
+{
+	char *end;
+	double d = strtod(val, &end);
+	int num = (!*end && (end != val));
+
+	if (!strcmp(key, "abort")) {
+		if (!strcasecmp(val, "none")) {
+			par->abort = PLAN_ABORT_NONE;
+		} else if (!strcasecmp(val, "first")) {
+			par->abort = PLAN_ABORT_FIRST;
+		} else {
+			return (-1);
+		}
+		return (0);
+	}
+	if (!num || (d <= 0.0)) {
+		return (-1);
+	}
+	if (!strcmp(key, "passband")) {
+		par->passband = d;
+	} else if (!strcmp(key, "stopband")) {
+		par->stopband = d;
+	} else if (!strcmp(key, "passband5k")) {
+		par->passband5k = d;
+	} else if (!strcmp(key, "tolerance")) {
+		par->tolerance = d / 100.0;
+	} else if (!strcmp(key, "settle_ms")) {
+		par->settle_ms = d;
+	} else if (!strcmp(key, "window")) {
+		par->window = d;
+	} else if (!strcmp(key, "dio_settle_ms")) {
+		par->dio_settle_ms = d;
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+/* The qualifiers after the fields of a step */
+static int plan_quals(char *tok, char **save, unsigned int *chips, float *tol)
+{
+	char *end;
+
+	for (; tok; tok = strtok_r(NULL, " \t", save)) {
+		if (!strncmp(tok, "chip=", 5)) {
+			if (plan_chips(tok + 5, chips)) {
+				return (-1);
+			}
+		} else if (tol && !strncmp(tok, "tol=", 4)) {
+			*tol = strtod(tok + 4, &end) / 100.0;
+			if (*end || (*tol <= 0.0)) {
+				return (-1);
+			}
+		} else {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Parse a plan into ps, on top of what is there.  The first [digital] or
+ * [analog] section replaces the steps parsed before it.
+ */
+static int plan_parse(struct plan_src *ps, FILE *fp, char *fname)
+{
+	char line[PLAN_LINE], *cp, *key, *val, *tok, *save;
+	enum {SEC_NONE, SEC_PLAN, SEC_CHIP, SEC_DIGITAL, SEC_ANALOG} sec = SEC_NONE;
+	unsigned int chips = 0;
+	int lineno = 0, dseen = 0, aseen = 0;
+	struct plan_astep *as;
+	struct plan_dstep *ds;
+	long out, expect;
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if ((cp = strchr(line, '#'))) {
+			*cp = 0;
+		}
+		for (cp = line + strlen(line); (cp > line) && isspace(cp[-1]); cp--) {
+			cp[-1] = 0;
+		}
+		for (cp = line; isspace(*cp); cp++) {
+			;
+		}
+		if (!*cp) {
+			continue;
+		}
+		if (*cp == '[') {
+			if (!strcmp(cp, "[plan]")) {
+				sec = SEC_PLAN;
+			} else if (!strcmp(cp, "[digital]")) {
+				sec = SEC_DIGITAL;
+				if (!dseen++) {
+					ps->ndstep = 0;
+				}
+			} else if (!strcmp(cp, "[analog]")) {
+				sec = SEC_ANALOG;
+				if (!aseen++) {
+					ps->nastep = 0;
+				}
+			} else if (!strncmp(cp, "[chip ", 6) && (cp[strlen(cp) - 1] == ']')) {
+				cp[strlen(cp) - 1] = 0;
+				if (plan_chips(cp + 6, &chips)) {
+					printf("%s line %d: unknown chip\n", fname, lineno);
+					return (-1);
+				}
+				sec = SEC_CHIP;
+			} else {
+				printf("%s line %d: unknown section %s\n", fname, lineno, cp);
+				return (-1);
+			}
+			continue;
+		}
+		key = cp;
+		val = strchr(cp, '=');
+		if (!val || (sec == SEC_NONE)) {
+			printf("%s line %d: expected a key = value in a section\n", fname, lineno);
+			return (-1);
+		}
+		for (cp = val; (cp > key) && isspace(cp[-1]); cp--) {
+			;
+		}
+		*cp = 0;
+		for (val++; isspace(*val); val++) {
+			;
+		}
+		switch (sec) {
+		case SEC_PLAN:
+			if (!strcmp(key, "name")) {
+				snprintf(ps->name, sizeof(ps->name), "%s", val);
+			} else if (plan_set(&ps->par, key, val)) {
+				printf("%s line %d: bad setting %s = %s\n", fname, lineno, key, val);
+				return (-1);
+			}
+			break;
+		case SEC_CHIP:
+			{
+				struct plan_params scratch = ps->par;
+
+				if ((ps->novr >= PLAN_MAX_OVR) || (strlen(key) >= 32) || (strlen(val) >= 32) ||
+					plan_set(&scratch, key, val)) {
+					printf("%s line %d: bad chip setting %s = %s\n", fname, lineno, key, val);
+					return (-1);
+				}
+				ps->ovr[ps->novr].chips = chips;
+				strcpy(ps->ovr[ps->novr].key, key);
+				strcpy(ps->ovr[ps->novr].val, val);
+				ps->ovr[ps->novr].line = lineno;
+				ps->novr++;
+			}
+			break;
+		case SEC_DIGITAL:
+			save = NULL;
+			tok = strtok_r(val, " \t", &save);
+			if (strcmp(key, "step") || (ps->ndstep >= PLAN_MAX_DIO) || !tok) {
+				printf("%s line %d: bad digital step\n", fname, lineno);
+				return (-1);
+			}
+			ds = &ps->dstep[ps->ndstep];
+			out = strtol(tok, &cp, 0);
+			tok = strtok_r(NULL, " \t", &save);
+			expect = (tok) ? strtol(tok, &val, 0) : -1;
+			ds->chips = 0;
+			if (*cp || !tok || *val || (out & ~0xff) || (expect & ~0xff) ||
+				plan_quals(strtok_r(NULL, " \t", &save), &save, &ds->chips, NULL)) {
+				printf("%s line %d: bad digital step\n", fname, lineno);
+				return (-1);
+			}
+			ds->out = out;
+			ds->expect = expect;
+			ps->ndstep++;
+			break;
+		case SEC_ANALOG:
+			save = NULL;
+			if (strcmp(key, "step") || (ps->nastep >= ANALOG_MAX_STEPS)) {
+				printf("%s line %d: bad analog step\n", fname, lineno);
+				return (-1);
+			}
+			as = &ps->astep[ps->nastep];
+			as->chips = 0;
+			as->tol = -1.0;
+			tok = strtok_r(val, " \t", &save);
+			as->freq1 = (tok) ? strtod(tok, &cp) : -1.0;
+			if (!tok || *cp || (as->freq1 < 0.0) || (as->freq1 >= 24000.0)) {
+				printf("%s line %d: bad analog step\n", fname, lineno);
+				return (-1);
+			}
+			tok = strtok_r(NULL, " \t", &save);
+			as->freq2 = (tok) ? strtod(tok, &cp) : -1.0;
+			if (!tok || *cp || (as->freq2 < 0.0) || (as->freq2 >= 24000.0)) {
+				printf("%s line %d: bad analog step\n", fname, lineno);
+				return (-1);
+			}
+			tok = strtok_r(NULL, " \t", &save);
+			if (!tok || plan_level(tok, &as->lev1)) {
+				printf("%s line %d: bad analog step level\n", fname, lineno);
+				return (-1);
+			}
+			tok = strtok_r(NULL, " \t", &save);
+			if (!tok || plan_level(tok, &as->lev2) ||
+				plan_quals(strtok_r(NULL, " \t", &save), &save, &as->chips, &as->tol)) {
+				printf("%s line %d: bad analog step\n", fname, lineno);
+				return (-1);
+			}
+			ps->nastep++;
+			break;
+		default:
+			break;
+		}
+	}
+	return (0);
+}
+
+/* A level for the plan settings */
+static float plan_resolve(struct plan_params *par, float lev)
+{
+	if (lev == PLAN_LEV_PASSBAND) {
+		return (par->passband);
+	}
+	if (lev == PLAN_LEV_STOPBAND) {
+		return (par->stopband);
+	}
+	if (lev == PLAN_LEV_PASSBAND5K) {
+		return (par->passband5k);
+	}
+	return (lev);
+}
+
+/* Compile the plan for chip type */
+static void plan_compile(struct plan_src *ps, int type, struct test_plan *tp)
+{
+	struct analog_step *st;
+	float tol;
+	int i;
+
+	memset(tp, 0, sizeof(*tp));
+	snprintf(tp->name, sizeof(tp->name), "%s", ps->name);
+	tp->par = ps->par;
+	for (i = 0; i < ps->novr; i++) {
+		if (ps->ovr[i].chips & (1 << type)) {
+			plan_set(&tp->par, ps->ovr[i].key, ps->ovr[i].val);
+		}
+	}
+	for (i = 0; i < ps->ndstep; i++) {
+		if (ps->dstep[i].chips && !(ps->dstep[i].chips & (1 << type))) {
+			continue;
+		}
+		tp->d[tp->nd].out = ps->dstep[i].out;
+		tp->d[tp->nd].expect = ps->dstep[i].expect;
+		tp->nd++;
+	}
+	for (i = 0; i < ps->nastep; i++) {
+		if (ps->astep[i].chips && !(ps->astep[i].chips & (1 << type))) {
+			continue;
+		}
+		st = &tp->a[tp->na++];
+		st->freq1 = ps->astep[i].freq1;
+		st->freq2 = ps->astep[i].freq2;
+		st->lev1 = plan_resolve(&tp->par, ps->astep[i].lev1);
+		st->lev2 = plan_resolve(&tp->par, ps->astep[i].lev2);
+		tol = (ps->astep[i].tol > 0.0) ? ps->astep[i].tol : tp->par.tolerance;
+		st->lo1 = st->lev1 * (1.0 - tol);
+		st->hi1 = st->lev1 * (1.0 + tol);
+		st->lo2 = st->lev2 * (1.0 - tol);
+		st->hi2 = st->lev2 * (1.0 + tol);
+		tone_plan_init(&st->t[0], st->freq1);
+		tone_plan_init(&st->t[1], st->freq2);
+	}
+}
+
+/* Load the built in plan and the plan file on top, and compile it for this chip */
+static int plan_load(char *fname)
+{
+	static struct plan_src ps;
+	FILE *fp;
+	int res;
+
+	plan_defaults(&ps);
+	fp = fmemopen(default_plan, strlen(default_plan), "r");
+	if (!fp) {
+		return (-1);
+	}
+	res = plan_parse(&ps, fp, "built in plan");
+	fclose(fp);
+	if (res) {
+		return (-1);
+	}
+	if (fname) {
+		fp = fopen(fname, "r");
+		if (!fp) {
+			printf("Unable to open test plan %s: %s\n", fname, strerror(errno));
+			return (-1);
+		}
+		res = plan_parse(&ps, fp, fname);
+		fclose(fp);
+		if (res) {
+			return (-1);
+		}
+	}
+	plan_compile(&ps, devtype, &tplan);
+	if (fname) {
+		printf("Test plan '%s' for %s: %d digital and %d analog step(s), tolerance %.0f%%%s\n", tplan.name,
+			   devtypestrs[devtype], tplan.nd, tplan.na, tplan.par.tolerance * 100.0,
+			   (tplan.par.abort == PLAN_ABORT_FIRST) ? ", stopping at the first failure" : "");
+	}
+	return (0);
+}
+
+/* Digital I/O test state */
+struct dio_sm {
+	struct usb_dev_handle *usb_handle;
+	FILE *out;					/* where its report goes */
+	int i;
+	int waiting;				/* for the loopback to settle */
+	int nerror;
+	int done;
+};
+
+/* Start the digital I/O test */
+static void dio_sm_init(struct dio_sm *sm, struct usb_dev_handle *usb_handle, FILE *out)
+{
+	memset(sm, 0, sizeof(*sm));
+	sm->usb_handle = usb_handle;
+	sm->out = out;
+	fprintf(out, "Testing digital I/O (PTT,COR,TONE and GPIO)....\n");
+}
+
+/* Put the outputs back to idle (PTT off) when the test ends before its last step */
+static void dio_sm_idle(struct dio_sm *sm)
+{
+	int failed = hid.failed;
+
+	hid_clear();				/* one more try, a unit that stopped answering may still key the radio */
+	setout_nowait(sm->usb_handle, 8);
+	hid.failed |= failed;
+}
+
+/* Advance the digital I/O test on the events in mask */
+static void dio_sm_run(struct dio_sm *sm, int mask)
+{
+	int nsteps = tplan.nd;
+	unsigned char c;
+
+	while (!sm->done) {
+		if (sm->i >= nsteps) {
+			if (!sm->nerror) {
+				fprintf(sm->out, "Digital I/O passed!!\n");
+			} else {
+				fprintf(sm->out, "Digital I/O had %d errors!!\n", sm->nerror);
+			}
+			sm->done = 1;
+			return;
+		}
+		if (!sm->waiting) {
+			setout_nowait(sm->usb_handle, tplan.d[sm->i].out);
+			ev_hid_timer(&evl, tplan.par.dio_settle_ms);	/* loopback settling */
+			sm->waiting = 1;
+			return;
+		}
+		if (!(mask & EV_HIDTIMER)) {
+			return;
+		}
+		mask &= ~EV_HIDTIMER;
+		c = getin(sm->usb_handle) & 0xf2;
+		if (hid.failed) {
+			fprintf(sm->out, "Digital I/O test aborted, the unit is not responding!!\n");
+			sm->nerror++;
+			dio_sm_idle(sm);
+			sm->i = nsteps;
+			continue;
+		}
+		sm->nerror += dioerror(sm->out, c, tplan.d[sm->i].expect);
+		sm->waiting = 0;
+		sm->i++;
+		if (sm->nerror && (tplan.par.abort == PLAN_ABORT_FIRST) && (sm->i < nsteps)) {
+			dio_sm_idle(sm);
+			sm->i = nsteps;
+		}
+	}
+}
+
+/* Digital I/O test */
+static int digital_test(struct usb_dev_handle *usb_handle)
+{
+	struct dio_sm sm;
+
+	dio_sm_init(&sm, usb_handle, stdout);
+	dio_sm_run(&sm, 0);
+	while (!sm.done) {
+		dio_sm_run(&sm, ev_wait(&evl, -1));
+	}
+	return (sm.nerror);
+}
+
+/* Print the spread of a level measurement */
+static void levwin_print(struct runstat *rs, int outliers)
+{
+	printf("  over %lu blocks: min %.1f, max %.1f, std dev %.1f, %d outlier(s)\n",
+		   rs->n, rs->min, rs->max, runstat_std(rs), outliers);
+}
+
+enum {ANALOG_START, ANALOG_RESET, ANALOG_SETTLE, ANALOG_MEASURE};
+
+/* Analog test state */
+struct analog_sm {
+	int i;
+	int state;
+	int resets;					/* glitch detector clears still to be seen */
+	int v;
+	int nerror;
+	int done;
+	unsigned long long start;
+	unsigned long glitches;		/* over all steps, the skew needs an unbroken stream */
+	float phase[ANALOG_MAX_STEPS][2];	/* mean tone phases per step, left and right */
+	int havephase[ANALOG_MAX_STEPS];
+	float lev[ANALOG_MAX_STEPS][2];	/* mean levels per step, left and right */
+	float dc[ANALOG_MAX_STEPS];
+	int havelev[ANALOG_MAX_STEPS];
+};
+
+/* Check the levels measured for one analog step */
+static int analog_step_result(struct analog_step *st, unsigned long long start, int stalled, int v)
+{
+	int nerror = 0;
+	float freq1 = st->freq1, freq2 = st->freq2;
+	float l1, l2;
+
+	if (stalled) {
+		printf("No audio analyzed at %.1f (and %.1f) Hz!!\n", freq1, freq2);
+		return (nerror + 1);
+	}
+	if (glitch.count) {
+		printf("Audio glitch(es) at %.1f (and %.1f) Hz, %lu lost or repeated sample group(s)!!\n",
+			   freq1, freq2, glitch.count);
+		glitch_print(&glitch, start);
+		nerror += glitch.count;
+	}
+	l1 = lwin.s1.mean;
+	l2 = lwin.s2.mean;
+	if ((l1 < st->lo1) || (l1 > st->hi1)) {
+		printf("Analog level on left channel for %.1f Hz (%.1f) is out of range!!\n",
+			   freq1, l1);
+		printf("Must be between %.1f and %.1f\n", st->lo1, st->hi1);
+		levwin_print(&lwin.s1, lwin.out1);
+		nerror++;
+	} else if (v) {
+		printf("Left channel level %.1f OK at %.1f Hz\n", l1, freq1);
+		levwin_print(&lwin.s1, lwin.out1);
+	}
+	if ((l2 < st->lo2) || (l2 > st->hi2)) {
+		printf("Analog level on right channel for %.1f Hz (%.1f) is out of range!!\n",
+			   freq2, l2);
+		printf("Must be between %.1f and %.1f\n", st->lo2, st->hi2);
+		levwin_print(&lwin.s2, lwin.out2);
+		nerror++;
+	} else if (v) {
+		printf("Right channel level %.1f OK at %.1f Hz\n", l2, freq2);
+		levwin_print(&lwin.s2, lwin.out2);
+	}
+	if (v && lwin.skipped) {
+		printf("  %d frame(s) left out next to GPIO output changes\n", lwin.skipped);
+	}
+	return (nerror);
+}
+
+/*!
+ * \brief Inter-channel phase and skew
+ *	Both outputs loop back into the one capture channel.  The stimulus
+ *	oscillators run on the playback frame index and the glitch detector
+ *	fits run on the capture frame index, so each fitted phase is the path
+ *	phase less the loopback latency times the tone frequency.  The sweep
+ *	plays every frequency once on the left and once on the right; at the
+ *	same frequency the latency term is the same, so the difference is the
+ *	relative phase of the two paths.  Their slope against frequency is the
+ *	group delay difference.  This needs the stream to run unbroken between
+ *	the two steps, which the glitch detector confirms.
+ */
+static void analog_skew(struct analog_sm *sm)
+{
+	int nsteps = tplan.na;
+	int i, j, k, n = 0, idx[ANALOG_MAX_STEPS][2];
+	float f[ANALOG_MAX_STEPS], d[ANALOG_MAX_STEPS], t, maxskew = 0.0, fmax;
+	struct linfit lf;
+
+	/* frequencies measured on both channels, first occurrence of each */
+	for (i = 0; i < nsteps; i++) {
+		if (!sm->havephase[i]) {
+			continue;
+		}
+		for (j = 0; j < nsteps; j++) {
+			if ((j == i) || !sm->havephase[j] || (tplan.a[j].freq2 != tplan.a[i].freq1)) {
+				continue;
+			}
+			for (k = 0; k < n; k++) {
+				if (f[k] == tplan.a[i].freq1) {
+					break;
+				}
+			}
+			if (k == n) {
+				f[n] = tplan.a[i].freq1;
+				idx[n][0] = i;
+				idx[n][1] = j;
+				n++;
+			}
+			break;
+		}
+	}
+	if (!n) {
+		return;
+	}
+	if (sm->glitches) {
+		printf("Channel skew not measured, the audio stream was broken by %lu glitch(es)\n", sm->glitches);
+		return;
+	}
+	/* ascending frequency, so the phase differences can be unwrapped */
+	for (i = 1; i < n; i++) {
+		for (j = i; (j > 0) && (f[j - 1] > f[j]); j--) {
+			t = f[j]; f[j] = f[j - 1]; f[j - 1] = t;
+			k = idx[j][0]; idx[j][0] = idx[j - 1][0]; idx[j - 1][0] = k;
+			k = idx[j][1]; idx[j][1] = idx[j - 1][1]; idx[j - 1][1] = k;
+		}
+	}
+	linfit_init(&lf);
+	fmax = 0.0;
+	for (i = 0; i < n; i++) {
+		d[i] = wrap_phase(sm->phase[idx[i][0]][0] - sm->phase[idx[i][1]][1]);
+		if (i) {
+			d[i] = d[i - 1] + wrap_phase(d[i] - d[i - 1]);
+		}
+		/* a path delayed by tau has phase -2 pi f tau */
+		t = -wrap_phase(d[i]) / (2.0 * M_PI * f[i]) * 1000000.0;
+		if (fabs(t) > fabs(maxskew)) {
+			maxskew = t;
+		}
+		if (f[i] <= SKEW_MAX_FREQ) {
+			linfit_add(&lf, 2.0 * M_PI * f[i], d[i]);
+			fmax = f[i];
+		}
+		if (sm->v) {
+			printf("  %6.1f Hz: left - right phase %+6.1f deg, left lags by %+7.1f us\n", f[i],
+				   wrap_phase(d[i]) * 180.0 / M_PI, t);
+		}
+	}
+	printf("Channel skew: left lags right by up to %+.1f us", maxskew);
+	if (lf.n >= 2) {
+		printf(", group delay difference %+.1f us (%.0f - %.0f Hz)", -linfit_slope(&lf) * 1000000.0,
+			   f[0], fmax);
+	}
+	printf("\n");
+}
+
+/*!
+ * \brief Analog results against the cached calibration
+ *	The test runs at the default capture setting, so its limits catch gain
+ *	drift; with a calibration cached for the unit the same levels are also
+ *	compared with it.  The response of each channel is taken relative to
+ *	its CAL_REF_FREQ step, as the calibration took it, and the CAL_REF_FREQ
+ *	gain is compared when the capture setting is the calibrated one or the
+ *	chip's mixer table gives the difference.  Only reported, the limits
+ *	decide pass or fail.
+ */
+static void analog_cal_compare(struct analog_sm *sm)
+{
+	struct cal_rec *rec = cal.rec;
+	struct mix_rec *mix = mixcal.rec;
+	int nsteps = tplan.na;
+	int i, j, ch, r = -1, ndc = 0, drift = 0, idx[CAL_NRESP][2];
+	float l, d, expect, dc = 0.0;
+	time_t when;
+
+	if (!rec || (rec->capmax != capmax)) {
+		return;
+	}
+	/* the first step with each calibration frequency on each channel */
+	for (i = 0; i < CAL_NRESP; i++) {
+		idx[i][0] = idx[i][1] = -1;
+		if (cal_freqs[i] == CAL_REF_FREQ) {
+			r = i;
+		}
+	}
+	for (j = 0; (j < nsteps) && (j < ANALOG_MAX_STEPS); j++) {
+		if (!sm->havelev[j]) {
+			continue;
+		}
+		dc += sm->dc[j];
+		ndc++;
+		for (i = 0; i < CAL_NRESP; i++) {
+			if ((idx[i][0] < 0) && (tplan.a[j].freq1 == cal_freqs[i])) {
+				idx[i][0] = j;
+			}
+			if ((idx[i][1] < 0) && (tplan.a[j].freq2 == cal_freqs[i])) {
+				idx[i][1] = j;
+			}
+		}
+	}
+	if (!ndc) {
+		return;
+	}
+	when = rec->when;
+	printf("Against the calibration of %s", ctime(&when));
+	if ((r >= 0) && (idx[r][0] >= 0) && (sm->lev[idx[r][0]][0] > 0.0)) {
+		expect = rec->gain * PASSBAND_LEVEL;
+		if ((capset != rec->capset) && mix && (mix->capmax == capmax)) {
+			expect *= pow(10.0, (mix->capdb[capset] - mix->capdb[rec->capset]) / 20.0);
+		}
+		if ((capset == rec->capset) || (mix && (mix->capmax == capmax))) {
+			l = sm->lev[idx[r][0]][0];
+			printf("  %.1f Hz left level %.1f, %.1f expected, %+.2f dB\n", CAL_REF_FREQ, l, expect,
+				   20.0 * log10(l / expect));
+		}
+	}
+	printf("  DC offset %.1f, calibrated %.1f\n", dc / ndc, rec->offset);
+	for (ch = 0; (ch < 2) && (r >= 0); ch++) {
+		if ((idx[r][ch] < 0) || (sm->lev[idx[r][ch]][ch] <= 0.0)) {
+			continue;
+		}
+		printf("  %s response change:", (ch) ? "Right" : "Left");
+		for (i = 0; i < CAL_NRESP; i++) {
+			if ((i == r) || (idx[i][ch] < 0) || (sm->lev[idx[i][ch]][ch] <= 0.0)) {
+				continue;
+			}
+			d = 20.0 * log10(sm->lev[idx[i][ch]][ch] / sm->lev[idx[r][ch]][ch]) - rec->resp[i][ch];
+			printf(" %.0f Hz %+.2f dB", cal_freqs[i], d);
+			if (fabs(d) > CAL_DRIFT_DB) {
+				drift++;
+			}
+		}
+		printf("\n");
+	}
+	if (drift) {
+		printf("Response moved more than %.1f dB at %d point(s) since the calibration, 'A' recalibrates\n",
+			   CAL_DRIFT_DB, drift);
+	}
+}
+
+/* Start the analog test */
+static void analog_sm_init(struct analog_sm *sm, int v)
+{
+	memset(sm, 0, sizeof(*sm));
+	sm->v = v;
+	printf("Passband level (200Hz - 3KHz) = %.0f +/- %.0f%%, Stopband level (> 4KHz) = %.0f +/- %.0f%%\n",
+		   tplan.par.passband, tplan.par.tolerance * 100.0, tplan.par.stopband, tplan.par.tolerance * 100.0);
+}
+
+/*!
+ * \brief Advance the analog test on the events in mask
+ *	Each step changes the stimulus, clears the glitch detector (twice, as
+ *	the first clear may be seen by a block of the old stimulus), awaits
+ *	analyzed blocks until the detector has locked to the new stimulus and
+ *	the playback queue has turned over (or the settle timer expires), then
+ *	clears the glitch counts once more and awaits the level window.
+ */
+static void analog_sm_run(struct analog_sm *sm, int mask)
+{
+	int nsteps = tplan.na;
+	struct analog_step *st;
+
+	while (!sm->done) {
+		if (sm->i >= nsteps) {
+			analog_skew(sm);
+			analog_cal_compare(sm);
+			if (!sm->nerror) {
+				printf("Analog Test Passed!!\n");
+			}
+			sm->done = 1;
+			return;
+		}
+		st = &tplan.a[sm->i];
+		switch (sm->state) {
+		case ANALOG_START:
+			mytones = st->t;
+			myfreq1 = st->freq1;
+			myfreq2 = st->freq2;
+			printf("Testing Analog at %1.f (and %1.f) Hz...\n", st->freq1, st->freq2);
+			glitch.reset = 1;
+			sm->resets = 2;
+			sm->start = now_us();
+			ev_timer(&evl, tplan.par.settle_ms, 0);
+			sm->state = ANALOG_RESET;
+			return;
+		case ANALOG_RESET:
+			if (!(mask & EV_TIMER)) {
+				if (glitch.reset) {
+					return;
+				}
+				if (--sm->resets > 0) {
+					glitch.reset = 1;
+					return;
+				}
+			}
+			sm->state = ANALOG_SETTLE;
+			break;
+		case ANALOG_SETTLE:
+			/* settle until the new stimulus is steady at the input, a tone left from the last step locks early */
+			if ((!glitch.locked || (now_us() - sm->start < playback_queue_us() + AUDIO_BLOCK_US)) &&
+				!(mask & EV_TIMER)) {
+				return;
+			}
+			mask &= ~EV_TIMER;
+			glitch.reset = 1;	/* anything before the lock was the stimulus changing */
+			ev_timer(&evl, levwin_start(&lwin, tplan.par.window), 0);
+			sm->state = ANALOG_MEASURE;
+			return;
+		case ANALOG_MEASURE:
+			if (!lwin.done && !(mask & EV_TIMER)) {
+				return;
+			}
+			mask &= ~EV_TIMER;
+			ev_timer(&evl, 0, 0);
+			lwin.want = 0;
+			sm->nerror += analog_step_result(st, sm->start, !lwin.done, sm->v);
+			sm->glitches += glitch.count;
+			if (lwin.done && (sm->i < ANALOG_MAX_STEPS)) {
+				sm->lev[sm->i][0] = lwin.s1.mean;
+				sm->lev[sm->i][1] = lwin.s2.mean;
+				sm->dc[sm->i] = lwin.dc.mean;
+				sm->havelev[sm->i] = 1;
+			}
+			if (lwin.done && lwin.np && (sm->i < ANALOG_MAX_STEPS)) {
+				sm->phase[sm->i][0] = levwin_mean_phase(&lwin, 0);
+				sm->phase[sm->i][1] = levwin_mean_phase(&lwin, 1);
+				sm->havephase[sm->i] = 1;
+			}
+			sm->state = ANALOG_START;
+			sm->i++;
+			if (sm->nerror && (tplan.par.abort == PLAN_ABORT_FIRST)) {
+				sm->i = nsteps;
+			}
+			break;
+		}
+	}
+}
+
+/*!
+ * \brief Digital and analog tests together
+ *	The digital test only uses the HID interface and the analog test only
+ *	the audio interface, so both state machines are stepped by the same
+ *	event loop, each on its own timer, and the whole test takes about as
+ *	long as the analog part.  The GPIO output changes click in the audio
+ *	path (see the PTT click test), so the sound thread leaves blocks close
+ *	to an output change out of the level windows and the glitch detector
+ *	ignores residual bursts there.  The digital test's report is kept in
+ *	memory and printed in one piece when it is done, so its lines do not
+ *	land in the middle of the analog ones.
+ */
+static int system_test(struct usb_dev_handle *usb_handle, int v, int *derrs, int *aerrs)
+{
+	struct dio_sm dsm;
+	struct analog_sm asm_state;
+	FILE *dout;
+	char *dbuf = NULL;
+	size_t dlen = 0;
+	int mask = 0, stopped = 0;
+	unsigned long long start = now_us();
+
+	if (capset != capdefault) {
+		/* a calibrated setting would hide the gain drift the limits are there to catch */
+		printf("Capture setting back to its default %d (from %d) for the test\n", capdefault, capset);
+		capture_set(capdefault);
+	}
+	dout = open_memstream(&dbuf, &dlen);
+	dio_sm_init(&dsm, usb_handle, (dout) ? dout : stdout);
+	analog_sm_init(&asm_state, v);
+	while (!dsm.done || !asm_state.done) {
+		if (!dsm.done) {
+			dio_sm_run(&dsm, mask);
+		}
+		if (!asm_state.done) {
+			analog_sm_run(&asm_state, mask);
+		}
+		if ((dsm.nerror || asm_state.nerror) && (tplan.par.abort == PLAN_ABORT_FIRST) &&
+			(!dsm.done || !asm_state.done)) {
+			/* stop the other test where it is */
+			if (!dsm.done) {
+				ev_hid_timer(&evl, 0);
+				setout_nowait(usb_handle, 8);
+				dsm.done = 1;
+			}
+			if (!asm_state.done) {
+				ev_timer(&evl, 0, 0);
+				lwin.want = 0;
+				asm_state.done = 1;
+			}
+			stopped = 1;
+		}
+		if (dsm.done && dout) {
+			fclose(dout);
+			fwrite(dbuf, 1, dlen, stdout);
+			free(dbuf);
+			dout = NULL;
+		}
+		if (stopped) {
+			printf("Test stopped at the first failure\n");
+		}
+		if (!dsm.done || !asm_state.done) {
+			mask = ev_wait(&evl, -1);
+		}
+	}
+	*derrs = dsm.nerror;
+	*aerrs = asm_state.nerror;
+	if (v) {
+		printf("Tests took %.1f seconds\n", (now_us() - start) / 1000000.0);
+	}
+	return (dsm.nerror + asm_state.nerror);
+}
+
+/* Key and unkey PTT with silence looped back, looking for clicks */
+static int click_test(struct usb_dev_handle *usb_handle, int v)
+{
+	int i, nerror = 0;
+	float db;
+
+	printf("Testing PTT keying transients (%d cycles, limit %.0f dBFS)...\n", CLICK_CYCLES, CLICK_LIMIT_DBFS);
+	myfreq1 = 0.0;
+	myfreq2 = 0.0;
+	setout(usb_handle, 8);
+	ev_wait_blocks(&evl, 48, 2000);
+	for (i = 0; i < CLICK_CYCLES * 2; i++) {
+		click_arm(&click);
+		ev_wait_blocks(&evl, 3, 500);	/* let the detector take its baseline */
+		setout_nowait(usb_handle, (i & 1) ? 8 : 0xc);
+		click.edge = lastout_us;
+		ev_timer(&evl, 2000, 0);
+		while (!click.done && !(ev_wait(&evl, -1) & EV_TIMER)) {
+			;
+		}
+		ev_timer(&evl, 0, 0);
+		if (!click.done) {
+			click.armed = 0;
+			printf("PTT %s: no audio analyzed!!\n", (i & 1) ? "unkey" : "key");
+			nerror++;
+			continue;
+		}
+		db = (click.peak > 0.0) ? 20.0 * log10(click.peak / 32768.0) : -200.0;
+		if (click.duration > 0.0) {
+			if ((db > CLICK_LIMIT_DBFS) || v) {
+				printf("PTT %s: transient of %.0f counts (%.1f dBFS) lasting %.1f ms, %+.1f ms from the edge\n",
+					   (i & 1) ? "unkey" : "key", click.peak, db, click.duration, click.offset);
+			}
+			if (db > CLICK_LIMIT_DBFS) {
+				nerror++;
+			}
+		} else if (v) {
+			printf("PTT %s: no transient above %.0f counts\n", (i & 1) ? "unkey" : "key", click.thresh);
+		}
+		ev_sleep(&evl, 500);	/* keep the cycles apart */
+	}
+	setout(usb_handle, 8);
+	if (!nerror) {
+		printf("PTT click test Passed!!\n");
+	}
+	return (nerror);
+}
+
+/* Play a stimulus and average the spectrum it produces, returns non-zero if the audio stalled */
+static int imd_measure(float freq, float amp, float mixfreq, float mixamp)
+{
+	int ms;
+
+	myfreq2 = 0.0;
+	mymixamp = mixamp;
+	mymixfreq = mixfreq;
+	myamp1 = amp;
+	myfreq1 = freq;
+	ev_wait_blocks(&evl, IMD_SETTLE_BLOCKS, 3000);
+	ms = specavg_start(&savg, IMD_AVG_BLOCKS);
+	ev_timer(&evl, ms, 0);
+	while (!savg.done && !(ev_wait(&evl, -1) & EV_TIMER)) {
+		;
+	}
+	ev_timer(&evl, 0, 0);
+	savg.want = 0;
+	return (!savg.done);
+}
+
+/* Level of a product relative to a reference level, in dB */
+static float imd_db(float l, float ref)
+{
+	if (l <= 0.0) {
+		return (-200.0);
+	}
+	return (20.0 * log10(l / ref));
+}
+
+/*!
+ * \brief Two-tone intermodulation distortion test
+ *	Both tones are played on the left channel and measured from the
+ *	averaged spectrum.  SMPTE style: a low tone with a high tone 12 dB
+ *	below it, the sidebands of the high tone at +/- 1, 2 and 3 times the
+ *	low tone give the IMD percentage.  CCIF style: two equal tones, the
+ *	difference tone (d2) and the third order products 2f1-f2 and 2f2-f1
+ *	(d3) relative to the tones.  The classic 60 Hz/7 kHz and 19/20 kHz
+ *	tones are scaled into the voice passband and centred on analyzer bins,
+ *	so there is no window leakage between the tones and the products.
+ */
+static int imd_test(int v)
+{
+	int i, k, lf, hf, b1, b2, nerror = 0;
+	float ref, l, sum, imd, d2, d3, t1, t2;
+
+	printf("Testing intermodulation distortion (SMPTE limit %.1f%%, CCIF limit %.0f dB)...\n",
+		   IMD_SMPTE_LIMIT, IMD_CCIF_LIMIT);
+	lf = (int) (IMD_SMPTE_LF / FFT_BIN_HZ + 0.5);
+	hf = (int) (IMD_SMPTE_HF / FFT_BIN_HZ + 0.5);
+	if (imd_measure(IMD_SMPTE_LF, 0.8, IMD_SMPTE_HF, 0.2)) {
+		printf("No audio analyzed for the SMPTE test!!\n");
+		nerror++;
+	} else {
+		ref = specavg_level(&savg, hf);
+		if (ref < IMD_MIN_LEVEL) {
+			printf("SMPTE: %.1f Hz tone level %.1f is too low to measure!!\n", IMD_SMPTE_HF, ref);
+			nerror++;
+		} else {
+			sum = 0.0;
+			for (i = 1; i <= 3; i++) {
+				for (k = -1; k <= 1; k += 2) {
+					l = specavg_level(&savg, hf + k * i * lf);
+					sum += l * l;
+					if (v) {
+						printf("  %.1f Hz: %.1f dB\n", (hf + k * i * lf) * FFT_BIN_HZ, imd_db(l, ref));
+					}
+				}
+			}
+			imd = sqrt(sum) / ref * 100.0;
+			printf("SMPTE IMD (%.1f Hz + %.1f Hz, 4:1): %.3f%% (%.1f dB)\n", IMD_SMPTE_LF, IMD_SMPTE_HF,
+				   imd, imd_db(sqrt(sum), ref));
+			if (imd > IMD_SMPTE_LIMIT) {
+				printf("SMPTE IMD is out of range!!\n");
+				nerror++;
+			}
+		}
+	}
+	b1 = (int) (IMD_CCIF_F1 / FFT_BIN_HZ + 0.5);
+	b2 = (int) (IMD_CCIF_F2 / FFT_BIN_HZ + 0.5);
+	if (imd_measure(IMD_CCIF_F1, 0.5, IMD_CCIF_F2, 0.5)) {
+		printf("No audio analyzed for the CCIF test!!\n");
+		nerror++;
+	} else {
+		t1 = specavg_level(&savg, b1);
+		t2 = specavg_level(&savg, b2);
+		ref = (t1 + t2) / 2.0;
+		if (ref < IMD_MIN_LEVEL) {
+			printf("CCIF: tone levels %.1f and %.1f are too low to measure!!\n", t1, t2);
+			nerror++;
+		} else {
+			d2 = imd_db(specavg_level(&savg, b2 - b1), ref);
+			l = specavg_level(&savg, 2 * b1 - b2);
+			sum = l * l;
+			l = specavg_level(&savg, 2 * b2 - b1);
+			sum += l * l;
+			d3 = imd_db(sqrt(sum), ref);
+			if (v) {
+				printf("  tones %.1f and %.1f, %.1f Hz: %.1f dB, %.1f Hz: %.1f dB, %.1f Hz: %.1f dB\n", t1, t2,
+					   (b2 - b1) * FFT_BIN_HZ, d2,
+					   (2 * b1 - b2) * FFT_BIN_HZ, imd_db(specavg_level(&savg, 2 * b1 - b2), ref),
+					   (2 * b2 - b1) * FFT_BIN_HZ, imd_db(specavg_level(&savg, 2 * b2 - b1), ref));
+			}
+			printf("CCIF IMD (%.1f Hz + %.1f Hz): d2 %.1f dB, d3 %.1f dB\n", IMD_CCIF_F1, IMD_CCIF_F2, d2, d3);
+			if ((d2 > IMD_CCIF_LIMIT) || (d3 > IMD_CCIF_LIMIT)) {
+				printf("CCIF IMD is out of range!!\n");
+				nerror++;
+			}
+		}
+	}
+	myfreq1 = 0.0;
+	mymixfreq = 0.0;
+	mymixamp = 0.0;
+	myamp1 = 1.0;
+	if (!nerror) {
+		printf("IMD test Passed!!\n");
+	}
+	return (nerror);
+}
+
+/*!
+ * \brief Full band spur search
+ *	The stopband check only looks at one frequency.  This averages Hann
+ *	windowed spectra of the capture while a stimulus plays and looks for
+ *	peaks anywhere from DC to Nyquist, leaving out DC, the stimulus tones
+ *	and their low harmonics (higher ones are listed, marked, but do not
+ *	fail the test).  A peak counts as a spur if it stands clear of the
+ *	median of the bins around it.  Spur and carrier are both summed over
+ *	their window lobes, so the ratio is in dBc whatever the bin offset.
+ *	Host switching supplies and the 1 kHz USB frame rate show up here.
+ */
+struct spur {
+	float freq;
+	float dbc;
+};
+
+/* Mark the lobe of a tone at freq and its low harmonics as not spurs */
+static void spur_exclude(unsigned char *excl, float freq)
+{
+	int h, k, b;
+
+	for (h = 1; (h <= SPUR_HARMONICS) && (h * freq < 24000.0); h++) {
+		b = (int) (h * freq / FFT_BIN_HZ + 0.5);
+		for (k = b - SPUR_LOBE; k <= b + SPUR_LOBE; k++) {
+			if ((k >= 0) && (k < NFFT / 2)) {
+				excl[k] = 1;
+			}
+		}
+	}
+}
+
+/* Power of a tone summed over its lobe around bin b */
+static double spur_lobe(double *pow, int b)
+{
+	double p = 0.0;
+	int k;
+
+	for (k = b - SPUR_LOBE; k <= b + SPUR_LOBE; k++) {
+		if ((k >= 0) && (k < NFFT / 2)) {
+			p += pow[k];
+		}
+	}
+	return (p);
+}
+
+/* Median of the bins around b, its own lobe left out */
+static double spur_floor(double *pow, int b)
+{
+	double v[2 * SPUR_FLOOR_BINS + 1], t;
+	int i, j, k, n = 0;
+
+	for (k = b - SPUR_FLOOR_BINS; k <= b + SPUR_FLOOR_BINS; k++) {
+		if ((k < 1) || (k >= NFFT / 2) || (abs(k - b) <= SPUR_LOBE)) {
+			continue;
+		}
+		v[n++] = pow[k];
+	}
+	for (i = 1; i < n; i++) {
+		for (j = i; (j > 0) && (v[j - 1] > v[j]); j--) {
+			t = v[j]; v[j] = v[j - 1]; v[j - 1] = t;
+		}
+	}
+	return ((n) ? v[n / 2] : 0.0);
+}
+
+/* Harmonic number of a tone at freq that f falls on, above the excluded ones, or 0 */
+static int spur_harmonic(float f, float freq)
+{
+	int h;
+
+	if (freq <= 0.0) {
+		return (0);
+	}
+	h = (int) (f / freq + 0.5);
+	if ((h > SPUR_HARMONICS) && (fabs(f - h * freq) < SPUR_LOBE * FFT_BIN_HZ)) {
+		return (h);
+	}
+	return (0);
+}
+
+/* Find the spurs in the averaged spectrum, largest first, returns how many */
+static int spur_find(struct spuravg *sa, unsigned char *excl, double carrier, struct spur *sp, int max)
+{
+	double *p = sa->pow, a, b, c, d;
+	struct spur t;
+	int i, j, n = 0;
+
+	for (i = 1; i < NFFT / 2 - 1; i++) {
+		if (excl[i] || (p[i] <= p[i - 1]) || (p[i] < p[i + 1])) {
+			continue;
+		}
+		if (p[i] < spur_floor(p, i) * pow(10.0, SPUR_MIN_SNR / 10.0)) {
+			continue;
+		}
+		/* Gaussian interpolation of the peak for the Hann window */
+		a = log(p[i - 1] + 1e-30);
+		b = log(p[i] + 1e-30);
+		c = log(p[i + 1] + 1e-30);
+		d = (a - 2.0 * b + c != 0.0) ? 0.5 * (a - c) / (a - 2.0 * b + c) : 0.0;
+		t.freq = (i + d) * FFT_BIN_HZ;
+		t.dbc = 10.0 * log10(spur_lobe(p, i) / carrier);
+		/* keep the largest max, in order */
+		if (n < max) {
+			j = n++;
+		} else if (t.dbc > sp[max - 1].dbc) {
+			j = max - 1;
+		} else {
+			continue;
+		}
+		for (; (j > 0) && (sp[j - 1].dbc < t.dbc); j--) {
+			sp[j] = sp[j - 1];
+		}
+		sp[j] = t;
+	}
+	return (n);
+}
+
+/* Spur search with the stimulus at freq1 (and freq2) */
+static int spur_test(int v)
+{
+	static struct spur sp[SPUR_MAX];
+	unsigned char excl[NFFT / 2];
+	char str[200];
+	float f1, f2;
+	double carrier;
+	int i, n, ms, worst = -1, nerror = 0, max = (v) ? SPUR_MAX : SPUR_REPORT;
+
+	prompt_str("Left channel frequency [1172]: ", str, sizeof(str));
+	f1 = (str[0]) ? atof(str) : SPUR_FREQ;
+	prompt_str("Right channel frequency (Enter for none): ", str, sizeof(str));
+	f2 = atof(str);
+	if ((f1 <= 0.0) || (f1 >= 24000.0) || (f2 < 0.0) || (f2 >= 24000.0)) {
+		printf("Frequency out of range\n");
+		return (1);
+	}
+	if (f2 > 0.0) {
+		printf("Searching 0 - 24000 Hz for spurs at %.1f (and %.1f) Hz...\n", f1, f2);
+	} else {
+		printf("Searching 0 - 24000 Hz for spurs at %.1f Hz...\n", f1);
+	}
+	myfreq1 = f1;
+	myfreq2 = f2;
+	ev_wait_blocks(&evl, SPUR_SETTLE_BLOCKS, 3000);
+	ms = spuravg_start(&spavg, SPUR_AVG_BLOCKS);
+	ev_timer(&evl, ms, 0);
+	while (!spavg.done && !(ev_wait(&evl, -1) & EV_TIMER)) {
+		;
+	}
+	ev_timer(&evl, 0, 0);
+	spavg.want = 0;
+	myfreq1 = 0.0;
+	myfreq2 = 0.0;
+	if (!spavg.done) {
+		printf("No audio analyzed!!\n");
+		return (1);
+	}
+	carrier = spur_lobe(spavg.pow, (int) (f1 / FFT_BIN_HZ + 0.5));
+	if (f2 > 0.0) {
+		carrier = (carrier + spur_lobe(spavg.pow, (int) (f2 / FFT_BIN_HZ + 0.5))) / 2.0;
+	}
+	if ((sqrt(carrier / spavg.n) / (float) (NFFT / 2)) * 4096.0 < SPUR_MIN_LEVEL) {
+		printf("Carrier level %.1f is too low to measure against!!\n",
+			   (sqrt(carrier / spavg.n) / (float) (NFFT / 2)) * 4096.0);
+		return (1);
+	}
+	memset(excl, 0, sizeof(excl));
+	for (i = 0; i <= SPUR_LOBE; i++) {
+		excl[i] = 1;			/* DC */
+	}
+	spur_exclude(excl, f1);
+	if (f2 > 0.0) {
+		spur_exclude(excl, f2);
+	}
+	n = spur_find(&spavg, excl, carrier, sp, max);
+	printf("Carrier level %.1f, averaged over %d frames\n", (sqrt(carrier / spavg.n) / (float) (NFFT / 2)) * 4096.0,
+		   spavg.n);
+	if (!n) {
+		printf("No spurs %.0f dB above the noise floor\n", SPUR_MIN_SNR);
+	}
+	for (i = 0; i < n; i++) {
+		float f = sp[i].freq, k = 1000.0 * floor(f / 1000.0 + 0.5);
+		int h = spur_harmonic(f, f1), h2 = spur_harmonic(f, f2), usb = ((k > 0.0) && (fabs(f - k) < FFT_BIN_HZ));
+
+		printf("  %8.1f Hz: %6.1f dBc", f, sp[i].dbc);
+		if (usb) {
+			printf("  (USB frame rate multiple)");
+			h = h2 = 0;
+		} else if (h || h2) {
+			printf("  (harmonic %d)", (h) ? h : h2);
+		}
+		printf("\n");
+		/* higher harmonics are distortion, the linearity sweep judges that */
+		if ((worst < 0) && !h && !h2) {
+			worst = i;
+		}
+	}
+	if (n) {
+		printf("Spurious free dynamic range %.1f dB\n", -sp[0].dbc);
+	}
+	if ((worst >= 0) && (sp[worst].dbc > SPUR_LIMIT_DBC)) {
+		printf("Largest spur at %.1f Hz is above %.0f dBc!!\n", sp[worst].freq, SPUR_LIMIT_DBC);
+		nerror++;
+	}
+	if (!nerror) {
+		printf("Spur search Passed!!\n");
+	}
+	return (nerror);
+}
+
+/*!
+ * \brief Gain linearity sweep
+ *	The left channel stimulus is stepped down from full scale in 3 dB
+ *	steps and the captured tone measured from short averages of Hann
+ *	windowed spectra, with the noise in the tone lobe (from the median of
+ *	the bins around it) taken off.  A step is settled once two averages
+ *	agree and the level has moved from the last step, so most steps take
+ *	a few blocks and only the ones near the noise floor run to the limit.
+ *	The error is against a unity slope line through the middle steps,
+ *	clear of both clipping and noise.
+ */
+static int lin_window(double *tone, double *noise)
+{
+	int ms, b = (int) (LIN_FREQ / FFT_BIN_HZ + 0.5);
+
+	ms = spuravg_start(&spavg, LIN_AVG_BLOCKS);
+	ev_timer(&evl, ms, 0);
+	while (!spavg.done && !(ev_wait(&evl, -1) & EV_TIMER)) {
+		;
+	}
+	ev_timer(&evl, 0, 0);
+	spavg.want = 0;
+	if (!spavg.done) {
+		return (-1);
+	}
+	/* lobe of the bin centred tone, each of its bins with the median noise in it */
+	*noise = (2 * SPUR_LOBE + 1) * spur_floor(spavg.pow, b) / spavg.n;
+	*tone = spur_lobe(spavg.pow, b) / spavg.n - *noise;
+	if (*tone < 1e-30) {
+		*tone = 1e-30;
+	}
+	if (*noise < 1e-30) {
+		*noise = 1e-30;
+	}
+	return (0);
+}
+
+/* Step the stimulus level down 60 dB and check the gain stays constant */
+static int lin_test(int v)
+{
+	float db[LIN_STEPS], snr[LIN_STEPS], err, maxerr = 0.0;
+	double tone, noise, cur = 0.0, last, offset = 0.0;
+	int i, w, nref = 0, maxat = 0, nfloor = -1, nerror = 0, windows = 0;
+
+	printf("Sweeping the stimulus from 0 to -%.0f dB in %.0f dB steps at %.2f Hz...\n",
+		   (LIN_STEPS - 1) * LIN_STEP_DB, LIN_STEP_DB, LIN_FREQ);
+	myfreq2 = 0.0;
+	myamp1 = 1.0;
+	myfreq1 = LIN_FREQ;
+	ev_wait_blocks(&evl, LIN_SETTLE_BLOCKS, 3000);
+	for (i = 0; i < LIN_STEPS; i++) {
+		myamp1 = pow(10.0, -i * LIN_STEP_DB / 20.0);
+		last = 0.0;
+		for (w = 0; w < LIN_MAX_WINDOWS; w++) {
+			if (lin_window(&tone, &noise)) {
+				printf("No audio analyzed at -%.0f dB!!\n", i * LIN_STEP_DB);
+				myfreq1 = 0.0;
+				myamp1 = 1.0;
+				return (nerror + 1);
+			}
+			cur = 10.0 * log10(tone);
+			if (w && (fabs(cur - last) < LIN_SETTLE_DB) && (!i || (db[i - 1] - cur > LIN_STEP_DB / 2.0))) {
+				break;
+			}
+			last = cur;
+		}
+		windows += (w < LIN_MAX_WINDOWS) ? w + 1 : w;
+		db[i] = cur;
+		snr[i] = 10.0 * log10(tone / noise);
+		if ((nfloor < 0) && (snr[i] < LIN_NOISE_SNR)) {
+			nfloor = i;
+		}
+		if ((i * LIN_STEP_DB >= LIN_REF_HI) && (i * LIN_STEP_DB <= LIN_REF_LO) && (snr[i] >= LIN_ERR_SNR)) {
+			offset += db[i] + i * LIN_STEP_DB;
+			nref++;
+		}
+	}
+	myfreq1 = 0.0;
+	myamp1 = 1.0;
+	if (!nref) {
+		printf("The tone never stood %.0f dB clear of the noise between -%.0f and -%.0f dB!!\n", LIN_ERR_SNR,
+			   LIN_REF_HI, LIN_REF_LO);
+		return (1);
+	}
+	offset /= nref;
+	for (i = 0; i < LIN_STEPS; i++) {
+		err = db[i] + i * LIN_STEP_DB - offset;
+		if (v) {
+			printf("  %4.0f dB: level %8.2f, error %+6.2f dB, SNR %5.1f dB\n", -i * LIN_STEP_DB,
+				   (sqrt(pow(10.0, db[i] / 10.0)) / (float) (NFFT / 2)) * 4096.0, err, snr[i]);
+		}
+		if ((snr[i] >= LIN_ERR_SNR) && (fabs(err) > fabs(maxerr))) {
+			maxerr = err;
+			maxat = i;
+		}
+	}
+	printf("Gain linearity error %+.2f dB at -%.0f dB (steps at least %.0f dB above the noise), %d averages of %d blocks\n",
+		   maxerr, maxat * LIN_STEP_DB, LIN_ERR_SNR, windows, LIN_AVG_BLOCKS);
+	if (nfloor >= 0) {
+		printf("The tone falls into the noise (SNR under %.0f dB) at -%.0f dB\n", LIN_NOISE_SNR, nfloor * LIN_STEP_DB);
+	} else {
+		printf("The tone is still %.1f dB above the noise at -%.0f dB\n", snr[LIN_STEPS - 1],
+			   (LIN_STEPS - 1) * LIN_STEP_DB);
+	}
+	if (fabs(maxerr) > LIN_LIMIT_DB) {
+		printf("Gain linearity error is out of range (+/- %.1f dB)!!\n", LIN_LIMIT_DB);
+		nerror++;
+	} else {
+		printf("Gain linearity test Passed!!\n");
+	}
+	return (nerror);
+}
+
+/* Live voice band zoom display */
+static int zoom_test(void)
+{
+	char str[200];
+	float freq, f, l, n;
+	unsigned long nfft;
+	int mask;
+
+	prompt_str("Left channel frequency [1004]: ", str, sizeof(str));
+	freq = (str[0]) ? atof(str) : 1004.0;
+	zoom_init(&zoom);
+	myfreq1 = freq;
+	myfreq2 = 0.0;
+	zoom.active = 1;
+	printf("Zoom analysis at %.1f Hz resolution, press any key to stop...\r\n", ZOOM_BIN_HZ);
+	kbd_nowait();
+	ev_key(&evl);
+	ev_timer(&evl, 500, 1);
+	for (;;) {
+		mask = ev_wait(&evl, -1);
+		if (mask & EV_KEY) {
+			ev_key(&evl);
+			break;
+		}
+		if (!(mask & EV_TIMER)) {
+			continue;
+		}
+		pthread_mutex_lock(&zoom.lock);
+		f = zoom.freq;
+		l = zoom.lev;
+		n = zoom.noise;
+		nfft = zoom.nfft;
+		pthread_mutex_unlock(&zoom.lock);
+		if (!nfft) {
+			continue;
+		}
+		printf("Tone at %.2f Hz: level %.1f, noise (%.0f - %.0f Hz) %.1f, S/N %.1f dB\r\n", f, l,
+			   ZOOM_NOISE_LO, ZOOM_NOISE_HI, n, (n > 0.0) ? 20.0 * log10(l / n) : 0.0);
+	}
+	ev_timer(&evl, 0, 0);
+	kbd_wait();
+	zoom.active = 0;
+	myfreq1 = 0.0;
+	return (0);
+}
+
+/*!
+ * \brief Voice band equalizer fit
+ *	The loopback response is measured with a periodic multitone: one tone
+ *	on every analyzer bin from EQ_KLO to EQ_KHI with Schroeder phases (low
+ *	crest factor), repeating every NFFT frames so every analysis block
+ *	holds whole periods and each tone lands exactly on its bin.  A linear
+ *	phase (symmetric) FIR for the 8 kHz channel driver audio is then
+ *	fitted by weighted least squares on that bin grid to the inverse of
+ *	the response, relative to the 984 Hz bin.  Filtering a sum of tones only scales
+ *	each tone, so the fit is verified by scaling the stimulus tones by
+ *	the filter response and measuring again.
+ */
+#define	EQ_NTONES	(EQ_KHI - EQ_KLO + 1)
+#define	EQ_NCOEF	(EQ_TAPS / 2 + 1)
+#define	EQ_REF_BIN	((int) (CAL_REF_FREQ / FFT_BIN_HZ + 0.5))	/* 984 Hz, the 0 dB point */
+
+static float eq_stim[NFFT];
+
+/* Build the multitone from the tone amplitudes, scaled to EQ_PEAK; amp is scaled to match */
+static void eq_stimulus(float *amp)
+{
+	double ph, peak = 0.0;
+	int i, k;
+
+	for (i = 0; i < NFFT; i++) {
+		eq_stim[i] = 0.0;
+	}
+	for (k = 0; k < EQ_NTONES; k++) {
+		ph = -M_PI * k * (k - 1) / EQ_NTONES;
+		for (i = 0; i < NFFT; i++) {
+			eq_stim[i] += amp[k] * cos(2.0 * M_PI * (k + EQ_KLO) * i / NFFT + ph);
+		}
+	}
+	for (i = 0; i < NFFT; i++) {
+		if (fabs(eq_stim[i]) > peak) {
+			peak = fabs(eq_stim[i]);
+		}
+	}
+	for (i = 0; i < NFFT; i++) {
+		eq_stim[i] *= EQ_PEAK / peak;
+	}
+	for (k = 0; k < EQ_NTONES; k++) {
+		amp[k] *= EQ_PEAK / peak;
+	}
+}
+
+/* Play the multitone and measure the loopback gain of every tone, relative to EQ_REF_BIN */
+static int eq_measure(float *amp, float *resp)
+{
+	int k, ms, ref = EQ_REF_BIN - EQ_KLO;
+
+	eq_stimulus(amp);
+	myfreq1 = myfreq2 = 0.0;
+	mystim = eq_stim;
+	ev_wait_blocks(&evl, EQ_SETTLE_BLOCKS, 3000);
+	ms = specavg_start(&savg, EQ_AVG_BLOCKS);
+	ev_timer(&evl, ms, 0);
+	while (!savg.done && !(ev_wait(&evl, -1) & EV_TIMER)) {
+		;
+	}
+	ev_timer(&evl, 0, 0);
+	savg.want = 0;
+	mystim = NULL;
+	if (!savg.done) {
+		return (-1);
+	}
+	for (k = 0; k < EQ_NTONES; k++) {
+		resp[k] = specavg_level(&savg, k + EQ_KLO) / amp[k];
+	}
+	if (resp[ref] < 1e-6) {
+		return (-1);
+	}
+	for (k = EQ_NTONES - 1; k >= 0; k--) {
+		resp[k] /= resp[ref];
+	}
+	return (0);
+}
+
+/* Gain of the symmetric FIR with centre and one sided coefficients h at f Hz */
+static double eq_gain(double *h, double f)
+{
+	double w = 2.0 * M_PI * f / EQ_RATE, g = h[0];
+	int n;
+
+	for (n = 1; n < EQ_NCOEF; n++) {
+		g += 2.0 * h[n] * cos(w * n);
+	}
+	return (g);
+}
+
+/* Solve a x = b in place (Gaussian elimination, partial pivoting) */
+static int eq_solve(double a[EQ_NCOEF][EQ_NCOEF], double *b, int n)
+{
+	double t;
+	int i, j, k, p;
+
+	for (i = 0; i < n; i++) {
+		p = i;
+		for (j = i + 1; j < n; j++) {
+			if (fabs(a[j][i]) > fabs(a[p][i])) {
+				p = j;
+			}
+		}
+		if (fabs(a[p][i]) < 1e-12) {
+			return (-1);
+		}
+		for (k = 0; k < n; k++) {
+			t = a[i][k];
+			a[i][k] = a[p][k];
+			a[p][k] = t;
+		}
+		t = b[i];
+		b[i] = b[p];
+		b[p] = t;
+		for (j = i + 1; j < n; j++) {
+			t = a[j][i] / a[i][i];
+			for (k = i; k < n; k++) {
+				a[j][k] -= t * a[i][k];
+			}
+			b[j] -= t * b[i];
+		}
+	}
+	for (i = n - 1; i >= 0; i--) {
+		for (k = i + 1; k < n; k++) {
+			b[i] -= a[i][k] * b[k];
+		}
+		b[i] /= a[i][i];
+	}
+	return (0);
+}
+
+/*
+ * Weighted least squares fit of the filter to 1/resp.  The voice band
+ * is weighted fully; outside it the target is held at the nearest band
+ * edge value with a small weight, so the filter does nothing wild where
+ * the channel driver filters anyway.  Boost is capped at EQ_MAX_BOOST.
+ */
+static int eq_fit(float *resp, double *h)
+{
+	double a[EQ_NCOEF][EQ_NCOEF], c[EQ_NCOEF], t[EQ_NTONES], f, w, wt, lo = 0.0, hi = 1.0;
+	double maxgain = pow(10.0, EQ_MAX_BOOST / 20.0);
+	int i, j, k;
+
+	for (k = 0; k < EQ_NTONES; k++) {
+		t[k] = (resp[k] > 1.0 / maxgain) ? 1.0 / resp[k] : maxgain;
+		f = (k + EQ_KLO) * FFT_BIN_HZ;
+		if ((f >= EQ_BAND_LO) && (lo == 0.0)) {
+			lo = t[k];
+		}
+		if (f <= EQ_BAND_HI) {
+			hi = t[k];
+		}
+	}
+	memset(a, 0, sizeof(a));
+	memset(h, 0, sizeof(double) * EQ_NCOEF);
+	for (k = 0; k < EQ_NTONES; k++) {
+		f = (k + EQ_KLO) * FFT_BIN_HZ;
+		w = 2.0 * M_PI * f / EQ_RATE;
+		wt = 1.0;
+		if (f < EQ_BAND_LO) {
+			t[k] = lo;
+			wt = EQ_STOP_WEIGHT;
+		} else if (f > EQ_BAND_HI) {
+			t[k] = hi;
+			wt = EQ_STOP_WEIGHT;
+		}
+		for (i = 0; i < EQ_NCOEF; i++) {
+			c[i] = (i) ? 2.0 * cos(w * i) : 1.0;
+		}
+		for (i = 0; i < EQ_NCOEF; i++) {
+			for (j = 0; j < EQ_NCOEF; j++) {
+				a[i][j] += wt * c[i] * c[j];
+			}
+			h[i] += wt * c[i] * t[k];
+		}
+	}
+	for (i = 0; i < EQ_NCOEF; i++) {
+		a[i][i] += EQ_RIDGE * EQ_NTONES;
+	}
+	return (eq_solve(a, h, EQ_NCOEF));
+}
+
+/* Peak to peak and RMS deviation of the response over the voice band, dB */
+static float eq_flatness(float *resp, float *rms)
+{
+	float db, min = 1e30, max = -1e30;
+	double sum = 0.0;
+	int k, n = 0;
+
+	for (k = 0; k < EQ_NTONES; k++) {
+		if (((k + EQ_KLO) * FFT_BIN_HZ < EQ_BAND_LO) || ((k + EQ_KLO) * FFT_BIN_HZ > EQ_BAND_HI)) {
+			continue;
+		}
+		db = 20.0 * log10((resp[k] > 1e-6) ? resp[k] : 1e-6);
+		if (db < min) {
+			min = db;
+		}
+		if (db > max) {
+			max = db;
+		}
+		sum += db * db;
+		n++;
+	}
+	*rms = (n) ? sqrt(sum / n) : 0.0;
+	return (max - min);
+}
+
+/* Write the full set of taps, centre in the middle */
+static int eq_export(char *name, double *h, float flat, float eqflat)
+{
+	FILE *fp;
+	time_t now = time(NULL);
+	int n;
+
+	fp = fopen(name, "w");
+	if (!fp) {
+		return (-1);
+	}
+	fprintf(fp, "# URI voice band equalizer, %s USB Radio Interface at %s, %s", devtypestrs[devtype], devpath,
+			ctime(&now));
+	fprintf(fp, "# %d tap linear phase FIR at %.0f Hz, %.0f - %.0f Hz flat to %.2f dB (was %.2f dB)\n",
+			EQ_TAPS, EQ_RATE, EQ_BAND_LO, EQ_BAND_HI, eqflat, flat);
+	for (n = 0; n < EQ_TAPS; n++) {
+		fprintf(fp, "%.9f\n", h[abs(n - EQ_TAPS / 2)]);
+	}
+	fclose(fp);
+	return (0);
+}
+
+/* Measure, fit, verify and export the equalizer */
+static int eq_test(void)
+{
+	float amp[EQ_NTONES], resp[EQ_NTONES], eqresp[EQ_NTONES];
+	double h[EQ_NCOEF];
+	char str[200];
+	float flat, rms, eqflat, eqrms;
+	unsigned long long t;
+	int k;
+
+	printf("Measuring the loopback response with %d tones, %.0f - %.0f Hz...\n", EQ_NTONES,
+		   EQ_KLO * FFT_BIN_HZ, EQ_KHI * FFT_BIN_HZ);
+	for (k = 0; k < EQ_NTONES; k++) {
+		amp[k] = 1.0;
+	}
+	if (eq_measure(amp, resp)) {
+		printf("No response measured, check the loopback!!\n");
+		return (1);
+	}
+	flat = eq_flatness(resp, &rms);
+	t = now_us();
+	if (eq_fit(resp, h)) {
+		printf("Equalizer fit failed!!\n");
+		return (1);
+	}
+	printf("Fitted %d taps in %.1f ms\n", EQ_TAPS, (now_us() - t) / 1000.0);
+
+	/* the equalized stimulus is the same tones through the filter */
+	for (k = 0; k < EQ_NTONES; k++) {
+		amp[k] = fabs(eq_gain(h, (k + EQ_KLO) * FFT_BIN_HZ));
+	}
+	if (eq_measure(amp, eqresp)) {
+		printf("No response measured with the equalizer!!\n");
+		return (1);
+	}
+	/* eq_measure divides out the stimulus, put the filter back in */
+	for (k = 0; k < EQ_NTONES; k++) {
+		eqresp[k] *= fabs(eq_gain(h, (k + EQ_KLO) * FFT_BIN_HZ)) /
+			fabs(eq_gain(h, EQ_REF_BIN * FFT_BIN_HZ));
+	}
+	eqflat = eq_flatness(eqresp, &eqrms);
+
+	printf("\n%-10s %10s %10s %10s\n", "Freq (Hz)", "Path (dB)", "EQ (dB)", "Result (dB)");
+	for (k = 0; k < EQ_NTONES; k += 4) {
+		printf("%-10.1f %10.2f %10.2f %10.2f\n", (k + EQ_KLO) * FFT_BIN_HZ, 20.0 * log10(resp[k]),
+			   20.0 * log10(fabs(eq_gain(h, (k + EQ_KLO) * FFT_BIN_HZ))), 20.0 * log10(eqresp[k]));
+	}
+	printf("Voice band (%.0f - %.0f Hz): %.2f dB p-p, %.2f dB RMS before; %.2f dB p-p, %.2f dB RMS equalized\n",
+		   EQ_BAND_LO, EQ_BAND_HI, flat, rms, eqflat, eqrms);
+	printf("Coefficients (%d taps at %.0f Hz):\n", EQ_TAPS, EQ_RATE);
+	for (k = 0; k < EQ_TAPS; k++) {
+		printf("%.6f%s", h[abs(k - EQ_TAPS / 2)], (k == EQ_TAPS - 1) ? "\n" : ((k % 8) == 7) ? ",\n" : ", ");
+	}
+	prompt_str("Coefficient file (Enter for " EQ_FILE ", '-' for none): ", str, sizeof(str));
+	if (strcmp(str, "-")) {
+		if (eq_export((str[0]) ? str : EQ_FILE, h, flat, eqflat)) {
+			printf("Unable to write %s\n", (str[0]) ? str : EQ_FILE);
+		} else {
+			printf("Coefficients written to %s\n", (str[0]) ? str : EQ_FILE);
+		}
+	}
+	if (eqflat >= flat) {
+		printf("The equalizer did not improve the response!!\n");
+		return (1);
+	}
+	return (0);
+}
+
+/* Play a stimulus and measure the levels over nblocks, returns non-zero if the audio stalled */
+static int level_measure(float freq1, float freq2, int nblocks)
+{
+	unsigned long long start;
+	int ms;
+
+	if ((myfreq1 != freq1) || (myfreq2 != freq2)) {
+		start = now_us();
+		myfreq1 = freq1;
+		myfreq2 = freq2;
+		glitch_clear(&glitch);
+		/* settle until the new stimulus is steady at the input and through the playback queue */
+		ev_timer(&evl, ANALOG_SETTLE_MAX / 1000, 0);
+		while ((!glitch.locked || (now_us() - start < playback_queue_us() + AUDIO_BLOCK_US)) &&
+			   !(ev_wait(&evl, -1) & EV_TIMER)) {
+			;
+		}
+	} else {
+		ev_wait_blocks(&evl, 2, 500);	/* a block in flight may predate a mixer change */
+	}
+	ms = levwin_start(&lwin, nblocks);
+	ev_timer(&evl, ms, 0);
+	while (!lwin.done && !(ev_wait(&evl, -1) & EV_TIMER)) {
+		;
+	}
+	ev_timer(&evl, 0, 0);
+	lwin.want = 0;
+	return (!lwin.done);
+}
+
+/* Show a calibration record */
+static void cal_print(struct cal_rec *rec)
+{
+	time_t when = rec->when;
+	int i;
+
+	printf("Calibrated %s", ctime(&when));
+	printf("  capture setting %d of %d, loopback gain %.3f, DC offset %.1f\n", rec->capset, rec->capmax,
+		   rec->gain, rec->offset);
+	for (i = 0; i < CAL_NRESP; i++) {
+		printf("  %6.1f Hz: left %+5.2f dB, right %+5.2f dB\n", cal_freqs[i], rec->resp[i][0], rec->resp[i][1]);
+	}
+}
+
+/* Apply a cached calibration */
+static void cal_apply(struct cal_rec *rec)
+{
+	if (rec->capmax == capmax) {
+		capture_set(rec->capset);
+	}
+}
+
+/* Full calibration of the unit in hand */
+static int cal_run(struct cal_db *db)
+{
+	struct cal_rec rec;
+	struct mix_rec *mix;
+	float ref[2], l;
+	int lo, hi, mid, i, ch;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.key = db->key;
+	rec.when = time(NULL);
+	rec.productid = devproductid;
+	rec.bcddevice = devbcd;
+	printf("Calibrating, this takes about 20 seconds...\n");
+	/* capture offset with no stimulus */
+	myfreq1 = 0.0;
+	myfreq2 = 0.0;
+	ev_wait_blocks(&evl, IMD_SETTLE_BLOCKS, 3000);
+	if (level_measure(0.0, 0.0, ANALOG_WINDOW_BLOCKS)) {
+		printf("No audio analyzed!!\n");
+		return (1);
+	}
+	rec.offset = lwin.dc.mean;
+	/* capture setting nearest PASSBAND_LEVEL, the level rises with the setting */
+	if (capmax > 0) {
+		lo = 0;
+		hi = capmax;
+		if ((mix = mix_lookup())) {
+			/* jump to the step the chip's table gives, moved by this unit's difference from it */
+			mid = mix_step(mix, 0.0);
+			capture_set(mid);
+			if (level_measure(CAL_REF_FREQ, 0.0, CAL_PROBE_BLOCKS)) {
+				printf("No audio analyzed!!\n");
+				return (1);
+			}
+			lo = hi = mix_step(mix, mix->capdb[mid] - mix_db(lwin.s1.mean / PASSBAND_LEVEL));
+			printf("  capture setting %d: level %.1f, the mixer table puts PASSBAND_LEVEL at %d\n", mid,
+				   lwin.s1.mean, lo);
+		}
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			capture_set(mid);
+			if (level_measure(CAL_REF_FREQ, 0.0, CAL_PROBE_BLOCKS)) {
+				printf("No audio analyzed!!\n");
+				return (1);
+			}
+			printf("  capture setting %d: level %.1f\n", mid, lwin.s1.mean);
+			if (lwin.s1.mean < PASSBAND_LEVEL) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo > 0) {
+			capture_set(lo);
+			level_measure(CAL_REF_FREQ, 0.0, CAL_PROBE_BLOCKS);
+			l = lwin.s1.mean;
+			capture_set(lo - 1);
+			level_measure(CAL_REF_FREQ, 0.0, CAL_PROBE_BLOCKS);
+			if (fabs(l - PASSBAND_LEVEL) < fabs(lwin.s1.mean - PASSBAND_LEVEL)) {
+				capture_set(lo);
+			}
+		} else {
+			capture_set(lo);
+		}
+	}
+	rec.capset = capset;
+	rec.capmax = capmax;
+	/* response of each channel relative to the reference frequency */
+	for (ch = 0; ch < 2; ch++) {
+		if (level_measure((ch) ? 0.0 : CAL_REF_FREQ, (ch) ? CAL_REF_FREQ : 0.0, ANALOG_WINDOW_BLOCKS)) {
+			printf("No audio analyzed!!\n");
+			return (1);
+		}
+		ref[ch] = (ch) ? lwin.s2.mean : lwin.s1.mean;
+		if (!ch) {
+			rec.gain = ref[0] / PASSBAND_LEVEL;
+		}
+		for (i = 0; i < CAL_NRESP; i++) {
+			if (level_measure((ch) ? 0.0 : cal_freqs[i], (ch) ? cal_freqs[i] : 0.0, ANALOG_WINDOW_BLOCKS)) {
+				printf("No audio analyzed!!\n");
+				return (1);
+			}
+			l = (ch) ? lwin.s2.mean : lwin.s1.mean;
+			rec.resp[i][ch] = ((l > 0.0) && (ref[ch] > 0.0)) ? 20.0 * log10(l / ref[ch]) : -100.0;
+		}
+	}
+	myfreq1 = 0.0;
+	myfreq2 = 0.0;
+	cal_print(&rec);
+	if (cal_store(db, &rec)) {
+		return (1);
+	}
+	printf("Calibration saved to %s\n", db->path);
+	return (0);
+}
+
+/* Short check that the cached calibration still holds, returns non-zero if not */
+static int cal_spot_check(struct cal_rec *rec)
+{
+	float l, dc;
+
+	cal_apply(rec);
+	if (level_measure(CAL_REF_FREQ, 0.0, ANALOG_WINDOW_BLOCKS)) {
+		printf("No audio analyzed!!\n");
+		return (-1);
+	}
+	l = lwin.s1.mean;
+	dc = lwin.dc.mean;
+	myfreq1 = 0.0;
+	printf("Spot check at %.1f Hz: level %.1f (cached %.1f), DC offset %.1f (cached %.1f)\n",
+		   CAL_REF_FREQ, l, rec->gain * PASSBAND_LEVEL, dc, rec->offset);
+	if ((fabs(l - rec->gain * PASSBAND_LEVEL) > rec->gain * PASSBAND_LEVEL * CAL_SPOT_TOL) ||
+		(fabs(dc - rec->offset) > CAL_OFFSET_TOL)) {
+		return (1);
+	}
+	return (0);
+}
+
+/* Calibrate the unit, or just spot check a cached calibration */
+static int cal_test(struct usb_dev_handle *usb_handle, struct usb_device *dev, int force)
+{
+	if (!cal.havekey) {
+		cal_unit_key(&cal, usb_handle, dev);
+		if (!cal.havekey) {
+			return (1);
+		}
+		cal.rec = cal_find(&cal, cal.key);
+	}
+	if (cal.weakkey) {
+		printf("This unit has no serial number or manufacturer EEPROM data to tell it from others, not calibrated\n");
+		return (1);
+	}
+	if (cal.rec && !force) {
+		cal_print(cal.rec);
+		if (!cal_spot_check(cal.rec)) {
+			printf("Cached calibration is valid\n");
+			return (0);
+		}
+		printf("Cached calibration no longer holds, recalibrating\n");
+	}
+	return (cal_run(&cal));
+}
+
+/* Show a mixer step table */
+static void mix_print(struct mix_rec *rec)
+{
+	time_t when = rec->when;
+	int s, ref = mix_step(rec, 0.0);
+
+	printf("Mixer characterized %s", ctime(&when));
+	printf("  capture steps 0 to %d: %+.1f to %+.1f dB, PASSBAND_LEVEL at step %d", rec->capmax, rec->capdb[0],
+		   rec->capdb[rec->capmax], ref);
+	if ((ref > 0) && (ref < rec->capmax)) {
+		printf(" (%.2f dB a step there)", (rec->capdb[ref + 1] - rec->capdb[ref - 1]) / 2.0);
+	}
+	printf("\n  playback steps 0 to %d: %+.1f to 0.0 dB, measured at capture step %d\n", rec->spkrmax,
+		   rec->spkrdb[0], rec->capref);
+	printf("  Capture, dB relative to PASSBAND_LEVEL:");
+	for (s = 0; s <= rec->capmax; s++) {
+		printf("%s%3d %+6.1f", (s % 8) ? "  " : "\n    ", s, rec->capdb[s]);
+	}
+	printf("\n  Playback, dB relative to the top step:");
+	for (s = 0; s <= rec->spkrmax; s++) {
+		printf("%s%3d %+6.1f", (s % 8) ? "  " : "\n    ", s, rec->spkrdb[s]);
+	}
+	printf("\n");
+}
+
+/*
+ * Step the capture control through its range with the playback at the top,
+ * then the playback control with the capture where it was, measuring the
+ * 1004 Hz loopback at each step
+ */
+static int mix_run(void)
+{
+	struct mix_rec rec;
+	float ref = 0.0;
+	int s, save = capset;
+
+	if ((capmax <= 0) || (spkrmax <= 0)) {
+		printf("No capture and playback volume controls to characterize\n");
+		return (1);
+	}
+	if ((capmax >= MIX_MAX_STEPS) || (spkrmax >= MIX_MAX_STEPS)) {
+		printf("Mixer ranges of %d and %d steps are more than %d\n", capmax, spkrmax, MIX_MAX_STEPS - 1);
+		return (1);
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.key = mixcal.key;
+	rec.when = time(NULL);
+	rec.productid = devproductid;
+	rec.bcddevice = devbcd;
+	rec.capmax = capmax;
+	rec.spkrmax = spkrmax;
+	rec.capref = save;
+	printf("Characterizing %d capture and %d playback steps, this takes about %d seconds...\n", capmax + 1,
+		   spkrmax + 1, (capmax + spkrmax + 2) * (MIX_PROBE_BLOCKS + 2) * AUDIO_SAMPLES_PER_BLOCK / 48000 + 1);
+	playback_set(spkrmax);
+	for (s = 0; s <= capmax; s++) {
+		capture_set(s);
+		if (level_measure(CAL_REF_FREQ, 0.0, MIX_PROBE_BLOCKS)) {
+			break;
+		}
+		rec.capdb[s] = mix_db(lwin.s1.mean / PASSBAND_LEVEL);
+	}
+	capture_set(save);
+	if (s <= capmax) {
+		myfreq1 = 0.0;
+		printf("No audio analyzed!!\n");
+		return (1);
+	}
+	for (s = spkrmax; s >= 0; s--) {
+		playback_set(s);
+		if (level_measure(CAL_REF_FREQ, 0.0, MIX_PROBE_BLOCKS)) {
+			break;
+		}
+		if (s == spkrmax) {
+			ref = lwin.s1.mean;
+		}
+		rec.spkrdb[s] = mix_db((ref > 0.0) ? lwin.s1.mean / ref : 0.0);
+	}
+	playback_set(spkrmax);
+	myfreq1 = 0.0;
+	if (s >= 0) {
+		printf("No audio analyzed!!\n");
+		return (1);
+	}
+	mix_print(&rec);
+	if (cal_store(&mixcal, &rec)) {
+		return (1);
+	}
+	printf("Mixer table saved to %s\n", mixcal.path);
+	return (0);
+}
+
+/* Characterize the mixer of this chip, or show the cached table */
+static int mix_test(int force)
+{
+	struct mix_rec *rec = mix_lookup();
+
+	if (rec && !force) {
+		mix_print(rec);
+		return (0);
+	}
+	if (mixcal.rec && !rec) {
+		printf("Cached mixer table is for other control ranges, characterizing again\n");
+	}
+	return (mix_run());
+}
+
+/*!
+ * \brief USB topology of the URI
+ *	Built from sysfs: the URI itself, the hubs between it and the root
+ *	hub, and every other device on the same bus with the isochronous
+ *	bandwidth its active interfaces reserve.  The URI is a full speed
+ *	device, so behind a high speed hub it shares that hub's transaction
+ *	translator (all ports for a single TT hub) with other full and low
+ *	speed devices; that shared 12 Mbit/s segment is what runs out first.
+ */
+struct usb_node {
+	char name[32];				/* sysfs name, e.g. 1-1.4.2 or usb1 */
+	char product[64];
+	int vid, pid;
+	float speed;				/* Mbit/s */
+	int hub;
+	int ttproto;				/* hub bDeviceProtocol, 1 single TT, 2 multi TT */
+	char control[16];			/* autosuspend "auto" or "on" */
+	char runtime[16];			/* runtime PM status */
+	int delay;					/* autosuspend delay, ms */
+	int isoeps;					/* isochronous endpoints in the active settings */
+	int isobytes;				/* their bandwidth, bytes per ms */
+};
+
+struct usb_topo {
+	struct usb_node uri;
+	struct usb_node chain[TOPO_MAX_CHAIN];	/* parent first, root hub last */
+	int nchain;
+	struct usb_node devs[TOPO_MAX_DEVS];	/* rest of the bus, other hubs included */
+	int ndevs;
+	char segment[32];			/* where the URI's full speed segment starts */
+	int segbytes, segothers;	/* isochronous load and other busy devices on it */
+	int busbytes, busothers;	/* the same for the whole bus */
+};
+
+/* Read the first line of a sysfs attribute */
+static int sysfs_str(char *dir, char *attr, char *buf, int len)
+{
+	char path[512];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fp = fopen(path, "r");
+	if (!fp) {
+		return (-1);
+	}
+	if (!fgets(buf, len, fp)) {
+		fclose(fp);
+		return (-1);
+	}
+	fclose(fp);
+	buf[strcspn(buf, "\n")] = 0;
+	return (0);
+}
+
+static int sysfs_int(char *dir, char *attr, int base, int def)
+{
+	char buf[32];
+
+	if (sysfs_str(dir, attr, buf, sizeof(buf))) {
+		return (def);
+	}
+	return (strtol(buf, NULL, base));
+}
+
+/* Sum the isochronous endpoints of the active interface settings */
+static void usb_node_iso(struct usb_node *nd, char *dir)
+{
+	char idir[512], edir[768], str[32];
+	struct dirent *de, *ee;
+	DIR *d, *e;
+	int len, w, bytes;
+	float interval;
+
+	nd->isoeps = nd->isobytes = 0;
+	d = opendir(dir);
+	if (!d) {
+		return;
+	}
+	len = strlen(nd->name);
+	while ((de = readdir(d))) {
+		/* interfaces are named <device>:<config>.<interface> */
+		if (strncmp(de->d_name, nd->name, len) || (de->d_name[len] != ':')) {
+			continue;
+		}
+		snprintf(idir, sizeof(idir), "%s/%s", dir, de->d_name);
+		e = opendir(idir);
+		if (!e) {
+			continue;
+		}
+		while ((ee = readdir(e))) {
+			if (strncmp(ee->d_name, "ep_", 3)) {
+				continue;
+			}
+			snprintf(edir, sizeof(edir), "%s/%s", idir, ee->d_name);
+			if (sysfs_str(edir, "type", str, sizeof(str)) || strcmp(str, "Isoc")) {
+				continue;
+			}
+			w = sysfs_int(edir, "wMaxPacketSize", 16, 0);
+			/* high speed high bandwidth endpoints add transactions per microframe */
+			bytes = (w & 0x7ff) * (1 + ((w >> 11) & 3));
+			if (sysfs_str(edir, "interval", str, sizeof(str))) {
+				continue;
+			}
+			interval = atof(str);
+			if (strstr(str, "us")) {
+				interval /= 1000.0;
+			}
+			if (interval <= 0.0) {
+				interval = 1.0;
+			}
+			nd->isoeps++;
+			nd->isobytes += bytes / interval;
+		}
+		closedir(e);
+	}
+	closedir(d);
+}
+
+/* Fill a node from /sys/bus/usb/devices/<name> */
+static int usb_node_read(char *name, struct usb_node *nd)
+{
+	char dir[256];
+
+	memset(nd, 0, sizeof(*nd));
+	snprintf(nd->name, sizeof(nd->name), "%s", name);
+	snprintf(dir, sizeof(dir), "%s/%s", USB_SYSFS, name);
+	nd->vid = sysfs_int(dir, "idVendor", 16, -1);
+	if (nd->vid < 0) {
+		return (-1);
+	}
+	nd->pid = sysfs_int(dir, "idProduct", 16, 0);
+	if (sysfs_str(dir, "product", nd->product, sizeof(nd->product))) {
+		strcpy(nd->product, "?");
+	}
+	if (sysfs_str(dir, "speed", nd->control, sizeof(nd->control)) == 0) {
+		nd->speed = atof(nd->control);
+	}
+	nd->hub = (sysfs_int(dir, "bDeviceClass", 16, 0) == 9);
+	nd->ttproto = (nd->hub) ? sysfs_int(dir, "bDeviceProtocol", 16, 0) : 0;
+	if (sysfs_str(dir, "power/control", nd->control, sizeof(nd->control))) {
+		strcpy(nd->control, "?");
+	}
+	if (sysfs_str(dir, "power/runtime_status", nd->runtime, sizeof(nd->runtime))) {
+		strcpy(nd->runtime, "?");
+	}
+	nd->delay = sysfs_int(dir, "power/autosuspend_delay_ms", 10, -1);
+	usb_node_iso(nd, dir);
+	return (0);
+}
+
+/* Find the sysfs name of the device at bus/device path "001/005" */
+static int usb_sysfs_find(char *path, char *name, int len)
+{
+	char dir[512];
+	struct dirent *de;
+	DIR *d;
+	int bus, dev;
+
+	if (sscanf(path, "%d/%d", &bus, &dev) != 2) {
+		return (-1);
+	}
+	d = opendir(USB_SYSFS);
+	if (!d) {
+		return (-1);
+	}
+	while ((de = readdir(d))) {
+		if ((de->d_name[0] == '.') || strchr(de->d_name, ':')) {
+			continue;
+		}
+		snprintf(dir, sizeof(dir), "%s/%s", USB_SYSFS, de->d_name);
+		if ((sysfs_int(dir, "busnum", 10, -1) == bus) && (sysfs_int(dir, "devnum", 10, -1) == dev) &&
+			(strlen(de->d_name) < len)) {
+			strcpy(name, de->d_name);
+			closedir(d);
+			return (0);
+		}
+	}
+	closedir(d);
+	return (-1);
+}
+
+/* Upstream device of a sysfs name: 1-1.4.2 -> 1-1.4 -> 1-1 -> usb1 */
+static int usb_parent(char *name, char *parent, int len)
+{
+	char *dash, *dot;
+
+	dash = strchr(name, '-');
+	if (!dash) {
+		return (-1);				/* a root hub */
+	}
+	dot = strrchr(name, '.');
+	if (dot && (dot > dash)) {
+		snprintf(parent, len, "%.*s", (int) (dot - name), name);
+	} else {
+		snprintf(parent, len, "usb%.*s", (int) (dash - name), name);
+	}
+	return (0);
+}
+
+/* Is name at or below the device anc */
+static int usb_below(char *name, char *anc)
+{
+	int len;
+
+	if (!strncmp(anc, "usb", 3)) {
+		len = strlen(anc + 3);
+		return (!strncmp(name, anc + 3, len) && (name[len] == '-'));
+	}
+	len = strlen(anc);
+	return (!strncmp(name, anc, len) && ((name[len] == 0) || (name[len] == '.')));
+}
+
+/* Read the topology around the URI, returns -1 if it is not in sysfs */
+static int usb_topo_scan(struct usb_topo *tp)
+{
+	char name[32], parent[32], *bus;
+	struct dirent *de;
+	struct usb_node *nd;
+	DIR *d;
+	int i;
+
+	memset(tp, 0, sizeof(*tp));
+	if (usb_sysfs_find(devpath, name, sizeof(name)) || usb_node_read(name, &tp->uri)) {
+		return (-1);
+	}
+	while ((tp->nchain < TOPO_MAX_CHAIN) && !usb_parent(name, parent, sizeof(parent))) {
+		if (usb_node_read(parent, &tp->chain[tp->nchain])) {
+			break;
+		}
+		tp->nchain++;
+		strcpy(name, parent);
+	}
+	if (!tp->nchain) {
+		return (-1);				/* not even the root hub could be read */
+	}
+	d = opendir(USB_SYSFS);
+	if (!d) {
+		return (-1);
+	}
+	bus = tp->chain[tp->nchain - 1].name;
+	while ((de = readdir(d)) && (tp->ndevs < TOPO_MAX_DEVS)) {
+		if ((de->d_name[0] == '.') || strchr(de->d_name, ':') || !strncmp(de->d_name, "usb", 3) ||
+			usb_below(tp->uri.name, de->d_name) || !usb_below(de->d_name, bus)) {
+			continue;
+		}
+		if (!usb_node_read(de->d_name, &tp->devs[tp->ndevs])) {
+			tp->ndevs++;
+		}
+	}
+	closedir(d);
+
+	/*
+	 * The full speed segment: the whole bus on a full speed root hub,
+	 * otherwise the first high speed hub up the chain holds the TT.  An
+	 * xHCI root hub or a multi TT hub gives each port its own.
+	 */
+	strcpy(tp->segment, tp->uri.name);
+	if (tp->uri.speed <= 12.0) {
+		strcpy(name, tp->uri.name);
+		for (i = 0; i < tp->nchain; i++) {
+			nd = &tp->chain[i];
+			if (nd->speed <= 12.0) {
+				strcpy(tp->segment, nd->name);
+			} else {
+				if ((nd->ttproto == 1) && strncmp(nd->name, "usb", 3)) {
+					strcpy(tp->segment, nd->name);
+				} else {
+					strcpy(tp->segment, name);
+				}
+				break;
+			}
+			strcpy(name, nd->name);
+		}
+	}
+	tp->segbytes = tp->busbytes = tp->uri.isobytes;
+	for (i = 0; i < tp->ndevs; i++) {
+		nd = &tp->devs[i];
+		if (!nd->isoeps) {
+			continue;
+		}
+		tp->busbytes += nd->isobytes;
+		tp->busothers++;
+		if ((nd->speed <= 12.0) && usb_below(nd->name, tp->segment)) {
+			tp->segbytes += nd->isobytes;
+			tp->segothers++;
+		}
+	}
+	return (0);
+}
+
+static char *usb_speed_str(float speed)
+{
+	if (speed >= 5000.0) {
+		return ("super speed");
+	}
+	if (speed >= 480.0) {
+		return ("high speed");
+	}
+	if (speed >= 12.0) {
+		return ("full speed");
+	}
+	return ("low speed");
+}
+
+static void usb_node_print(struct usb_node *nd, char *indent)
+{
+	printf("%s%-12s %04x:%04x %-28.28s %5g Mbit/s", indent, nd->name, nd->vid, nd->pid, nd->product, nd->speed);
+	if (nd->hub && (nd->ttproto == 1)) {
+		printf(", single TT");
+	} else if (nd->hub && (nd->ttproto == 2)) {
+		printf(", multi TT");
+	}
+	printf(", autosuspend %s (%s)", nd->control, nd->runtime);
+	if (nd->isoeps) {
+		printf(", %d isoc endpoint(s) %d bytes/ms", nd->isoeps, nd->isobytes);
+	}
+	printf("\n");
+}
+
+/* Print the topology with whatever in it looks like trouble, returns the warning count */
+static int usb_topo_print(struct usb_topo *tp)
+{
+	struct usb_node *root = &tp->chain[tp->nchain - 1];
+	int i, warn = 0, budget;
+
+	printf("URI at %s is %s in sysfs, %s (%g Mbit/s)\n", devpath, tp->uri.name,
+		   usb_speed_str(tp->uri.speed), tp->uri.speed);
+	printf("Autosuspend %s, delay %d ms, now %s\n", tp->uri.control, tp->uri.delay, tp->uri.runtime);
+	printf("Hub chain (%d hub(s) below the root hub):\n", tp->nchain - 1);
+	for (i = tp->nchain - 1; i >= 0; i--) {
+		usb_node_print(&tp->chain[i], "  ");
+	}
+	printf("Other devices on %s:\n", root->name);
+	for (i = 0; i < tp->ndevs; i++) {
+		usb_node_print(&tp->devs[i], (usb_below(tp->devs[i].name, tp->segment) &&
+									  (tp->devs[i].speed <= 12.0)) ? "* " : "  ");
+	}
+	if (!tp->ndevs) {
+		printf("  none\n");
+	}
+	printf("(* shares the URI's full speed segment at %s)\n", tp->segment);
+	printf("Isochronous load: %d bytes/ms on the segment (budget %d), %d bytes/ms on the bus",
+		   tp->segbytes, TOPO_FS_PERIODIC, tp->busbytes);
+	budget = (root->speed >= 480.0) ? TOPO_HS_PERIODIC : TOPO_FS_PERIODIC;
+	printf(" (budget %d)\n", budget);
+	if (!tp->uri.isoeps) {
+		printf("Note: the URI shows no active isochronous endpoints, audio may not be streaming\n");
+	}
+
+	if (tp->uri.speed > 12.0) {
+		printf("Warning: the URI reports %g Mbit/s, expected a full speed device\n", tp->uri.speed);
+		warn++;
+	}
+	if (tp->nchain - 1 > TOPO_DEEP_CHAIN) {
+		printf("Warning: %d hubs deep, every hub adds latency and another failure point\n", tp->nchain - 1);
+		warn++;
+	}
+	if (!strcmp(tp->uri.control, "auto")) {
+		printf("Warning: autosuspend is enabled for the URI, echo on > %s/%s/power/control\n",
+			   USB_SYSFS, tp->uri.name);
+		warn++;
+	}
+	for (i = 0; i < tp->nchain - 1; i++) {
+		if (!strcmp(tp->chain[i].control, "auto") && strcmp(tp->chain[i].runtime, "active")) {
+			printf("Warning: hub %s is allowed to suspend and is %s\n", tp->chain[i].name, tp->chain[i].runtime);
+			warn++;
+		}
+	}
+	if (tp->segothers) {
+		printf("Warning: %d other streaming device(s) share the URI's full speed segment\n", tp->segothers);
+		warn++;
+	}
+	if (tp->segbytes > TOPO_FS_PERIODIC * 3 / 4) {
+		printf("Warning: the full speed segment is %d%% booked by isochronous traffic\n",
+			   tp->segbytes * 100 / TOPO_FS_PERIODIC);
+		warn++;
+	}
+	if (tp->busbytes > budget * 3 / 4) {
+		printf("Warning: the bus is %d%% booked by isochronous traffic\n", tp->busbytes * 100 / budget);
+		warn++;
+	}
+	return (warn);
+}
+
+/*!
+ * \brief USB topology and bus contention test
+ *	Prints the topology, then plays tones for a while and each second
+ *	rescans the bus, so the xruns and glitches of every second can be
+ *	split between seconds with other isochronous traffic on the URI's own
+ *	full speed segment, seconds with it only elsewhere on the bus and
+ *	seconds without.  Start and stop other audio or video devices during
+ *	the run to see whether they are what hurts the URI.
+ */
+static int usb_topo_test(void)
+{
+	struct usb_topo tp;
+	char str[200];
+	unsigned long over, under, glitches, dx, dg;
+	unsigned long secs[3] = {0, 0, 0}, xr[3] = {0, 0, 0}, gl[3] = {0, 0, 0};
+	unsigned long long start;
+	int warn, mask, busy, lastbusy = -1, n, elapsed = 0;
+
+	if (!devpath[0] || usb_topo_scan(&tp)) {
+		printf("Unable to find the URI in %s\n", USB_SYSFS);
+		return (1);
+	}
+	warn = usb_topo_print(&tp);
+	prompt_str("\nStress run duration in seconds (0 to skip) [60]: ", str, sizeof(str));
+	n = (str[0]) ? atoi(str) : TOPO_STRESS_SECS;
+	if (n <= 0) {
+		return (warn);
+	}
+
+	myfreq1 = 1004.0;
+	myfreq2 = 700.0;
+	ev_wait_blocks(&evl, SOAK_SETTLE_BLOCKS, 2000);
+	glitch_clear(&glitch);
+	over = xrun.overruns;
+	under = xrun.underruns;
+	glitches = glitch.count;
+	start = now_us();
+	printf("Running for %d s, press any key to stop...\r\n", n);
+	kbd_nowait();
+	ev_key(&evl);
+	ev_timer(&evl, 1000, 1);
+	while (elapsed < n) {
+		mask = ev_wait(&evl, -1);
+		if (mask & EV_KEY) {
+			ev_key(&evl);
+			break;
+		}
+		if (!(mask & EV_TIMER)) {
+			continue;
+		}
+		elapsed++;
+		if (usb_topo_scan(&tp)) {
+			printf("The URI disappeared from %s\r\n", USB_SYSFS);
+			warn++;
+			break;
+		}
+		dx = (xrun.overruns - over) + (xrun.underruns - under);
+		dg = glitch.count - glitches;
+		over = xrun.overruns;
+		under = xrun.underruns;
+		glitches = glitch.count;
+		/* 0 quiet, 1 traffic elsewhere on the bus, 2 on the URI's own segment */
+		busy = (tp.segothers) ? 2 : (tp.busothers > 0);
+		secs[busy]++;
+		xr[busy] += dx;
+		gl[busy] += dg;
+		if (dx || dg || (busy != lastbusy)) {
+			printf("%5d s: %lu xrun(s), %lu glitch(es), %d other streaming device(s) on the segment, %d on the bus, "
+				   "%d bytes/ms on the segment\r\n", elapsed, dx, dg, tp.segothers, tp.busothers, tp.segbytes);
+		}
+		lastbusy = busy;
+	}
+	ev_timer(&evl, 0, 0);
+	kbd_wait();
+	myfreq1 = 0.0;
+	myfreq2 = 0.0;
+
+	printf("\n%-28s %8s %8s %10s %10s\n", "", "seconds", "xruns", "glitches", "per minute");
+	printf("%-28s %8lu %8lu %10lu %10.2f\n", "Bus otherwise quiet", secs[0], xr[0], gl[0],
+		   (secs[0]) ? (xr[0] + gl[0]) * 60.0 / secs[0] : 0.0);
+	printf("%-28s %8lu %8lu %10lu %10.2f\n", "Traffic elsewhere on the bus", secs[1], xr[1], gl[1],
+		   (secs[1]) ? (xr[1] + gl[1]) * 60.0 / secs[1] : 0.0);
+	printf("%-28s %8lu %8lu %10lu %10.2f\n", "Traffic on the URI segment", secs[2], xr[2], gl[2],
+		   (secs[2]) ? (xr[2] + gl[2]) * 60.0 / secs[2] : 0.0);
+	printf("%lu overrun(s), %lu underrun(s) since the program started\n", xrun.overruns, xrun.underruns);
+	if (secs[0] && secs[2] && ((xr[2] + gl[2]) * secs[0] > 2 * (xr[0] + gl[0]) * secs[2]) && (xr[2] + gl[2] > 1)) {
+		printf("Problems are more frequent while devices on the same segment stream, move the URI to its own root port\n");
+	}
+	if (secs[0] && secs[1] && ((xr[1] + gl[1]) * secs[0] > 2 * (xr[0] + gl[0]) * secs[1]) && (xr[1] + gl[1] > 1)) {
+		printf("Problems are more frequent while other devices on the bus stream, try another host controller\n");
+	}
+	glitch_print(&glitch, start);
+	return (warn + xr[0] + xr[1] + xr[2] + gl[0] + gl[1] + gl[2]);
+}
+
+/*!
+ * \brief Multiple URI streaming benchmark
+ *	Opens every attached URI and runs a loopback tone with the block
+ *	analysis on each of them at once, one thread per device, to find how
+ *	many streams a host and its USB controllers really sustain.  Every
+ *	BENCH_MARK_BLOCKS one playback block is muted; finding that gap in
+ *	the capture gives the round trip latency in frames, and a gap that
+ *	matches no marker is a dropout.  The other URIs may belong to a live
+ *	node, so their mixer settings are saved and put back afterwards.
+ */
+struct bench_dev {
+	int card, type, primary;
+	char path[32];
+	int rfd, wfd;
+	pthread_t thread;
+	int running;
+	int leftout;				/* could not be opened or started */
+	struct mixer_saved mixer;	/* the card's own settings, put back afterwards */
+	pthread_mutex_t lock;
+	struct tonevars tv;
+	short pbuf[AUDIO_SAMPLES_PER_BLOCK * 2];	/* playback block being written */
+	int pdone;					/* bytes of it written */
+	short cbuf[AUDIO_SAMPLES_PER_BLOCK];	/* capture block being read */
+	int cfill;					/* bytes of it read */
+	long long playframes, capframes;
+	long long marks[BENCH_MARKS];	/* playback frame of each muted block */
+	int mhead, mtail;
+	float dc, peak;				/* capture offset and tone peak, counts */
+	int quiet, ingap, gapblock;
+	double afft[(NFFT + 1) * 2 + 1], wfft[NFFT * 5 / 2];
+	int ipfft[NFFTSQRT + 2];
+	struct xrun_state xr;
+	unsigned long blocks, dropouts, missed;
+	struct runstat latency;		/* ms */
+	struct runstat level;
+	struct runstat proc;		/* block analysis time, us */
+	double cpu;					/* thread CPU time, s */
+};
+
+struct bench_state {
+	struct bench_dev dev[BENCH_MAX_DEVS];
+	int ndevs;
+	int stopfd;
+	volatile int stop;
+};
+
+struct bench_state bench;
+
+/* Find every URI that has a sound card */
+static int bench_enum(struct bench_state *b)
+{
+	struct usb_bus *usb_bus;
+	struct usb_device *dev;
+	struct bench_dev *bd;
+	char devstr[10000];
+	int card;
+
+	b->ndevs = 0;
+	usb_find_busses();
+	usb_find_devices();
+	for (usb_bus = usb_busses; usb_bus; usb_bus = usb_bus->next) {
+		for (dev = usb_bus->devices; dev && (b->ndevs < BENCH_MAX_DEVS); dev = dev->next) {
+			if (!uri_match(dev)) {
+				continue;
+			}
+			sprintf(devstr, "%s/%s", usb_bus->dirname, dev->filename);
+			card = uri_card(devstr);
+			if (card < 0) {
+				continue;
+			}
+			bd = &b->dev[b->ndevs++];
+			memset(bd, 0, sizeof(*bd));
+			bd->card = card;
+			bd->type = uri_type(dev);
+			bd->primary = (card == devnum);
+			bd->rfd = bd->wfd = -1;
+			bd->pdone = AUDIO_BLOCKSIZE;
+			sprintf(bd->path, "%03d/%03d", atoi(usb_bus->dirname) & 0xfff, atoi(dev->filename) & 0xfff);
+		}
+	}
+	return (b->ndevs);
+}
+
+/* Write playback, a new block (muted for the markers) once the last one is all written */
+static int bench_play(struct bench_dev *bd, float ddr, float ddi)
+{
+	int i, mark, res;
+
+	if (bd->pdone >= AUDIO_BLOCKSIZE) {
+		mark = ((bd->playframes / AUDIO_SAMPLES_PER_BLOCK) % BENCH_MARK_BLOCKS == BENCH_MARK_BLOCKS - 1);
+		for (i = 0; i < AUDIO_SAMPLES_PER_BLOCK * 2; i += 2) {
+			bd->pbuf[i] = (mark) ? 0 : get_tonesample(&bd->tv, ddr, ddi) * 32765;
+			bd->pbuf[i + 1] = 0;
+		}
+		if (mark && (bd->mhead - bd->mtail < BENCH_MARKS)) {
+			bd->marks[bd->mhead++ % BENCH_MARKS] = bd->playframes;
+		}
+		bd->playframes += AUDIO_SAMPLES_PER_BLOCK;
+		bd->pdone = 0;
+	}
+	res = write(bd->wfd, (char *) bd->pbuf + bd->pdone, AUDIO_BLOCKSIZE - bd->pdone);
+	if (res < 0) {
+		return ((errno == EAGAIN) ? 0 : -1);
+	}
+	bd->pdone += res;
+	return (0);
+}
+
+/* A gap started at capture frame c, match it to a marker */
+static void bench_gap(struct bench_dev *bd, long long c)
+{
+	long long d;
+	float ms;
+
+	while (bd->mtail != bd->mhead) {
+		d = c - bd->marks[bd->mtail % BENCH_MARKS];
+		if (d < 0) {
+			break;				/* before the next marker is due */
+		}
+		ms = d / 48.0;
+		if ((d > BENCH_MAX_LATENCY) || (bd->latency.n && (ms > bd->latency.mean + BENCH_LATENCY_TOL))) {
+			bd->missed++;		/* that marker never came back */
+			bd->mtail++;
+			continue;
+		}
+		if (bd->latency.n && (ms < bd->latency.mean - BENCH_LATENCY_TOL)) {
+			break;				/* too early for this marker */
+		}
+		runstat_add(&bd->latency, ms);
+		bd->mtail++;
+		return;
+	}
+	bd->dropouts++;
+}
+
+/* Scan the capture for gaps */
+static void bench_capture(struct bench_dev *bd, short *sbuf, int n)
+{
+	float a;
+	int i;
+
+	for (i = 0; i < n; i++, bd->capframes++) {
+		bd->dc += (sbuf[i] - bd->dc) * 0.001;
+		a = fabs(sbuf[i] - bd->dc);
+		if (a > bd->peak) {
+			bd->peak = a;
+		} else {
+			bd->peak *= 0.99995;
+		}
+		if (bd->peak < BENCH_MIN_PEAK) {
+			bd->quiet = bd->ingap = 0;
+			continue;
+		}
+		if (bd->ingap) {
+			if (a > 0.5 * bd->peak) {
+				bd->ingap = bd->quiet = 0;
+			}
+		} else if (a < BENCH_GAP_LEVEL * bd->peak) {
+			if (++bd->quiet == BENCH_GAP_RUN) {
+				bench_gap(bd, bd->capframes - BENCH_GAP_RUN + 1);
+				bd->ingap = bd->gapblock = 1;
+			}
+		} else {
+			bd->quiet = 0;
+		}
+	}
+}
+
+/* Tone level of one block, the same analysis the sound thread does */
+static float bench_level(struct bench_dev *bd, short *sbuf)
+{
+	float ftmp, sum = 0.0;
+	int i;
+
+	memset(bd->afft, 0, sizeof(double) * 2 * (NFFT + 1));
+	for (i = 0; i < NFFT; i++) {
+		bd->afft[i * 2] = (double) (sbuf[i] + 32768) / (double) 65536.0;
+	}
+	cdft(NFFT * 2, -1, bd->afft, bd->ipfft, bd->wfft);
+	for (i = 1; i < NFFT / 2; i++) {
+		if (fabs(i * FFT_BIN_HZ - BENCH_FREQ) < 1.5 * FFT_BIN_HZ) {
+			ftmp = (bd->afft[i * 2] * bd->afft[i * 2]) + (bd->afft[i * 2 + 1] * bd->afft[i * 2 + 1]);
+			sum += ftmp;
+		}
+	}
+	return ((sqrt(sum) / (float) (NFFT / 2)) * 4096.0);
+}
+
+/* One device, until bench.stop */
+static void *bench_thread(void *this)
+{
+	struct bench_dev *bd = this;
+	struct epoll_event ev;
+	struct timespec t0, t1;
+	short *sbuf = bd->cbuf;
+	float ddr, ddi, l;
+	unsigned long long t;
+	int epfd, res;
+
+	ddr = cos(BENCH_FREQ * 2.0 * M_PI / 48000.0);
+	ddi = sin(BENCH_FREQ * 2.0 * M_PI / 48000.0);
+	bd->tv.mycr = 1.0;
+	bd->tv.myci = 0.0;
+	bd->ipfft[0] = 0;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = bd->rfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, bd->rfd, &ev);
+	ev.events = EPOLLOUT;
+	ev.data.fd = bd->wfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, bd->wfd, &ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = bench.stopfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, bench.stopfd, &ev);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+	while (!bench.stop) {
+		res = epoll_wait(epfd, &ev, 1, -1);
+		if (res <= 0) {
+			continue;
+		}
+		if (ev.data.fd == bench.stopfd) {
+			break;
+		}
+		if (ev.data.fd == bd->wfd) {
+			xrun_playback(&bd->xr, bd->wfd);
+			bench_play(bd, ddr, ddi);
+			continue;
+		}
+		if (ev.events & EPOLLIN) {
+			/* short reads are kept, the block is analyzed once it is whole */
+			res = read(bd->rfd, (char *) sbuf + bd->cfill, CAPTURE_BLOCKSIZE - bd->cfill);
+			if (res <= 0) {
+				continue;
+			}
+			bd->cfill += res;
+			if (bd->cfill < CAPTURE_BLOCKSIZE) {
+				continue;
+			}
+			bd->cfill = 0;
+			t = now_us();
+			xrun_capture(&bd->xr, bd->rfd);
+			pthread_mutex_lock(&bd->lock);
+			bd->gapblock = 0;
+			bench_capture(bd, sbuf, AUDIO_SAMPLES_PER_BLOCK);
+			l = bench_level(bd, sbuf);
+			if ((bd->peak >= BENCH_MIN_PEAK) && !bd->gapblock && !bd->ingap) {
+				runstat_add(&bd->level, l);
+			}
+			bd->blocks++;
+			runstat_add(&bd->proc, now_us() - t);
+			pthread_mutex_unlock(&bd->lock);
+		}
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	bd->cpu = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1000000000.0;
+	close(epfd);
+	return (NULL);
 }
 
-/* Sound card processing thread */
-void *soundthread(void *this)
+/* Have the sound thread close (hold != 0) or reopen the primary URI */
+static int bench_hold(int hold)
 {
-	int fd, micmax, spkrmax;
-	int adjust;
-	int micparam1 = 0;
-	char newname = 0;
-
-	fd = soundopen(devnum);
-	micmax = amixer_max(devnum, MIXER_PARAM_MIC_CAPTURE_VOL);
-	spkrmax = amixer_max(devnum, MIXER_PARAM_SPKR_PLAYBACK_VOL);
+	int i;
 
-	if (spkrmax == -1) {
-		newname = 1;
-		spkrmax = amixer_max(devnum, MIXER_PARAM_SPKR_PLAYBACK_VOL_NEW);
+	soundhold = hold;
+	ev_signal(evl.wakefd);
+	for (i = 0; i < 200; i++) {
+		if (soundheld == hold) {
+			return ((hold) ? 0 : -soundfail);
+		}
+		usleep(10000);
 	}
+	return (-1);
+}
 
-	setamixer(devnum, MIXER_PARAM_MIC_PLAYBACK_SW, 0, 0);
-	setamixer(devnum, MIXER_PARAM_MIC_PLAYBACK_VOL, 0, 0);
-	setamixer(devnum, (newname) ? MIXER_PARAM_SPKR_PLAYBACK_SW_NEW : MIXER_PARAM_SPKR_PLAYBACK_SW, 1, 0);
-	setamixer(devnum, (newname) ? MIXER_PARAM_SPKR_PLAYBACK_VOL_NEW : MIXER_PARAM_SPKR_PLAYBACK_VOL, spkrmax, spkrmax);
-	switch (devtype)
-	{
-		case DEV_C108:
-			adjust = C108_ADJUST;
-			break;
-		case DEV_C108AH:
-			adjust = C108AH_ADJUST;
-			break;
-		case DEV_C119:
-			adjust = C119_ADJUST;
-			break;
-		case DEV_C119A:
-			adjust = C119A_ADJUST;
-			break;
-		case DEV_C119B:
-			adjust = C119B_ADJUST;
-			micparam1 = 1;
-			break;
-		default:
-			adjust = DEFAULT_ADJUST;
+/* Run the benchmark on all attached URIs */
+static int bench_test(void)
+{
+	struct bench_dev *bd;
+	struct timespec p0, p1;
+	char str[200];
+	unsigned long long start;
+	unsigned long blocks = 0, drops = 0, missed = 0, over = 0, under = 0;
+	double secs, cpu = 0.0, pcpu;
+	int i, n, mask, nrun = 0, errs = 0;
+
+	if (!bench_enum(&bench)) {
+		printf("No URIs with sound cards found\n");
+		return (1);
+	}
+	printf("%d URI(s) found:\n", bench.ndevs);
+	for (i = 0; i < bench.ndevs; i++) {
+		bd = &bench.dev[i];
+		printf("  %s %s, sound card %d%s\n", bd->path, devtypestrs[bd->type], bd->card,
+			   (bd->primary) ? " (the one under test)" : "");
+	}
+	prompt_str("Benchmark duration in seconds [60]: ", str, sizeof(str));
+	n = (str[0]) ? atoi(str) : BENCH_SECS;
+	if (n <= 0) {
+		return (0);
 	}
-	setamixer(devnum, MIXER_PARAM_MIC_CAPTURE_VOL, AUDIO_IN_SETTING * micmax / adjust, 0);
-	setamixer(devnum, MIXER_PARAM_MIC_BOOST, micparam1, 0);
-	setamixer(devnum, MIXER_PARAM_MIC_CAPTURE_SW, 1, 0);
 
-	while (!shutdown) {
-		fd_set rfds, wfds;
-		int res;
-		char buf[AUDIO_BLOCKSIZE];
-		float mylev, mylev1, mylev2;
+	if (bench_hold(1)) {
+		printf("The sound thread did not release the device\n");
+		bench_hold(0);
+		return (1);
+	}
+	bench.stop = 0;
+	bench.stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &p0);
+	for (i = 0; i < bench.ndevs; i++) {
+		bd = &bench.dev[i];
+		if (soundopen_pair(bd->card, &bd->rfd, &bd->wfd)) {
+			printf("Unable to open %s, left out\n", bd->path);
+			bd->leftout = 1;
+			errs++;
+			continue;
+		}
+		if (!bd->primary) {
+			int micmax, smax;
+			char *sname;
 
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		FD_SET(fd, &rfds);
-		FD_SET(fd, &wfds);
-		res = select(fd + 1, &rfds, &wfds, NULL, NULL);
-		if (!res) {
+			/* another node's URI may be in use, its settings go back afterwards */
+			mixer_save(bd->card, &bd->mixer);
+			mixer_setup(bd->card, bd->type, &micmax, &smax, &sname);
+		}
+		pthread_mutex_init(&bd->lock, NULL);
+		runstat_init(&bd->latency);
+		runstat_init(&bd->level);
+		runstat_init(&bd->proc);
+		if (pthread_create(&bd->thread, NULL, bench_thread, bd)) {
+			close(bd->rfd);
+			close(bd->wfd);
+			bd->rfd = bd->wfd = -1;
+			if (!bd->primary) {
+				mixer_restore(bd->card, &bd->mixer);
+			}
+			bd->leftout = 1;
+			errs++;
 			continue;
 		}
-		if (res < 0) {
-			perror("poll");
-			exit(255);
+		bd->running = 1;
+		nrun++;
+	}
+	printf("Streaming on %d URI(s) for %d s, press any key to stop...\r\n", nrun, n);
+	start = now_us();
+	kbd_nowait();
+	ev_key(&evl);
+	ev_timer(&evl, 5000, 1);
+	for (;;) {
+		mask = ev_wait(&evl, -1);
+		if (mask & EV_KEY) {
+			ev_key(&evl);
+			break;
+		}
+		if (now_us() - start >= n * 1000000ULL) {
+			break;
 		}
-		if (FD_ISSET(fd, &wfds)) {
-			outaudio(fd, myfreq1, myfreq2);
+		if (!(mask & EV_TIMER)) {
 			continue;
 		}
-		if (FD_ISSET(fd, &rfds)) {
-			short *sbuf = (short *) buf;
-			static double afft[(NFFT + 1) * 2 + 1], wfft[NFFT * 5 / 2];
-			float buck;
-			float gfac;
-			static int ipfft[NFFTSQRT + 2], i;
-
-			res = read(fd, buf, AUDIO_BLOCKSIZE);
-			if (res < AUDIO_BLOCKSIZE) {
-				printf("Warining, short read!!\n");
+		printf("%5.0f s:", (now_us() - start) / 1000000.0);
+		for (i = 0; i < bench.ndevs; i++) {
+			bd = &bench.dev[i];
+			if (!bd->running) {
 				continue;
 			}
-			memset(afft, 0, sizeof(double) * 2 * (NFFT + 1));
-			gfac = 1.0;
-			if (devtype == DEV_C108AH || devtype == DEV_C119 ||
-				devtype == DEV_C119A || devtype == DEV_C119B) {
-				gfac = 0.7499;
+			pthread_mutex_lock(&bd->lock);
+			printf(" %s %lu/%lu", bd->path, bd->dropouts + bd->missed, bd->xr.overruns + bd->xr.underruns);
+			pthread_mutex_unlock(&bd->lock);
+		}
+		printf(" (dropouts/xruns)\r\n");
+	}
+	ev_timer(&evl, 0, 0);
+	kbd_wait();
+	bench.stop = 1;
+	ev_signal(bench.stopfd);
+	for (i = 0; i < bench.ndevs; i++) {
+		bd = &bench.dev[i];
+		if (bd->running) {
+			pthread_join(bd->thread, NULL);
+			close(bd->rfd);
+			close(bd->wfd);
+			bd->rfd = bd->wfd = -1;
+			bd->running = 0;
+			if (!bd->primary) {
+				mixer_restore(bd->card, &bd->mixer);
 			}
-			for (i = 0; i < res / 2; i++) {
-				sbuf[i] = (int) (((float) sbuf[i] + 32768) * gfac) - 32768;
+		}
+	}
+	secs = (now_us() - start) / 1000000.0;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &p1);
+	pcpu = (p1.tv_sec - p0.tv_sec) + (p1.tv_nsec - p0.tv_nsec) / 1000000000.0;
+	close(bench.stopfd);
+	if (bench_hold(0)) {
+		printf("Warning: the sound thread did not reopen the device\n");
+	}
+	ev_wait_blocks(&evl, 24, 2000);
 
-			}
-			for (i = 0; i < NFFT * 2; i += 2) {
-				afft[i] = (double) (sbuf[i] + 32768) / (double) 65536.0;
-			}
-			ipfft[0] = 0;
-			cdft(NFFT * 2, -1, afft, ipfft, wfft);
-			mylev = 0.0;
-			mylev1 = 0.0;
-			mylev2 = 0.0;
-			for (i = 1; i < NFFT / 2; i++) {
-				float ftmp;
+	printf("\n%-8s %-8s %7s %8s %7s %6s %6s %20s %8s %9s %6s\n", "URI", "Chip", "blocks", "dropouts", "missed",
+		   "overr", "underr", "latency ms (min/max)", "level", "block us", "CPU %");
+	for (i = 0; i < bench.ndevs; i++) {
+		bd = &bench.dev[i];
+		if (bd->leftout) {
+			printf("%-8s %-8s left out\n", bd->path, devtypestrs[bd->type]);	/* counted when it failed */
+			continue;
+		}
+		if (!bd->blocks) {
+			printf("%-8s %-8s no audio\n", bd->path, devtypestrs[bd->type]);
+			errs++;
+			continue;
+		}
+		printf("%-8s %-8s %7lu %8lu %7lu %6lu %6lu %6.1f (%5.1f/%5.1f) %8.1f %9.1f %6.2f\n", bd->path,
+			   devtypestrs[bd->type], bd->blocks, bd->dropouts, bd->missed, bd->xr.overruns, bd->xr.underruns,
+			   bd->latency.mean, (bd->latency.n) ? bd->latency.min : 0.0, (bd->latency.n) ? bd->latency.max : 0.0,
+			   bd->level.mean, bd->proc.mean, bd->cpu * 100.0 / secs);
+		if (!bd->latency.n) {
+			printf("         no latency markers came back, check the loopback\n");
+			errs++;
+		}
+		blocks += bd->blocks;
+		drops += bd->dropouts;
+		missed += bd->missed;
+		over += bd->xr.overruns;
+		under += bd->xr.underruns;
+		cpu += bd->cpu;
+	}
+	printf("%-17s %7lu %8lu %7lu %6lu %6lu %42.2f\n", "All streams", blocks, drops, missed, over, under,
+		   cpu * 100.0 / secs);
+	printf("Process CPU %.1f%% of one core over %.1f s, %.2f%% per stream\n", pcpu * 100.0 / secs, secs,
+		   (nrun) ? pcpu * 100.0 / secs / nrun : 0.0);
+	return (errs + drops + missed + over + under);
+}
+
+/* Print one line of period interval statistics */
+static void jitter_print(char *name, struct runstat *rs, float nominal)
+{
+	printf("%-18s: mean %7.3f ms, std %6.3f ms, min %7.3f ms, max %7.3f ms", name,
+		   rs->mean, runstat_std(rs), rs->min, rs->max);
+	if (nominal > 0.0) {
+		printf(" (nominal %.3f)", nominal);
+	}
+	printf("\n");
+}
 
-				ftmp = (afft[i * 2] * afft[i * 2]) + (afft[i * 2 + 1] * afft[i * 2 + 1]);
+/* Audio period timing / jitter analysis */
+static int jitter_test(void)
+{
+	char str[200];
+	float secs, nominal, ratio;
+	unsigned long long start, last;
+	int mask;
 
-				mylev += ftmp;
-				buck = (float) i * 46.875;
-				if (myfreq1 > 0.0) {
-					if (fabs(buck - myfreq1) < 1.5 * 46.875)
-						mylev1 += ftmp;
-				}
-				if (myfreq2 > 0.0) {
-					if (fabs(buck - myfreq2) < 1.5 * 46.875) {
-						mylev2 += ftmp;
-					}
-				}
-			}
-			lev = (sqrt(mylev) / (float) (NFFT / 2)) * 4096.0;
-			lev1 = (sqrt(mylev1) / (float) (NFFT / 2)) * 4096.0;
-			lev2 = (sqrt(mylev2) / (float) (NFFT / 2)) * 4096.0;
+	prompt_str("Analysis duration in seconds [10]: ", str, sizeof(str));
+	secs = (str[0]) ? atof(str) : 10.0;
+	nominal = AUDIO_SAMPLES_PER_BLOCK / 48.0;
+	myfreq1 = 1004.0;
+	myfreq2 = 700.0;
+	ev_wait_blocks(&evl, 48, 2000);
+	printf("Timing audio periods for %.0f seconds, press any key to stop...\r\n", secs);
+	jitter_start(&jit);
+	kbd_nowait();
+	ev_key(&evl);
+	ev_timer(&evl, 1000, 1);
+	start = now_us();
+	while ((now_us() - start) < secs * 1000000.0) {
+		mask = ev_wait(&evl, -1);
+		if (mask & EV_KEY) {
+			ev_key(&evl);
+			break;
+		}
+		if (!(mask & EV_TIMER)) {
+			continue;
 		}
+		last = now_us();
+		pthread_mutex_lock(&jit.lock);
+		printf("%5.0f s: capture period %.3f ms (max %.3f), playback delay %.2f ms (%.2f - %.2f)\r\n",
+			   (last - start) / 1000000.0, jit.seccap.mean, jit.seccap.max, jit.secdelay.mean,
+			   jit.secdelay.min, jit.secdelay.max);
+		runstat_init(&jit.seccap);
+		runstat_init(&jit.secdelay);
+		pthread_mutex_unlock(&jit.lock);
 	}
-	close(fd);
-	pthread_exit(NULL);
+	ev_timer(&evl, 0, 0);
+	kbd_wait();
+	pthread_mutex_lock(&jit.lock);
+	jit.active = 0;
+	myfreq1 = 0.0;
+	myfreq2 = 0.0;
+	printf("\n");
+	jitter_print("Capture period", &jit.capint, nominal);
+	jitter_print("Playback period", &jit.playint, nominal);
+	printf("%lu capture period(s) arrived more than 2x late\n", jit.late);
+	ratio = linfit_slope(&jit.rate) / 48000.0;
+	printf("Device rate       : %.2f Hz by the host clock (%+.0f ppm)\n", ratio * 48000.0, (ratio - 1.0) * 1e6);
+	jitter_print("Playback delay", &jit.odelay, 0.0);
+	printf("Delay drift       : %+.3f ms per minute\n", linfit_slope(&jit.delaydrift) * 60.0);
+	jitter_print("Capture backlog", &jit.ibacklog, 0.0);
+	pthread_mutex_unlock(&jit.lock);
+	return (0);
 }
 
-/* Digital I/O test */
-static int digital_test(struct usb_dev_handle *usb_handle)
+/* Write one resolution of the soak time series as CSV */
+static void soak_csv_series(FILE *fp, char *name, struct soak_series *s)
 {
-	int nerror = 0;
+	struct soak_bucket *b;
+	int i, j;
 
-	printf("Testing digital I/O (PTT,COR,TONE and GPIO)....\n");
-	nerror += testio(usb_handle, 8, 0);			/* NONE */
-	nerror += testio(usb_handle, 9, 2);			/* GPIO1 -> GPIO2 */
-	nerror += testio(usb_handle, 0xc, 0x10);	/* GPIO3/PTT -> CTCSS */
-	nerror += testio(usb_handle, 0, 0x20);		/* GPIO4 -> COR */
-	if (devtype == DEV_C119 || devtype == DEV_C119A || devtype == DEV_C119B) {
-		nerror += testio(usb_handle, 0x18, 0x40);	/* GPIO5 -> GPIO7 */
-		nerror += testio(usb_handle, 0x28, 0x80);	/* GPIO6 -> GPIO8 */
-	}
-	nerror += testio(usb_handle, 8, 0);	/* NONE */
-	if (!nerror) {
-		printf("Digital I/O passed!!\n");
-	} else {
-		printf("Digital I/O had %d errors!!\n", nerror);
+	for (i = 0; i < s->count; i++) {
+		b = soak_series_get(s, i);
+		fprintf(fp, "%s,%lu,%u", name, b->t, b->n);
+		for (j = 0; j < SOAK_NQ; j++) {
+			fprintf(fp, ",%.2f,%.2f,%.2f", b->q[j].min, b->q[j].max, soak_mean(b, j));
+		}
+		fprintf(fp, "\n");
 	}
-	return (nerror);
 }
 
-/* Test audio */
-static int analog_test_one(float freq1, float freq2, float dlev1, float dlev2, int v)
+/* Print the soak results */
+static int soak_report(struct soak_state *sk, char *csvname)
 {
-	int nerror = 0;
-	myfreq1 = freq1;
-	myfreq2 = freq2;
-	printf("Testing Analog at %1.f (and %1.f) Hz...\n", freq1, freq2);
-	usleep(1000000);
-	if (fabs(lev1 - dlev1) > (dlev1 * 0.2)) {
-		printf("Analog level on left channel for %.1f Hz (%.1f) is out of range!!\n",
-			   freq1, lev1);
-		printf("Must be between %.1f and %.1f\n", dlev1 * .8, dlev1 * 1.2);
-		nerror++;
-	} else if (v) {
-		printf("Left channel level %.1f OK at %.1f Hz\n", lev1, freq1);
+	struct soak_series *s;
+	struct soak_bucket *b;
+	FILE *fp;
+	int i, j, n;
+
+	pthread_mutex_lock(&sk->lock);
+	printf("\nSoak results, %lu frames analyzed\n", sk->blocks);
+	if (sk->havebase) {
+		printf("Baseline: ");
+		for (i = 0; i < SOAK_NQ; i++) {
+			printf("%s %.1f%s", soak_names[i], soak_mean(&sk->base, i), (i < SOAK_NQ - 1) ? ", " : "\n");
+		}
+	} else {
+		printf("Soak too short to establish a baseline\n");
 	}
-	if (fabs(lev2 - dlev2) > (dlev2 * 0.2)) {
-		printf("Analog level on right channel for %.1f Hz (%.1f) is out of range!!\n",
-			   freq2, lev2);
-		printf("Must be between %.1f and %.1f\n", dlev2 * .8, dlev2 * 1.2);
-		nerror++;
-	} else if (v) {
-		printf("Right channel level %.1f OK at %.1f Hz\n", lev2, freq2);
+	/* summarize on the coarsest resolution that has data */
+	s = &sk->hour;
+	if (!s->count) {
+		s = &sk->min;
 	}
-	return (nerror);
+	if (!s->count) {
+		s = &sk->sec;
+	}
+	printf("%-12s %-24s %-24s %-24s\n", "Time (s)", "Left min/max/mean", "Right min/max/mean",
+		   "Noise min/max/mean");
+	for (i = 0; i < s->count; i++) {
+		b = soak_series_get(s, i);
+		printf("%-12lu", b->t);
+		for (j = SOAK_LEV1; j <= SOAK_NOISE; j++) {
+			printf(" %7.1f/%7.1f/%7.1f", b->q[j].min, b->q[j].max, soak_mean(b, j));
+		}
+		printf("\n");
+	}
+	n = (sk->ndropouts < SOAK_MAX_EVENTS) ? sk->ndropouts : SOAK_MAX_EVENTS;
+	printf("%d dropout(s) below %.0f%% of baseline\n", sk->ndropouts, SOAK_DROPOUT_LEVEL * 100.0);
+	for (i = 0; i < n; i++) {
+		printf("  at %.3f s for %.3f s, %s %.1f\n", sk->dropouts[i].t / 1000000.0,
+			   sk->dropouts[i].len / 1000000.0, soak_names[sk->dropouts[i].q], sk->dropouts[i].val);
+	}
+	n = (sk->ndrifts < SOAK_MAX_EVENTS) ? sk->ndrifts : SOAK_MAX_EVENTS;
+	printf("%d drift event(s)\n", sk->ndrifts);
+	for (i = 0; i < n; i++) {
+		printf("  in minute starting at %llu s, %s %.1f (baseline %.1f)\n", sk->drifts[i].t / 1000000ULL,
+			   soak_names[sk->drifts[i].q], sk->drifts[i].val, soak_mean(&sk->base, sk->drifts[i].q));
+	}
+	printf("%lu audio glitch(es)\n", glitch.count);
+	glitch_print(&glitch, sk->start);
+	if (csvname && csvname[0]) {
+		fp = fopen(csvname, "w");
+		if (fp) {
+			fprintf(fp, "res,t,blocks");
+			for (j = 0; j < SOAK_NQ; j++) {
+				fprintf(fp, ",%s min,%s max,%s mean", soak_names[j], soak_names[j], soak_names[j]);
+			}
+			fprintf(fp, "\n");
+			soak_csv_series(fp, "1s", &sk->sec);
+			soak_csv_series(fp, "1m", &sk->min);
+			soak_csv_series(fp, "1h", &sk->hour);
+			fclose(fp);
+			printf("Time series written to %s\n", csvname);
+		} else {
+			printf("Unable to create %s\n", csvname);
+		}
+	}
+	n = sk->ndropouts + sk->ndrifts + glitch.count;
+	pthread_mutex_unlock(&sk->lock);
+	return (n);
 }
 
-/* Perform analog test */
-static int analog_test(int v)
+/* Long duration analog soak */
+static int soak_test(void)
 {
-	int nerror = 0;
+	char str[200], csvname[200];
+	float hours, f1, f2;
+	unsigned long long start, elapsed;
+	int mask;
 
-	printf("Passband level (200Hz - 3KHz) = %.0f +/- 20%%, Stopband level (> 4KHz) = %.0f +/- 20%%\n", PASSBAND_LEVEL, STOPBAND_LEVEL); 
-	nerror += analog_test_one(204.0, 700.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(504.0, 700.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(1004.0, 700.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(2004.0, 700.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(3004.0, 700.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(5004.0, 700.0, STOPBAND_LEVEL, PASSBAND_5KHZ_LEVEL, v); 	// this a fudge to make this work with CM119B chips and EEPROMs, not sure why
-	nerror += analog_test_one(700.0, 204.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(700.0, 504.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(700.0, 1004.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(700.0, 2004.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(700.0, 3004.0, PASSBAND_LEVEL, PASSBAND_LEVEL, v);
-	nerror += analog_test_one(700.0, 5004.0, PASSBAND_5KHZ_LEVEL, STOPBAND_LEVEL, v);
-	if (!nerror) {
-		printf("Analog Test Passed!!\n");
+	prompt_str("Soak duration in hours [1]: ", str, sizeof(str));
+	hours = (str[0]) ? atof(str) : 1.0;
+	prompt_str("Left channel frequency [1004]: ", str, sizeof(str));
+	f1 = (str[0]) ? atof(str) : 1004.0;
+	prompt_str("Right channel frequency [700]: ", str, sizeof(str));
+	f2 = (str[0]) ? atof(str) : 700.0;
+	prompt_str("CSV output file (Enter for none): ", csvname, sizeof(csvname));
+
+	myfreq1 = f1;
+	myfreq2 = f2;
+	glitch_clear(&glitch);
+	soak_start(&soak);
+	printf("Soaking at %.1f (and %.1f) Hz for %.2f hours, press any key to stop...\r\n", f1, f2, hours);
+	kbd_nowait();
+	ev_key(&evl);
+	ev_timer(&evl, 10000, 1);
+	start = now_us();
+	for (;;) {
+		mask = ev_wait(&evl, -1);
+		if (mask & EV_KEY) {
+			ev_key(&evl);
+			break;
+		}
+		elapsed = now_us() - start;
+		if (elapsed >= hours * 3600.0 * 1000000.0) {
+			break;
+		}
+		if (mask & EV_TIMER) {
+			pthread_mutex_lock(&soak.lock);
+			printf("%7.0f s: left %.1f, right %.1f, noise %.1f, %d dropout(s), %d drift(s), %lu glitch(es)\r\n",
+				   elapsed / 1000000.0, lev1, lev2, levnoise, soak.ndropouts, soak.ndrifts, glitch.count);
+			pthread_mutex_unlock(&soak.lock);
+		}
 	}
-	return (nerror);
+	ev_timer(&evl, 0, 0);
+	kbd_wait();
+	soak_stop(&soak);
+	myfreq1 = 0.0;
+	myfreq2 = 0.0;
+	return (soak_report(&soak, csvname));
 }
 /* Test the EEPROM by writing a short to our spare memory position */
 static int eeprom_test(struct usb_dev_handle *usb_handle)
@@ -1023,7 +7815,10 @@ static int eeprom_test(struct usb_dev_handle *usb_handle)
 	write_eeprom(usb_handle, EEPROM_START_ADDR + EEPROM_USER_SPARE, 0x6942);
 	
 	i = read_eeprom(usb_handle, EEPROM_START_ADDR + EEPROM_USER_SPARE);
-	if (i != 0x6942) {
+	if (hid.failed) {
+		printf("Error!! EEPROM test could not talk to the unit\n");
+		nerror++;
+	} else if (i != 0x6942) {
 		printf("Error!! EEPROM wrote 6942 hex, read %04x hex\n", i);
 		nerror++;
 	} else {
@@ -1041,6 +7836,9 @@ static int eeprom_list(struct usb_dev_handle *usb_handle)
 
 	i = get_eeprom(usb_handle, sbuf);
 
+	if (hid.failed) {
+		return (1);
+	}
 	if (i) {
 		printf("Failure!! EEPROM fail checksum or not present\n");
 		printf("Check Sum, %i, is invalid.\n", i);
@@ -1078,6 +7876,9 @@ static int eeprom_dump(struct usb_dev_handle *usb_handle)
 	int i;
 
 	get_eeprom_dump(usb_handle, sbuf);
+	if (hid.failed) {
+		return (1);
+	}
 
 	printf("EEPROM dump\n");
 
@@ -1096,6 +7897,9 @@ static int eeprom_list_manufacturer(struct usb_dev_handle *usb_handle)
 	char s[31];
 
 	get_eeprom_dump(usb_handle, sbuf);
+	if (hid.failed) {
+		return (1);
+	}
 
 	printf("Device id %04x\n", devproductid);
 	printf("EEPROM manufacturer data...\n");
@@ -1193,6 +7997,204 @@ static void eeprom_init(struct usb_dev_handle *usb_handle)
 	put_eeprom(usb_handle, sbuf);
 }
 
+/* Close out a transmission into rec (main thread, gate closed) */
+static void mon_finish(struct mon_state *ms, struct mon_rec *rec)
+{
+	struct mon_ctcss *ct = &ms->ct;
+	double total = 0.0;
+	int k, best = 0;
+
+	pthread_mutex_lock(&ms->lock);
+	rec->frames = ms->level.n;
+	rec->level = ms->level.mean;
+	rec->peak = (ms->level.n) ? ms->level.max : 0.0;
+	rec->noise = ms->noise.mean;
+	rec->tone = -1;
+	rec->tonefreq = rec->tonelevel = 0.0;
+	rec->tonewins = ct->windows;
+	for (k = 0; k < MON_NTONES; k++) {
+		total += ct->energy[k];
+		if (ct->energy[k] > ct->energy[best]) {
+			best = k;
+		}
+	}
+	if (ct->windows && (total > 0.0) && (ct->energy[best] >= MON_CTCSS_SHARE * total)) {
+		rec->tone = best;
+		rec->tonefreq = ctcss_tones[best];
+		if (ct->drift[best].n >= 2) {
+			/* radians per 1 second window */
+			rec->tonefreq += linfit_slope(&ct->drift[best]) / (2.0 * M_PI);
+		}
+		/* amplitude 2|z|/N, on the analyzer level scale */
+		rec->tonelevel = 2.0 * sqrt(ct->energy[best] / ct->windows) / MON_CTCSS_WIN / 16.0;
+	}
+	pthread_mutex_unlock(&ms->lock);
+}
+
+/* Print and log one transmission */
+static void mon_print(struct mon_rec *rec, FILE *fp)
+{
+	char when[32];
+	float snr = (rec->noise > 0.0) ? 20.0 * log10(rec->level / rec->noise) : 0.0;
+
+	strftime(when, sizeof(when), "%H:%M:%S", localtime(&rec->start));
+	printf("%s %6.1f s: level %.1f, peak %.1f, noise %.1f (%.1f dB)", when, rec->secs,
+		   rec->level, rec->peak, rec->noise, snr);
+	if (rec->tone >= 0) {
+		printf(", CTCSS %.1f Hz", ctcss_tones[rec->tone]);
+		if (rec->tonewins >= 2) {
+			printf(" %+.2f", rec->tonefreq - ctcss_tones[rec->tone]);
+		}
+		printf(" level %.1f", rec->tonelevel);
+	} else {
+		printf(", no CTCSS");
+	}
+	printf("%s\r\n", (rec->ctcssin) ? ", decoder input active" : "");
+	if (fp) {
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&rec->start));
+		fprintf(fp, "%s,%.1f,%.1f,%.1f,%.1f,%.1f,", when, rec->secs, rec->level, rec->peak,
+				rec->noise, snr);
+		if (rec->tone >= 0) {
+			fprintf(fp, "%.1f,%.2f,%.1f,", ctcss_tones[rec->tone], rec->tonefreq, rec->tonelevel);
+		} else {
+			fprintf(fp, ",,,");
+		}
+		fprintf(fp, "%d\n", rec->ctcssin);
+		fflush(fp);
+	}
+}
+
+/* Monitor the receive audio while COR is active */
+static int monitor_test(struct usb_dev_handle *usb_handle, int use_interrupt)
+{
+	static struct gpio_capture gc;
+	pthread_t gthread;
+	char str[200], logname[200];
+	FILE *fp = NULL;
+	struct gpio_event *ev;
+	struct mon_rec rec;
+	unsigned long long topen = 0, t;
+	unsigned int head;
+	double onair = 0.0;
+	int invert, active, isopen = 0, ctcssin = 0, n = 0, kerchunks = 0, joined = 0, asked = 0;
+
+	prompt_str("COR polarity, n(ormal) or i(nverted) [n]: ", str, sizeof(str));
+	invert = (tolower(str[0]) == 'i');
+	prompt_str("Log file (Enter for none): ", logname, sizeof(logname));
+	if (logname[0]) {
+		fp = fopen(logname, "a");
+		if (!fp) {
+			printf("Unable to open %s\n", logname);
+			return (1);
+		}
+		if (!ftell(fp)) {
+			fprintf(fp, "start,seconds,level,peak,noise,snr_db,ctcss_hz,ctcss_measured_hz,ctcss_level,ctcss_input\n");
+		}
+	}
+	memset(&gc, 0, sizeof(gc));
+	gc.usb_handle = usb_handle;
+	gc.use_interrupt = use_interrupt;
+	gc.period_us = (use_interrupt) ? 0 : MON_POLL_MS * 1000;
+	gc.start = now_us();
+	mon.open = 0;
+	mon.active = 1;
+	if (pthread_create(&gthread, NULL, gpio_sampler, &gc)) {
+		printf("Unable to start GPIO sampler\n");
+		mon.active = 0;
+		if (fp) {
+			fclose(fp);
+		}
+		return (1);
+	}
+	printf("Monitoring receive audio while COR is active (%s), press any key to stop...\r\n",
+		   (use_interrupt) ? "interrupt reports" : "polled");
+	kbd_nowait();
+	ev_key(&evl);
+	for (;;) {
+		head = __atomic_load_n(&gc.head, __ATOMIC_ACQUIRE);
+		while (gc.tail != head) {
+			ev = &gc.ev[gc.tail & (GPIO_RING_SIZE - 1)];
+			t = gc.start + ev->t;
+			active = ((ev->bits & 0x20) != 0) ^ invert;
+			if (active && !isopen) {
+				mon_gate(&mon, 1, t);
+				time(&rec.start);
+				topen = t;
+				ctcssin = 0;
+				isopen = 1;
+			} else if (!active && isopen) {
+				mon_gate(&mon, 0, t);
+				rec.secs = (t - topen) / 1000000.0;
+				rec.ctcssin = ctcssin;
+				if (rec.secs * 1000.0 < MON_MIN_MS) {
+					kerchunks++;
+				} else {
+					mon_finish(&mon, &rec);
+					mon_print(&rec, fp);
+					onair += rec.secs;
+					n++;
+				}
+				isopen = 0;
+			}
+			if (isopen && (ev->bits & 0x10)) {
+				ctcssin = 1;
+			}
+			__atomic_store_n(&gc.tail, gc.tail + 1, __ATOMIC_RELEASE);
+		}
+		if (joined) {
+			break;
+		}
+		if (gc.stop) {
+			/* asked to, or the sampler stopped itself, either way it is ending */
+			pthread_join(gthread, NULL);
+			joined = 1;
+			continue;			/* drain what is left */
+		}
+		/* the sampler signals every transition it pushes */
+		if (ev_wait(&evl, -1) & EV_KEY) {
+			ev_key(&evl);
+			gc.stop = 1;
+			asked = 1;
+		}
+	}
+	kbd_wait();
+	if (!asked) {
+		printf("Monitor stopped, the unit stopped answering!!\n");
+	}
+	if (isopen) {
+		/* still on the air, record what there is */
+		mon_gate(&mon, 0, now_us());
+		rec.secs = (now_us() - topen) / 1000000.0;
+		rec.ctcssin = ctcssin;
+		mon_finish(&mon, &rec);
+		mon_print(&rec, fp);
+		onair += rec.secs;
+		n++;
+	}
+	mon.active = 0;
+	if (fp) {
+		fclose(fp);
+	}
+	printf("%d transmission(s), %.1f s on the air, %d kerchunk(s) under %d ms\n", n, onair, kerchunks,
+		   MON_MIN_MS);
+	return (!asked);
+}
+
+/* Print the command line options */
+static void usage(char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("  -s <name>   publish capture blocks and spectra in POSIX shared memory <name>\n");
+	printf("  -C <file>   calibration cache (default $HOME/%s), mixer tables go in <file>%s\n", CAL_FILE,
+		   MIX_SUFFIX);
+	printf("  -H <frames> analysis hop, a power of 2 from %d to %d (default %d)\n", HOP_MIN,
+		   AUDIO_SAMPLES_PER_BLOCK, AUDIO_SAMPLES_PER_BLOCK);
+	printf("  -p <file>   test plan, replacing the built in steps and limits\n");
+	printf("  -r <file>   record the HID transfers and menu input to a trace\n");
+	printf("  -R <file>   replay a HID trace in place of the unit (HID only commands)\n");
+	printf("  -h          show this help\n");
+}
+
 /* Main program start */
 int main(int argc, char **argv)
 {
@@ -1201,9 +8203,49 @@ int main(int argc, char **argv)
 	int retval = 1;
 	char c;
 	pthread_t sthread;
-	pthread_attr_t attr;
-	struct termios t, t0;
+	int sthreaded = 0;
+	struct termios t0;
 	float myfreq;
+	char *tracename = NULL;
+	int opt, replay = 0;
+
+	/* no stdio buffer on stdin, typed ahead input is then still there when keys are watched */
+	setvbuf(stdin, NULL, _IONBF, 0);
+	if (getenv("HOME")) {
+		snprintf(cal.path, sizeof(cal.path), "%s/%s", getenv("HOME"), CAL_FILE);
+	} else {
+		snprintf(cal.path, sizeof(cal.path), "%s", CAL_FILE);
+	}
+	while ((opt = getopt(argc, argv, "s:C:H:p:r:R:h")) != -1) {
+		switch (opt) {
+		case 'r':
+		case 'R':
+			tracename = optarg;
+			replay = (opt == 'R');
+			break;
+		case 'p':
+			planname = optarg;
+			break;
+		case 's':
+			shmname = optarg;
+			break;
+		case 'C':
+			snprintf(cal.path, sizeof(cal.path), "%s", optarg);
+			break;
+		case 'H':
+			hop = atoi(optarg);
+			if ((hop < HOP_MIN) || (hop > AUDIO_SAMPLES_PER_BLOCK) || (hop & (hop - 1))) {
+				usage(argv[0]);
+				exit(255);
+			}
+			hopsperblock = AUDIO_SAMPLES_PER_BLOCK / hop;
+			break;
+		default:
+			usage(argv[0]);
+			exit(255);
+		}
+	}
+	snprintf(mixcal.path, sizeof(mixcal.path), "%.250s%s", cal.path, MIX_SUFFIX);
 
 	printf("\n\n"
                "URIDiag, diagnostic program for the DMK Engineering URIxB <www.dmkeng.com>\n" 
@@ -1217,11 +8259,22 @@ int main(int argc, char **argv)
 	       "License version 2 and other licenses; you are welcome to redistribute it under\n" 
 	       "certain conditions.  Type 'Z' for details. \n\n");
 
+	if (replay) {
+		usb_dev = NULL;
+		usb_handle = NULL;
+		if (hidtrace_replay(tracename) || plan_load(planname) || evloop_init(&evl)) {
+			exit(255);
+		}
+		goto menu;
+	}
 	usb_dev = device_init();
 	if (usb_dev == NULL) {
 		fprintf(stderr, "\nError: Device not found.\n");
 		exit(255);
 	}
+	if (plan_load(planname)) {
+		exit(255);
+	}
 	usb_handle = usb_open(usb_dev);
 	if (usb_handle == NULL) {
 		fprintf(stderr, "\nError: Not able to open USB device.\n");
@@ -1239,12 +8292,41 @@ int main(int argc, char **argv)
 	}
 
 	setout(usb_handle, 8);
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	pthread_create(&sthread, &attr, soundthread, NULL);
+	if (shmname && shm_ring_open(shmname)) {
+		goto exit;
+	}
+	if (evloop_init(&evl)) {
+		goto exit;
+	}
+	/* joined at exit, the shared memory ring is unmapped only after it stops writing */
+	if (pthread_create(&sthread, NULL, soundthread, NULL)) {
+		fprintf(stderr, "\nError: Cannot start the sound thread.\n");
+		goto exit;
+	}
+	sthreaded = 1;
 
-	usleep(500000);
+	ev_wait_blocks(&evl, 24, 2000);
 
+	/* the default capture setting, from this chip's mixer table if there is one */
+	if (mix_lookup()) {
+		capture_set(mix_step(mixcal.rec, 0.0));
+		capdefault = capset;
+		printf("Using the mixer table for this chip, capture setting %d (use 'y' to show it)\n", capset);
+	}
+	/* and this unit's calibration, for the system test to report against */
+	if (!cal_open(&cal) && cal.hdr->count) {
+		cal_unit_key(&cal, usb_handle, usb_dev);
+		cal.rec = (cal.havekey && !cal.weakkey) ? cal_find(&cal, cal.key) : NULL;
+		if (cal.rec) {
+			printf("Found a calibration for this unit, the system test compares with it (use 'a' to spot check)\n");
+		}
+	}
+
+	if (tracename && hidtrace_record(tracename)) {
+		goto exit;
+	}
+
+  menu:
 	tcgetattr(fileno(stdin), &t0);
 	for (;;) {
 		char str[80];
@@ -1254,6 +8336,7 @@ int main(int argc, char **argv)
 		myfreq = 0.0;
 		myfreq1 = 0.0;
 		myfreq2 = 0.0;
+		mytones = NULL;
 		printf("Menu:\r\n\n");
 		printf("For Left Channel:\n");
 		printf("1 - 1004Hz, 2 - 204Hz, 3 - 300Hz, 4 - 404Hz, 5 - 502Hz\n");
@@ -1264,6 +8347,20 @@ int main(int argc, char **argv)
 		printf("Tests....\n");
 		printf("t - test normal operation (use uppercase 'T' for verbose output)\n");
 		printf("i - test digital signals only (COR,TONE,PTT,GPIO)\n");
+		printf("g - capture GPIO timeline to VCD file (G - use interrupt reports)\n");
+		printf("s - long duration analog soak test\n");
+		printf("k - test PTT keying clicks (use uppercase 'K' for verbose output)\n");
+		printf("j - analyze audio period timing (jitter, rate, delay)\n");
+		printf("n - two-tone intermodulation test (use uppercase 'N' for verbose output)\n");
+		printf("p - search the whole band for spurs (use uppercase 'P' to list all of them)\n");
+		printf("w - gain linearity sweep over 60 dB (use uppercase 'W' for every step)\n");
+		printf("v - voice band zoom analysis (12 KHz decimated)\n");
+		printf("a - calibrate unit or spot check its cached calibration (A - force calibration)\n");
+		printf("y - show this chip's mixer step table, measuring it if needed (Y - measure again)\n");
+		printf("f - fit a voice band equalizer to the measured response\n");
+		printf("u - show USB topology and run a bus contention stress test\n");
+		printf("o - monitor receive audio while COR is active (O - use interrupt reports)\n");
+		printf("b - benchmark all attached URIs streaming at once\n");
 		printf("e - test EEPROM, E - Initialize EEPROM (User memory)\n");
 		printf("l - list EEPROM contents\n");
 		printf("d - dump all EEPROM contents\n");
@@ -1275,11 +8372,18 @@ int main(int argc, char **argv)
 		printf("Enter your selection: ");
 		fflush(stdout);
 		
-		fgets(str, sizeof(str) - 1, stdin);
+		if (!input_line(str, sizeof(str) - 1)) {
+			goto pt_exit;
+		}
+		hid_clear();
 		c = str[0];
 		if (isupper(c)) {
 			c = tolower(str[0]);
 		}
+		if ((hidtrace.mode == HIDTRACE_REPLAY) && !strchr(HIDTRACE_COMMANDS, c)) {
+			printf("Not available in HID replay, it needs the audio\n\n");
+			continue;
+		}
 		switch (c) {
 		case 'x':
 		case 'q':
@@ -1319,14 +8423,102 @@ int main(int argc, char **argv)
 		case 'i':
 			digital_test(usb_handle);
 			continue;
+		case 'g':
+			gpio_timeline(usb_handle, str[0] == 'G');
+			printf("\n");
+			continue;
 		case 't':
 		case 'T':
-			errs = digital_test(usb_handle);
-			errs += analog_test(str[0] == 'T');
-			if (!errs)
-				printf("System Tests all Passed successfully!\n");
-			else
-				printf("%d Error(s) found during test(s)!\n", errs);
+			{
+				int derrs, aerrs;
+
+				errs = system_test(usb_handle, str[0] == 'T', &derrs, &aerrs);
+				if (!errs)
+					printf("System Tests all Passed successfully!\n");
+				else
+					printf("%d Error(s) found during test(s) (%d digital, %d analog)!\n", errs, derrs, aerrs);
+			}
+			printf("\n\n");
+			continue;
+		case 'k':
+			errs = click_test(usb_handle, str[0] == 'K');
+			if (errs) {
+				printf("%d Error(s) found during test!\n", errs);
+			}
+			printf("\n\n");
+			continue;
+		case 'w':
+			errs = lin_test(str[0] == 'W');
+			if (errs) {
+				printf("%d Error(s) found during test!\n", errs);
+			}
+			printf("\n\n");
+			continue;
+		case 'p':
+			errs = spur_test(str[0] == 'P');
+			if (errs) {
+				printf("%d Error(s) found during test!\n", errs);
+			}
+			printf("\n\n");
+			continue;
+		case 'n':
+			errs = imd_test(str[0] == 'N');
+			if (errs) {
+				printf("%d Error(s) found during test!\n", errs);
+			}
+			printf("\n\n");
+			continue;
+		case 'a':
+			errs = cal_test(usb_handle, usb_dev, str[0] == 'A');
+			if (errs) {
+				printf("Calibration failed!\n");
+			}
+			printf("\n\n");
+			continue;
+		case 'y':
+			errs = mix_test(str[0] == 'Y');
+			if (errs) {
+				printf("Mixer characterization failed!\n");
+			}
+			printf("\n\n");
+			continue;
+		case 'b':
+			errs = bench_test();
+			if (errs) {
+				printf("%d problem(s) found!\n", errs);
+			}
+			printf("\n\n");
+			continue;
+		case 'o':
+			monitor_test(usb_handle, str[0] == 'O');
+			printf("\n\n");
+			continue;
+		case 'u':
+			errs = usb_topo_test();
+			if (errs) {
+				printf("%d problem(s) found!\n", errs);
+			}
+			printf("\n\n");
+			continue;
+		case 'f':
+			eq_test();
+			printf("\n\n");
+			continue;
+		case 'v':
+			zoom_test();
+			printf("\n\n");
+			continue;
+		case 'j':
+			jitter_test();
+			printf("\n\n");
+			continue;
+		case 's':
+			errs = soak_test();
+			if (!errs) {
+				printf("Soak test Passed successfully!\n");
+			} else {
+				printf("%d Error(s) found during soak!\n", errs);
+			}
 			printf("\n\n");
 			continue;
 		case 'e':
@@ -1413,7 +8605,7 @@ int main(int argc, char **argv)
 			      "Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA\n"
 			      "\n"
 			      " >>> PRESS ANY KEY TO CONTINUE <<<\n");
-			fgets(str,sizeof(str) - 1,stdin);
+			input_line(str, sizeof(str) - 1);
 			continue;
 		default:
 			continue;
@@ -1425,33 +8617,39 @@ int main(int argc, char **argv)
 			myfreq1 = myfreq;
 		}
 		
-		tcgetattr(fileno(stdin), &t);
-		cfmakeraw(&t);
-		t.c_lflag &= ~ICANON;
-		tcsetattr(fileno(stdin), TCSANOW, &t);
-		fcntl(fileno(stdin), F_SETFL, fcntl(fileno(stdin), F_GETFL) | O_NONBLOCK);
+		kbd_nowait();
+		ev_key(&evl);
+		ev_timer(&evl, 500, 1);
 		for (;;) {
-			int c = getc(stdin);
-			if (c > 0) {
+			int mask = ev_wait(&evl, -1);
+			if (mask & EV_KEY) {
+				ev_key(&evl);
 				break;
 			}
-			usleep(500000);
-			printf("Level at %.1f Hz: %.1f mV (RMS) %.1f mV (P-P)\r\n", myfreq, lev,
-				   lev * 2.828);
+			if (mask & EV_TIMER) {
+				printf("Level at %.1f Hz: %.1f mV (RMS) %.1f mV (P-P)\r\n", myfreq, lev,
+					   lev * 2.828);
+			}
 		}
-		tcgetattr(fileno(stdin), &t);
-		t.c_lflag &= ICANON;
-		tcsetattr(fileno(stdin), TCSANOW, &t);
-		fcntl(fileno(stdin), F_SETFL, fcntl(fileno(stdin), F_GETFL) & ~O_NONBLOCK);
+		ev_timer(&evl, 0, 0);
+		kbd_wait();
 	}
 	
 
 	pt_exit:	/* only run if we made it past the initilization stage */
-	pthread_join(sthread,NULL);
+	if (hidtrace.mode == HIDTRACE_REPLAY) {
+		return (hidtrace_close());
+	}
 	
   exit:
 	shutdown = 1;
-	pthread_join(sthread, NULL);
+	if (sthreaded) {
+		ev_signal(evl.wakefd);
+		pthread_join(sthread, NULL);
+	}
+	shm_ring_close();
+	cal_close(&cal);
+	hidtrace_close();
 	usb_close(usb_handle);
 	
 	return retval;